@@ -3,21 +3,65 @@
 
 #include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 
-// 3rd party header for writing png files
+#include "example.hpp"          // Include short list of convenience functions for rendering
+#include "frame-writer.hpp"     // Saves frames from a pool of threads, metadata_to_csv
+#include "metadata-log.hpp"     // Binary log of the metadata of every frame
+#include "event-capture.hpp"    // Ring of the last seconds of frames, saved on a trigger
+
+// 3rd party header for writing png files. The headers above only declare its functions, they are compiled
+// here, once: the implementation is not covered by the header's include guard.
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define _CRT_SECURE_NO_WARNINGS
 #include "stb_image_write.h"
-#include "example.hpp"          // Include short list of convenience functions for rendering
+#undef STB_IMAGE_WRITE_IMPLEMENTATION
+
+// Command line options.
+const char* usage = "Usage: RealSense-OpenCV [--continuous] [--writers N] [--queue-size N] [--policy latest|every] [--depth-format png|rvl] [--record FILE] [--metadata-log FILE] [--export-metadata FILE] [--pre-trigger SECONDS] [--post-trigger SECONDS] [--event-memory MB]";
+struct app_options
+{
+	bool continuous = false;    // Save every frame, not only the first one after auto-exposure settled.
+	std::string record;          // Record every frame to this file instead of saving pngs, see recording.hpp.
+	std::string metadata_log;    // Log the metadata of every frame to this file instead of a csv per saved frame.
+	std::string export_metadata; // Convert this metadata log to "<file>.csv" and exit.
+	bool capture_events = false; // Only save the frames around a trigger, instead of every frame.
+	event_capture_options events;
+	frame_writer_options writer;
+};
 
-// Helper function for writing metadata to disk as a csv file
-void metadata_to_csv(const rs2::frame& frm, const std::string& filename);
+// Saving an event can also be asked from another process, with SIGUSR1, or Ctrl+Break on Windows.
+#ifdef _WIN32
+const int trigger_signal = SIGBREAK;
+#else
+const int trigger_signal = SIGUSR1;
+#endif
+// Lock-free, so the signal handler may set it.
+std::atomic<bool> signal_trigger{ false };
+void on_trigger_signal(int) { signal_trigger = true; }
+
+app_options parse_options(int argc, char* argv[]);
+void print_writer_stats(const frame_writer& writer);
 
 int main(int argc, char* argv[]) try
 {
+	app_options options = parse_options(argc, argv);
+	if (!options.export_metadata.empty())
+	{
+		const std::string csv = options.export_metadata + ".csv";
+		const size_t lines = metadata_log_to_csv(options.export_metadata, csv);
+		std::cout << "Exported " << lines << " frames to " << csv << std::endl;
+		return EXIT_SUCCESS;
+	}
+
 	rs2::log_to_console(RS2_LOG_SEVERITY_ERROR);
 	// Create a simple OpenGL window for rendering:
 	window app(1280, 720, "RealSense Capture Example");
@@ -37,32 +81,96 @@ int main(int argc, char* argv[]) try
 	// Capture 30 frames to give autoexposure a chance to settle.
 	for (auto i=0; i < 30; i++) pipe.wait_for_frames();
 
+	// A recording takes every frame, the writers append them to it.
+	std::unique_ptr<recording_writer> recording;
+	if (!options.record.empty())
+	{
+		recording.reset(new recording_writer(options.record));
+		options.writer.recording = recording.get();
+		std::cout << "Recording to " << options.record << std::endl;
+	}
+
+	// Logging the metadata of a frame only costs the attributes its stream supports, every frame is logged.
+	std::unique_ptr<metadata_log> logger;
+	if (!options.metadata_log.empty())
+	{
+		logger.reset(new metadata_log(options.metadata_log));
+		options.writer.metadata = false;
+		std::cout << "Logging metadata to " << options.metadata_log << std::endl;
+	}
+
+	// Frames are colorized, encoded and written by a pool of threads, so streaming never waits for the disk.
+	frame_writer writer(options.writer);
+
 	// Wait for the next set of frames from the camera, which will be saved to the disk.
-	for (auto&& frame : pipe.wait_for_frames()) {
-		// Video frames can only be saved as pngs.
-		if (auto vf = frame.as<rs2::video_frame>()) {
-			auto stream = frame.get_profile().stream_type();
-			// Use the colorizer to get an rgb image for the depth stream.
-			if (vf.is<rs2::depth_frame>()) vf = color_map.process(frame);
-
-			// Write images to disk
-			std::stringstream png_file;
-			png_file << "rs-save-to-disk-output-" << vf.get_profile().stream_name() << ".png";
-			stbi_write_png(png_file.str().c_str(), vf.get_width(), vf.get_height(),
-				vf.get_bytes_per_pixel(), vf.get_data(), vf.get_stride_in_bytes());
-			std::cout << "Saved " << png_file.str() << std::endl;
-
-			// Record per-frame metadata 
-			std::stringstream csv_file;
-			csv_file << "rs-save-to-disk-output-" << vf.get_profile().stream_name() << "-metadata.csv";
-			metadata_to_csv(vf, csv_file.str());
+	// In continuous mode, every frame after it is saved too. Capturing events only saves the frames of events.
+	if (!options.capture_events)
+	{
+		for (auto&& frame : pipe.wait_for_frames()) {
+			if (logger)
+				logger->append(frame);
+			// Video frames are saved as pngs, depth can also be saved as is.
+			if (frame.is<rs2::video_frame>()) {
+				std::stringstream prefix;
+				prefix << "rs-save-to-disk-output-" << frame.get_profile().stream_name();
+				writer.write(frame, prefix.str());
+				const bool rvl = options.writer.depth == depth_format::rvl && frame.is<rs2::depth_frame>();
+				if (!recording)
+					std::cout << "Saving " << prefix.str() << (rvl ? ".rvl" : ".png") << std::endl;
+			}
 		}
 	}
 
+	// The last seconds of frames stay in memory until space is pressed or the signal arrives.
+	std::unique_ptr<event_capture> events;
+	if (options.capture_events)
+	{
+		events.reset(new event_capture(writer, options.events));
+		app.on_key_release = [&](int key)
+		{
+			if (key == 32) // Space
+				events->trigger();
+		};
+		std::signal(trigger_signal, on_trigger_signal);
+		std::cout << "Keeping the last " << options.events.pre_seconds << " s of frames, press space to save them" << std::endl;
+	}
+
+	auto last_report = std::chrono::steady_clock::now();
 	while (app) // Application still alive?
 	{
-		rs2::frameset data = pipe.wait_for_frames().    // Wait for next set of frames from the camera
-			apply_filter(printer).     // Print each enabled stream frame rate
+		rs2::frameset data = pipe.wait_for_frames();    // Wait for next set of frames from the camera
+
+		if (logger)
+			for (auto&& frame : data)
+				logger->append(frame);
+
+		if (events)
+		{
+			if (signal_trigger.exchange(false))
+				events->trigger();
+			events->add(data);
+		}
+		else if (options.continuous)
+		{
+			// Hand the raw frames over before colorizing for display, the writers colorize depth on their own.
+			for (auto&& frame : data)
+			{
+				if (frame.is<rs2::video_frame>())
+				{
+					std::stringstream prefix;
+					prefix << "rs-save-to-disk-output-" << frame.get_profile().stream_name() << "-" << frame.get_frame_number();
+					writer.write(frame, prefix.str());
+				}
+			}
+			// Report the backlog of the writers every few seconds.
+			if (std::chrono::steady_clock::now() - last_report > std::chrono::seconds(5))
+			{
+				print_writer_stats(writer);
+				last_report = std::chrono::steady_clock::now();
+			}
+		}
+
+		data = data.apply_filter(printer).     // Print each enabled stream frame rate
 			apply_filter(color_map);   // Find and colorize the depth data
 
 // The show method, when applied on frameset, break it to frames and upload each frame into a gl textures
@@ -70,6 +178,25 @@ int main(int argc, char* argv[]) try
 		app.show(data);
 	}
 
+	// Hand the events over, finish writing what is queued, then the index of the recording.
+	if (events)
+	{
+		events->close();
+		event_capture_stats stats = events->stats();
+		std::cout << "Events: " << stats.events << " saved, " << stats.flushed << " frames, " << stats.dropped << " framesets dropped" << std::endl;
+	}
+	writer.close();
+	print_writer_stats(writer);
+	if (recording)
+	{
+		recording->close();
+		std::cout << "Recorded " << recording->frames() << " frames, " << recording->bytes() << " bytes" << std::endl;
+	}
+	if (logger)
+	{
+		logger->close();
+		std::cout << "Logged the metadata of " << logger->rows() << " frames" << std::endl;
+	}
 	return EXIT_SUCCESS;
 }
 catch (const rs2::error& e)
@@ -83,21 +210,63 @@ catch (const std::exception& e)
 	return EXIT_FAILURE;
 }
 
-void metadata_to_csv(const rs2::frame& frm, const std::string& filename)
+app_options parse_options(int argc, char* argv[])
 {
-	std::ofstream csv;
-
-	csv.open(filename);
+	app_options options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--continuous")
+		{
+			options.continuous = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			throw std::invalid_argument("Missing value for " + arg + "\n" + usage);
+		std::string value = argv[++i];
 
-	std::cout << "Writting metadata to " << filename << std::endl;
-	csv << "Stream," << rs2_stream_to_string(frm.get_profile().stream_type()) << "\nMetadata Attribute,Value\n";
-	// Record all the available metadata attributes.
-	for (size_t i = 0; i < RS2_FRAME_METADATA_COUNT; i ++ ) {
-		if (frm.supports_frame_metadata((rs2_frame_metadata_value)i)) {
-			csv << rs2_frame_metadata_to_string((rs2_frame_metadata_value)i) << ","
-				<< frm.get_frame_metadata((rs2_frame_metadata_value)i) << "\n";
+		if (arg == "--writers")
+			options.writer.writers = std::stoi(value);
+		else if (arg == "--queue-size")
+			options.writer.queue_size = std::max(1, std::stoi(value));
+		else if (arg == "--policy")
+			options.writer.policy = parse_queue_policy(value);
+		else if (arg == "--depth-format")
+			options.writer.depth = parse_depth_format(value);
+		else if (arg == "--metadata-log")
+			options.metadata_log = value;
+		else if (arg == "--export-metadata")
+			options.export_metadata = value;
+		else if (arg == "--pre-trigger")
+		{
+			options.events.pre_seconds = std::max(0.0, std::stod(value));
+			options.capture_events = true;
+		}
+		else if (arg == "--post-trigger")
+		{
+			options.events.post_seconds = std::max(0.0, std::stod(value));
+			options.capture_events = true;
 		}
+		else if (arg == "--event-memory")
+		{
+			options.events.memory_bytes = static_cast<size_t>(std::max(1, std::stoi(value))) << 20;
+			options.capture_events = true;
+		}
+		else if (arg == "--record")
+		{
+			options.record = value;
+			options.continuous = true;
+		}
+		else
+			throw std::invalid_argument("Unknown option " + arg + "\n" + usage);
 	}
+	return options;
+}
 
-	csv.close();
+void print_writer_stats(const frame_writer& writer)
+{
+	frame_writer_stats stats = writer.stats();
+	std::cout << "Writer: " << stats.written << " written, " << stats.failed << " failed, " << stats.dropped << " dropped, "
+		<< stats.pending << " pending, at most " << stats.high_water << "/" << stats.capacity << " queued, "
+		<< stats.write_ms << " ms per frame" << std::endl;
 }
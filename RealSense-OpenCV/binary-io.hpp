@@ -0,0 +1,53 @@
+// binary-io.hpp : Little-endian fields of the files written by this example.
+//
+// Values are appended to a byte buffer as they are in memory, and read back with a check that they fit in what
+// is left of the input, so a truncated or corrupt file fails to parse instead of reading past its end.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace binary_io {
+    template <class T>
+    void put( std::vector<uint8_t>& out, const T& value ) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+        out.insert( out.end(), p, p + sizeof( T ) );
+    }
+
+    template <class T>
+    bool get( const uint8_t*& p, const uint8_t* end, T& value ) {
+        if ( static_cast<size_t>(end - p) < sizeof( T ) )
+            return false;
+        std::memcpy( &value, p, sizeof( T ) );
+        p += sizeof( T );
+        return true;
+    }
+
+    inline void put_intrinsics( std::vector<uint8_t>& out, const rs2_intrinsics& intrinsics ) {
+        put( out, static_cast<int32_t>(intrinsics.width) );
+        put( out, static_cast<int32_t>(intrinsics.height) );
+        put( out, intrinsics.ppx );
+        put( out, intrinsics.ppy );
+        put( out, intrinsics.fx );
+        put( out, intrinsics.fy );
+        put( out, static_cast<int32_t>(intrinsics.model) );
+        for ( float c : intrinsics.coeffs )
+            put( out, c );
+    }
+
+    inline bool get_intrinsics( const uint8_t*& p, const uint8_t* end, rs2_intrinsics& intrinsics ) {
+        int32_t width = 0, height = 0, model = 0;
+        bool ok = get( p, end, width ) && get( p, end, height ) && get( p, end, intrinsics.ppx ) && get( p, end, intrinsics.ppy )
+            && get( p, end, intrinsics.fx ) && get( p, end, intrinsics.fy ) && get( p, end, model );
+        for ( float& c : intrinsics.coeffs )
+            ok = ok && get( p, end, c );
+        intrinsics.width = width;
+        intrinsics.height = height;
+        intrinsics.model = static_cast<rs2_distortion>(model);
+        return ok;
+    }
+}
@@ -0,0 +1,144 @@
+// bounded-queue.hpp : Fixed capacity, thread-safe queue connecting the stages of the frame pipeline.
+//
+// Unlike rs2::frame_queue, which always drops the oldest frame when full, the behavior on a full queue is
+// selectable: either keep only the most recent items, or block the producer until a consumer catches up.
+// Storage is a ring allocated once, so moving frames between threads never allocates.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class queue_policy {
+    latest_frame_wins,      // A full queue drops its oldest item, producers never wait.
+    process_every_frame     // A full queue blocks producers, nothing is ever dropped.
+};
+
+inline queue_policy parse_queue_policy( const std::string& name ) {
+    if ( name == "latest" )
+        return queue_policy::latest_frame_wins;
+    if ( name == "every" )
+        return queue_policy::process_every_frame;
+    throw std::invalid_argument( "Unknown queue policy '" + name + "', expected 'latest' or 'every'" );
+}
+
+template <class T>
+class bounded_queue {
+public:
+    bounded_queue( size_t capacity, queue_policy policy )
+        : _items( capacity ), _policy( policy ) {
+        if ( capacity == 0 )
+            throw std::invalid_argument( "A bounded queue needs room for at least one item" );
+    }
+
+    bounded_queue( const bounded_queue& ) = delete;
+    bounded_queue& operator=( const bounded_queue& ) = delete;
+
+    // Returns false if the queue was closed, in which case the item is discarded.
+    bool push( T item ) {
+        std::unique_lock<std::mutex> lock( _mutex );
+        if ( _policy == queue_policy::process_every_frame )
+            _not_full.wait( lock, [this] { return _closed || _count < _items.size(); } );
+        if ( _closed )
+            return false;
+
+        if ( _count == _items.size() ) {
+            // Only reachable with latest_frame_wins: make room by forgetting the oldest item.
+            _items[_head] = T();
+            _head = (_head + 1) % _items.size();
+            _count--;
+            _dropped++;
+        }
+        _items[(_head + _count) % _items.size()] = std::move( item );
+        _count++;
+        _high_water = std::max( _high_water, _count );
+        lock.unlock();
+        _not_empty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available. Returns false once the queue is closed and drained.
+    bool pop( T& item ) {
+        std::unique_lock<std::mutex> lock( _mutex );
+        _not_empty.wait( lock, [this] { return _closed || _count > 0; } );
+        return take( item, lock );
+    }
+
+    // Same as pop(), but gives up after timeout. Returns false on timeout too.
+    template <class Rep, class Period>
+    bool pop_for( T& item, const std::chrono::duration<Rep, Period>& timeout ) {
+        std::unique_lock<std::mutex> lock( _mutex );
+        _not_empty.wait_for( lock, timeout, [this] { return _closed || _count > 0; } );
+        return take( item, lock );
+    }
+
+    bool try_pop( T& item ) {
+        std::unique_lock<std::mutex> lock( _mutex );
+        return take( item, lock );
+    }
+
+    // Wakes up every waiting producer and consumer. Items already queued can still be popped.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            _closed = true;
+        }
+        _not_empty.notify_all();
+        _not_full.notify_all();
+    }
+
+    bool closed() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _closed;
+    }
+
+    // Number of items discarded because the queue was full.
+    size_t dropped() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _dropped;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _count;
+    }
+
+    size_t capacity() const { return _items.size(); }
+
+    // Most items ever queued at once, how close producers came to dropping or blocking.
+    size_t high_water() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _high_water;
+    }
+
+private:
+    bool take( T& item, std::unique_lock<std::mutex>& lock ) {
+        if ( _count == 0 )
+            return false;
+        item = std::move( _items[_head] );
+        // Release the slot right away, queued frames hold on to SDK memory.
+        _items[_head] = T();
+        _head = (_head + 1) % _items.size();
+        _count--;
+        lock.unlock();
+        _not_full.notify_one();
+        return true;
+    }
+
+    std::vector<T> _items;
+    size_t _head = 0;
+    size_t _count = 0;
+    size_t _dropped = 0;
+    size_t _high_water = 0;
+    bool _closed = false;
+    queue_policy _policy;
+    mutable std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+};
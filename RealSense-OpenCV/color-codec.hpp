@@ -0,0 +1,201 @@
+// color-codec.hpp : Lossless compression of frames with 8-bit channels (RGB8, BGR8, RGBA8, BGRA8, Y8).
+//
+// Every byte is predicted from the same channel of its neighbors with the median edge detector of LOCO-I: the
+// left, above and above-left values, the left one alone on the first row of a band and the one above alone at
+// the start of a row. The prediction error, taken modulo 256 as a signed byte and zigzagged, is written with the
+// nibble codes of the RVL depth codec: errors within -4..3 take 4 bits, within -32..31 8 bits, others 12 bits.
+// Camera images mostly take a half to two thirds of their size; noise does not compress and can grow by half,
+// so callers keep the raw pixels when the coded frame is not smaller.
+//
+// Frames are cut in bands of rows coded independently and stored as rvl_codec stores its bands, so they are
+// encoded and decoded in parallel.
+#pragma once
+
+#include "rvl-codec.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// LOCO-I prediction from the left (a), above (b) and above-left (c) values: the smaller of a and b at an edge
+// above c, the larger at an edge below it, and the plane through the three otherwise. That is the plane clamped
+// between a and b. The branches of std::min and std::max are taken at random on images, so they are replaced by
+// masks: d >> 31 is all ones when d is negative.
+inline int median_edge_prediction( int a, int b, int c ) {
+    const int d = a - b;
+    const int low = b + (d & (d >> 31));
+    const int high = a - (d & (d >> 31));
+    const int plane = a + b - c;
+    const int above_low = plane - low;
+    const int clamped_low = low + (above_low & ~(above_low >> 31));
+    const int below_high = clamped_low - high;
+    return high + (below_high & (below_high >> 31));
+}
+
+// The nibble codes of the 256 zigzagged errors, and the other way around for every 12 bits of input, so a byte
+// takes a lookup either way instead of the general code of nibble_writer and nibble_reader.
+struct color_code_table {
+    uint16_t code[256];         // Nibbles in the low 12 bits, their count above.
+    uint16_t value[4096];       // Error in the low 8 bits, nibbles of its code above, 0 for no valid code.
+
+    color_code_table() {
+        for ( uint32_t v = 0; v < 256; v++ ) {
+            const uint32_t nibbles = v < 8 ? 1 : v < 64 ? 2 : 3;
+            uint32_t bits = 0;
+            for ( uint32_t i = 0; i < nibbles; i++ )
+                bits |= (((v >> (3 * i)) & 07) | (i + 1 < nibbles ? 010 : 0)) << (4 * i);
+            code[v] = static_cast<uint16_t>(bits | (nibbles << 12));
+        }
+        for ( uint32_t x = 0; x < 4096; x++ ) {
+            value[x] = 0;
+            uint32_t v = 0;
+            for ( uint32_t i = 0; i < 3; i++ ) {
+                const uint32_t nibble = (x >> (4 * i)) & 0xF;
+                v |= (nibble & 07) << (3 * i);
+                if ( !(nibble & 010) ) {
+                    if ( v < 256 )
+                        value[x] = static_cast<uint16_t>(v | ((i + 1) << 8));
+                    break;
+                }
+            }
+        }
+    }
+};
+
+inline const color_code_table& color_codes() {
+    static const color_code_table table;
+    return table;
+}
+
+// Room color_encode() needs for count bytes, at most 3 nibbles each, and the last partial word.
+inline size_t color_max_words( size_t count ) {
+    return (3 * count + 7) / 8 + 1;
+}
+
+// Encodes rows of row_bytes bytes, stride bytes apart, into out with room for color_max_words() words. channels is
+// the distance in bytes to the same channel of the next pixel. Returns the number of words written.
+inline size_t color_encode( const uint8_t* pixels, size_t row_bytes, int rows, int channels, size_t stride, uint32_t* out ) {
+    const color_code_table& table = color_codes();
+    uint32_t* begin = out;
+    uint64_t buffer = 0;
+    int bits = 0;
+    auto put = [&]( int value, int predicted ) {
+        const uint32_t error = static_cast<uint8_t>(value - predicted);
+        // Zigzag of the error as a signed byte.
+        const uint32_t code = table.code[((error << 1) ^ (0u - (error >> 7))) & 0xFF];
+        buffer |= static_cast<uint64_t>(code & 0xFFF) << bits;
+        bits += 4 * (code >> 12);
+        if ( bits >= 32 ) {
+            *out++ = static_cast<uint32_t>(buffer);
+            buffer >>= 32;
+            bits -= 32;
+        }
+    };
+    const size_t first = std::min( static_cast<size_t>(channels), row_bytes );
+    for ( size_t i = 0; i < first; i++ )
+        put( pixels[i], 0 );
+    for ( size_t i = first; i < row_bytes; i++ )
+        put( pixels[i], pixels[i - channels] );
+    for ( int y = 1; y < rows; y++ ) {
+        const uint8_t* row = pixels + stride * y;
+        const uint8_t* above = row - stride;
+        for ( size_t i = 0; i < first; i++ )
+            put( row[i], above[i] );
+        for ( size_t i = first; i < row_bytes; i++ )
+            put( row[i], median_edge_prediction( row[i - channels], above[i], above[i - channels] ) );
+    }
+    if ( bits )
+        *out++ = static_cast<uint32_t>(buffer);
+    return static_cast<size_t>(out - begin);
+}
+
+// Decodes exactly rows tightly packed rows. Returns false if the stream is truncated or holds a code that is
+// not an error of color_encode().
+inline bool color_decode( const uint32_t* in, size_t words, uint8_t* pixels, size_t row_bytes, int rows, int channels ) {
+    const color_code_table& table = color_codes();
+    const uint32_t* end = in + words;
+    uint64_t buffer = 0;
+    int bits = 0;
+    bool ok = true;
+    auto get = [&]( int predicted ) {
+        if ( bits < 12 && in != end ) {
+            buffer |= static_cast<uint64_t>(*in++) << bits;
+            bits += 32;
+        }
+        const uint32_t entry = table.value[buffer & 0xFFF];
+        const int length = 4 * static_cast<int>(entry >> 8);
+        // No valid code, or one running past the end of the input.
+        ok &= length != 0 && length <= bits;
+        buffer >>= length;
+        bits -= length;
+        const uint32_t zigzag = entry & 0xFF;
+        return static_cast<uint8_t>(predicted + static_cast<int>((zigzag >> 1) ^ (0u - (zigzag & 1))));
+    };
+    const size_t first = std::min( static_cast<size_t>(channels), row_bytes );
+    for ( size_t i = 0; i < first; i++ )
+        pixels[i] = get( 0 );
+    for ( size_t i = first; i < row_bytes; i++ )
+        pixels[i] = get( pixels[i - channels] );
+    for ( int y = 1; y < rows && ok; y++ ) {
+        uint8_t* row = pixels + row_bytes * y;
+        const uint8_t* above = row - row_bytes;
+        for ( size_t i = 0; i < first; i++ )
+            row[i] = get( above[i] );
+        for ( size_t i = first; i < row_bytes; i++ )
+            row[i] = get( median_edge_prediction( row[i - channels], above[i], above[i - channels] ) );
+    }
+    return ok;
+}
+
+// Frame coded in bands of rows. The scratch buffers are kept between frames, one codec per thread.
+class color_codec {
+public:
+    static const int band_rows = 32;
+
+    // Appends the coded frame to out, in the layout of rvl_codec. stride is in bytes, channels is the number of
+    // bytes per pixel. Bands are coded on several threads if parallel is set.
+    void encode( const uint8_t* pixels, int width, int height, int channels, int stride, std::vector<uint8_t>& out, bool parallel = true ) {
+        const int bands = band_count( height );
+        const size_t row_bytes = static_cast<size_t>(width) * channels;
+        _bands.resize( bands );
+        _sizes.resize( bands );
+
+#pragma omp parallel for schedule(dynamic, 1) if(parallel)
+        for ( int band = 0; band < bands; band++ ) {
+            const int y_begin = band * band_rows;
+            const int rows = std::min( height, y_begin + band_rows ) - y_begin;
+            std::vector<uint32_t>& words = _bands[band];
+            words.resize( color_max_words( row_bytes * rows ) );
+            _sizes[band] = static_cast<uint32_t>(color_encode( pixels + static_cast<size_t>(y_begin) * stride, row_bytes, rows, channels, stride, words.data() ));
+        }
+        put_bands( _bands, _sizes, out );
+    }
+
+    // Decodes what encode() wrote into a tightly packed width x height frame. Returns false on corrupt data.
+    bool decode( const uint8_t* data, size_t size, int width, int height, int channels, uint8_t* pixels, bool parallel = true ) {
+        const int bands = band_count( height );
+        if ( !get_bands( data, size, bands, _sizes, _offsets, _words ) )
+            return false;
+        const size_t row_bytes = static_cast<size_t>(width) * channels;
+
+        int failed = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:failed) if(parallel)
+        for ( int band = 0; band < bands; band++ ) {
+            const int y_begin = band * band_rows;
+            const int rows = std::min( height, y_begin + band_rows ) - y_begin;
+            if ( !color_decode( _words.data() + _offsets[band], _sizes[band], pixels + row_bytes * y_begin, row_bytes, rows, channels ) )
+                failed++;
+        }
+        return failed == 0;
+    }
+
+private:
+    static int band_count( int height ) {
+        return (height + band_rows - 1) / band_rows;
+    }
+
+    std::vector<std::vector<uint32_t>> _bands;
+    std::vector<uint32_t> _sizes;
+    std::vector<size_t> _offsets;
+    std::vector<uint32_t> _words;
+};
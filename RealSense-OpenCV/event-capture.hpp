@@ -0,0 +1,200 @@
+// event-capture.hpp : Keeps the last seconds of frames in memory, so an event is saved with what led to it.
+//
+// The capture loop adds every frameset to a ring of frame references: frames are kept out of the SDK's pool but
+// never copied, and the oldest are let go once they are older than the pre-trigger window or the ring is over its
+// memory budget. A trigger hands the ring, then the framesets of the post-trigger window, to a flush thread that
+// passes them to the frame writer, so a full writer queue blocks the flush thread and never the capture loop.
+// Frames waiting to be flushed count against the same budget: when the writers fall that far behind, frames of
+// the event are dropped instead of memory growing.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include "frame-writer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct event_capture_options {
+    double pre_seconds = 5;             // Saved from before the trigger.
+    double post_seconds = 5;            // Saved from after the trigger, a trigger in this window extends it.
+    size_t memory_bytes = size_t( 1 ) << 30;    // Frames in the ring and waiting to be flushed, together.
+};
+
+struct event_capture_stats {
+    size_t events = 0;
+    size_t buffered = 0;                // Framesets in the ring.
+    size_t buffered_bytes = 0;
+    size_t pending = 0;                 // Framesets waiting to be flushed.
+    size_t flushed = 0;                 // Frames handed to the writer.
+    size_t dropped = 0;                 // Framesets of an event left out to stay within memory_bytes.
+};
+
+class event_capture {
+public:
+    event_capture( frame_writer& writer, event_capture_options options = event_capture_options() )
+        : _writer( writer ), _options( options ) {
+        _thread = std::thread( [this] { flush(); } );
+    }
+
+    event_capture( const event_capture& ) = delete;
+    event_capture& operator=( const event_capture& ) = delete;
+
+    ~event_capture() {
+        close();
+    }
+
+    // Only sets a lock-free flag, which the next add() acts on, so it can be called from any thread.
+    void trigger() {
+        _triggered = true;
+    }
+
+    // Called by the capture loop with every frameset. Video frames are kept, the others are not saved anyway.
+    void add( const rs2::frameset& frames ) {
+        const auto now = std::chrono::steady_clock::now();
+        buffered_frames item;
+        item.time = now;
+        for ( auto&& frame : frames ) {
+            if ( auto vf = frame.as<rs2::video_frame>() ) {
+                vf.keep();
+                item.bytes += vf.get_data_size();
+                item.frames.push_back( vf );
+            }
+        }
+        const bool triggered = _triggered.exchange( false );
+
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            if ( _closed )
+                return;
+            if ( triggered ) {
+                // The ring is empty while an event is being saved, its frames went with the first trigger.
+                if ( !_saving )
+                    _events++;
+                for ( auto& buffered : _ring ) {
+                    buffered.event = _events;
+                    _pending.push_back( std::move( buffered ) );
+                }
+                _pending_bytes += _ring_bytes;
+                _ring.clear();
+                _ring_bytes = 0;
+                _saving = true;
+                _post_end = now + seconds( _options.post_seconds );
+            }
+
+            if ( _saving && now <= _post_end ) {
+                if ( _ring_bytes + _pending_bytes + item.bytes <= _options.memory_bytes ) {
+                    item.event = _events;
+                    _pending_bytes += item.bytes;
+                    _pending.push_back( std::move( item ) );
+                }
+                else
+                    _dropped++;
+            }
+            else {
+                _saving = false;
+                _ring_bytes += item.bytes;
+                _ring.push_back( std::move( item ) );
+            }
+
+            // Frames let go here return to the SDK.
+            const auto oldest = now - seconds( _options.pre_seconds );
+            while ( !_ring.empty() && (_ring.front().time < oldest || _ring_bytes + _pending_bytes > _options.memory_bytes) ) {
+                _ring_bytes -= _ring.front().bytes;
+                _ring.pop_front();
+            }
+        }
+        _ready.notify_one();
+    }
+
+    // Hands what is waiting to the writer, then stops the flush thread. The ring is let go, it has no event.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            if ( _closed )
+                return;
+            _closed = true;
+            _ring.clear();
+            _ring_bytes = 0;
+        }
+        _ready.notify_one();
+        if ( _thread.joinable() )
+            _thread.join();
+    }
+
+    event_capture_stats stats() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        event_capture_stats stats;
+        stats.events = _events;
+        stats.buffered = _ring.size();
+        stats.buffered_bytes = _ring_bytes;
+        stats.pending = _pending.size();
+        stats.flushed = _flushed;
+        stats.dropped = _dropped;
+        return stats;
+    }
+
+private:
+    struct buffered_frames {
+        std::chrono::steady_clock::time_point time;
+        std::vector<rs2::frame> frames;
+        size_t bytes = 0;
+        size_t event = 0;
+    };
+
+    static std::chrono::steady_clock::duration seconds( double value ) {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( value ) );
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock( _mutex );
+        while ( true ) {
+            _ready.wait( lock, [this] { return _closed || !_pending.empty(); } );
+            if ( _pending.empty() )
+                return;
+            buffered_frames item = std::move( _pending.front() );
+            _pending.pop_front();
+
+            // The writer may block on a full queue, the capture loop must not wait for it.
+            lock.unlock();
+            size_t written = 0;
+            for ( auto& frame : item.frames ) {
+                std::stringstream prefix;
+                prefix << "rs-event-" << item.event << "-" << frame.get_profile().stream_name() << "-" << frame.get_frame_number();
+                if ( _writer.write( frame, prefix.str() ) )
+                    written++;
+            }
+            item.frames.clear();
+            lock.lock();
+
+            _pending_bytes -= item.bytes;
+            _flushed += written;
+        }
+    }
+
+    frame_writer& _writer;
+    event_capture_options _options;
+    std::atomic<bool> _triggered{ false };
+
+    mutable std::mutex _mutex;
+    std::condition_variable _ready;
+    bool _closed = false;
+    std::deque<buffered_frames> _ring;
+    size_t _ring_bytes = 0;
+    std::deque<buffered_frames> _pending;
+    size_t _pending_bytes = 0;
+    bool _saving = false;                   // In the post-trigger window of an event.
+    std::chrono::steady_clock::time_point _post_end;
+    size_t _events = 0;
+    size_t _flushed = 0;
+    size_t _dropped = 0;
+    std::thread _thread;
+};
@@ -0,0 +1,180 @@
+// frame-writer.hpp : Pool of threads saving frames to disk while the camera keeps streaming.
+//
+// Frames are queued by reference: the SDK frame stays alive through its reference count and is never copied.
+// Writer threads colorize depth, encode the PNGs and write the metadata in parallel, or append the frames to a
+// recording. The queue in front of them is bounded, a full queue either drops its oldest frame or blocks the
+// capture loop until a writer catches up, and the statistics tell how close the writers came to that.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include "bounded-queue.hpp"
+#include "recording.hpp"
+#include "rvl-codec.hpp"
+#include "stb_image_write.h"     // Declarations only, RealSense-OpenCV.cpp compiles the implementation.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Writes every available metadata attribute of a frame to a csv file.
+inline bool metadata_to_csv( const rs2::frame& frm, const std::string& filename ) {
+    std::ofstream csv( filename );
+    csv << "Stream," << rs2_stream_to_string( frm.get_profile().stream_type() ) << "\nMetadata Attribute,Value\n";
+    for ( size_t i = 0; i < RS2_FRAME_METADATA_COUNT; i++ ) {
+        if ( frm.supports_frame_metadata( (rs2_frame_metadata_value)i ) ) {
+            csv << rs2_frame_metadata_to_string( (rs2_frame_metadata_value)i ) << ","
+                << frm.get_frame_metadata( (rs2_frame_metadata_value)i ) << "\n";
+        }
+    }
+    return static_cast<bool>(csv);
+}
+
+enum class depth_format {
+    colorized_png,      // What the depth looks like, 8 bits per channel.
+    rvl                 // The depth itself, losslessly compressed, see rvl-codec.hpp.
+};
+
+inline depth_format parse_depth_format( const std::string& name ) {
+    if ( name == "png" )
+        return depth_format::colorized_png;
+    if ( name == "rvl" )
+        return depth_format::rvl;
+    throw std::invalid_argument( "Unknown depth format '" + name + "', expected 'png' or 'rvl'" );
+}
+
+struct frame_writer_options {
+    int writers = 0;                // 0 picks a count from the number of cores.
+    size_t queue_size = 60;         // One second of depth and color at 30 FPS.
+    queue_policy policy = queue_policy::process_every_frame;
+    bool metadata = true;           // Also write "<prefix>-metadata.csv" next to every image.
+    depth_format depth = depth_format::colorized_png;
+    recording_writer* recording = nullptr;     // Append every frame to it instead of writing files.
+};
+
+struct frame_writer_stats {
+    size_t queued = 0;
+    size_t written = 0;
+    size_t failed = 0;              // Frames that could not be encoded or written.
+    size_t dropped = 0;             // Only with latest_frame_wins.
+    size_t pending = 0;             // Queued, not written yet.
+    size_t high_water = 0;          // Most frames queued at once, out of capacity.
+    size_t capacity = 0;
+    double write_ms = 0;            // Average time a writer spends on a frame.
+};
+
+class frame_writer {
+public:
+    explicit frame_writer( frame_writer_options options = frame_writer_options() )
+        : _options( options ), _jobs( std::max<size_t>( 1, options.queue_size ), options.policy ) {
+        const int cores = static_cast<int>(std::max( 1u, std::thread::hardware_concurrency() ));
+        // Leave a core to the capture loop.
+        const int writers = _options.writers > 0 ? _options.writers : std::max( 1, cores - 1 );
+        for ( int i = 0; i < writers; i++ )
+            _threads.emplace_back( [this] { run(); } );
+    }
+
+    frame_writer( const frame_writer& ) = delete;
+    frame_writer& operator=( const frame_writer& ) = delete;
+
+    ~frame_writer() {
+        close();
+    }
+
+    // Queues a video frame to be saved as "<path_prefix>.png", depth is colorized first unless it is saved as
+    // "<path_prefix>.rvl". Blocks while the queue is full with process_every_frame. Returns false once closed.
+    bool write( rs2::frame frame, std::string path_prefix ) {
+        // Kept frames are released from the SDK's frame pool, so queued frames do not starve the camera.
+        frame.keep();
+        if ( !_jobs.push( job{ std::move( frame ), std::move( path_prefix ) } ) )
+            return false;
+        _queued++;
+        return true;
+    }
+
+    // Writes whatever is already queued, then stops the writers.
+    void close() {
+        _jobs.close();
+        for ( auto& thread : _threads )
+            if ( thread.joinable() )
+                thread.join();
+    }
+
+    frame_writer_stats stats() const {
+        frame_writer_stats stats;
+        stats.queued = _queued;
+        stats.written = _written;
+        stats.failed = _failed;
+        stats.dropped = _jobs.dropped();
+        stats.pending = _jobs.size();
+        stats.high_water = _jobs.high_water();
+        stats.capacity = _jobs.capacity();
+        const size_t done = stats.written + stats.failed;
+        stats.write_ms = done ? static_cast<double>(_write_us) / 1000.0 / done : 0.0;
+        return stats;
+    }
+
+private:
+    struct job {
+        rs2::frame frame;
+        std::string path_prefix;
+    };
+
+    void run() {
+        // Processing blocks are not meant to be called from several threads at once, every writer has its own.
+        rs2::colorizer color_map;
+        rvl_codec codec;
+        std::vector<uint8_t> rvl_buffer;
+        recording_scratch recording_buffers;
+        job item;
+        while ( _jobs.pop( item ) ) {
+            const auto start = std::chrono::steady_clock::now();
+            bool ok = false;
+            // A frame that fails, colorizing it or appending it to the recording, is counted and the writer
+            // goes on with the next one.
+            try {
+                if ( _options.recording ) {
+                    ok = _options.recording->write( item.frame, recording_buffers );
+                }
+                else if ( _options.depth == depth_format::rvl && item.frame.is<rs2::depth_frame>() ) {
+                    // The pool already writes several frames at once, the bands of one frame are coded in turn.
+                    ok = rvl_write_file( item.path_prefix + ".rvl", item.frame.as<rs2::depth_frame>(), codec, rvl_buffer, false );
+                    if ( ok && _options.metadata )
+                        ok = metadata_to_csv( item.frame, item.path_prefix + "-metadata.csv" );
+                }
+                else if ( auto vf = item.frame.as<rs2::video_frame>() ) {
+                    if ( vf.is<rs2::depth_frame>() )
+                        vf = color_map.process( vf );
+                    const std::string png_file = item.path_prefix + ".png";
+                    ok = stbi_write_png( png_file.c_str(), vf.get_width(), vf.get_height(),
+                                         vf.get_bytes_per_pixel(), vf.get_data(), vf.get_stride_in_bytes() ) != 0;
+                    if ( ok && _options.metadata )
+                        ok = metadata_to_csv( item.frame, item.path_prefix + "-metadata.csv" );
+                }
+            }
+            catch ( const std::exception& ) {
+                ok = false;
+            }
+            // Let go of the SDK frame before waiting for the next one.
+            item = job();
+
+            (ok ? _written : _failed)++;
+            _write_us += std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+        }
+    }
+
+    frame_writer_options _options;
+    bounded_queue<job> _jobs;
+    std::vector<std::thread> _threads;
+    std::atomic<size_t> _queued{ 0 };
+    std::atomic<size_t> _written{ 0 };
+    std::atomic<size_t> _failed{ 0 };
+    std::atomic<long long> _write_us{ 0 };
+};
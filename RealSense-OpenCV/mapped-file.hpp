@@ -0,0 +1,109 @@
+// mapped-file.hpp : Read-only memory mapping of a whole file.
+//
+// Pages are only read from disk when they are touched, so seeking in a recording of several hours costs
+// what the index and the frames actually looked at cost, not the size of the file.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class mapped_file {
+public:
+    explicit mapped_file( const std::string& filename ) {
+#ifdef _WIN32
+        _file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if ( _file == INVALID_HANDLE_VALUE )
+            throw std::runtime_error( "Can not open " + filename );
+        LARGE_INTEGER size;
+        if ( !GetFileSizeEx( _file, &size ) ) {
+            close();
+            throw std::runtime_error( "Can not get the size of " + filename );
+        }
+        _size = static_cast<size_t>(size.QuadPart);
+        if ( _size == 0 )
+            return;
+        _mapping = CreateFileMappingA( _file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if ( _mapping )
+            _data = static_cast<const uint8_t*>(MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 ));
+        if ( !_data ) {
+            close();
+            throw std::runtime_error( "Can not map " + filename );
+        }
+#else
+        _file = ::open( filename.c_str(), O_RDONLY );
+        if ( _file < 0 )
+            throw std::runtime_error( "Can not open " + filename );
+        struct stat status;
+        if ( ::fstat( _file, &status ) != 0 ) {
+            close();
+            throw std::runtime_error( "Can not get the size of " + filename );
+        }
+        _size = static_cast<size_t>(status.st_size);
+        if ( _size == 0 )
+            return;
+        void* data = ::mmap( nullptr, _size, PROT_READ, MAP_SHARED, _file, 0 );
+        if ( data == MAP_FAILED ) {
+            close();
+            throw std::runtime_error( "Can not map " + filename );
+        }
+        _data = static_cast<const uint8_t*>(data);
+#endif
+    }
+
+    mapped_file( const mapped_file& ) = delete;
+    mapped_file& operator=( const mapped_file& ) = delete;
+
+    ~mapped_file() {
+        close();
+    }
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    void close() {
+#ifdef _WIN32
+        if ( _data )
+            UnmapViewOfFile( _data );
+        if ( _mapping )
+            CloseHandle( _mapping );
+        if ( _file != INVALID_HANDLE_VALUE )
+            CloseHandle( _file );
+        _mapping = nullptr;
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if ( _data )
+            ::munmap( const_cast<uint8_t*>(_data), _size );
+        if ( _file >= 0 )
+            ::close( _file );
+        _file = -1;
+#endif
+        _data = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#else
+    int _file = -1;
+#endif
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+};
@@ -0,0 +1,363 @@
+// metadata-log.hpp : Binary log of the metadata of every frame, exported to csv when someone needs to read it.
+//
+// Probing all RS2_FRAME_METADATA_COUNT attributes and formatting text for every frame costs more than the frame
+// is worth, so the attributes a stream profile supports are found once, on its first frame. After that a frame
+// is a fixed-width row: frame number, timestamp, a bit per column telling if the value is there, and one 64-bit
+// value per column. Rows are kept per stream and written a block at a time, column after column, so the disk
+// sees a few large writes and a column of a block is one array.
+//
+// The file is a header followed by blocks: a stream block describes a stream and its columns before its first
+// rows block. Blocks are only appended, a log cut short still reads up to its last complete block. All fields
+// are little-endian.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include "binary-io.hpp"
+#include "mapped-file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const char metadata_log_magic[8] = { 'R', 'S', 'M', 'E', 'T', 'A', 'L', 'G' };
+const char metadata_log_stream_tag[4] = { 'S', 'T', 'R', 'M' };
+const char metadata_log_rows_tag[4] = { 'R', 'O', 'W', 'S' };
+const uint32_t metadata_log_version = 1;
+
+// Words of the presence bits of a row with columns columns.
+inline size_t metadata_log_mask_words( size_t columns ) {
+    return (columns + 63) / 64;
+}
+
+// Metadata attributes frame supports, found on the first frame of a stream profile.
+inline std::vector<rs2_frame_metadata_value> supported_metadata( const rs2::frame& frame ) {
+    std::vector<rs2_frame_metadata_value> ids;
+    for ( int i = 0; i < RS2_FRAME_METADATA_COUNT; i++ )
+        if ( frame.supports_frame_metadata( (rs2_frame_metadata_value)i ) )
+            ids.push_back( (rs2_frame_metadata_value)i );
+    return ids;
+}
+
+class metadata_log {
+public:
+    // Rows of a stream are kept in memory until there are block_rows of them.
+    explicit metadata_log( const std::string& filename, size_t block_rows = 256 )
+        : _file( filename, std::ios::binary | std::ios::trunc ), _block_rows( std::max<size_t>( 1, block_rows ) ) {
+        if ( !_file )
+            throw std::runtime_error( "Can not create " + filename );
+        std::vector<uint8_t> header( metadata_log_magic, metadata_log_magic + 8 );
+        binary_io::put( header, metadata_log_version );
+        binary_io::put( header, uint32_t( 0 ) );
+        write_bytes( header.data(), header.size() );
+    }
+
+    metadata_log( const metadata_log& ) = delete;
+    metadata_log& operator=( const metadata_log& ) = delete;
+
+    ~metadata_log() {
+        try {
+            close();
+        }
+        catch ( ... ) {
+        }
+    }
+
+    // Appends a row for frame, a block of rows reaches the disk every block_rows frames of a stream.
+    // Frames from several threads are applied one at a time. Returns false once closed.
+    bool append( const rs2::frame& frame ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _closed )
+            return false;
+        const uint32_t stream = find_stream( frame );
+        stream_columns& s = _streams[stream];
+
+        s.frame_numbers.push_back( frame.get_frame_number() );
+        s.timestamps.push_back( frame.get_timestamp() );
+        const size_t mask_at = s.present.size();
+        s.present.resize( mask_at + metadata_log_mask_words( s.ids.size() ), 0 );
+        for ( size_t i = 0; i < s.ids.size(); i++ ) {
+            // Only the columns of the stream are probed, not every attribute the SDK knows of.
+            int64_t value = 0;
+            if ( frame.supports_frame_metadata( s.ids[i] ) ) {
+                value = static_cast<int64_t>(frame.get_frame_metadata( s.ids[i] ));
+                s.present[mask_at + i / 64] |= uint64_t( 1 ) << (i % 64);
+            }
+            s.values[i].push_back( value );
+        }
+        _rows++;
+        if ( s.frame_numbers.size() >= _block_rows )
+            flush( stream );
+        return true;
+    }
+
+    // Writes the rows left in memory. Nothing can be appended after.
+    void close() {
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _closed )
+            return;
+        _closed = true;
+        for ( uint32_t i = 0; i < _streams.size(); i++ )
+            flush( i );
+        _file.close();
+    }
+
+    size_t rows() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _rows;
+    }
+
+private:
+    struct stream_columns {
+        int profile_id = 0;
+        std::vector<rs2_frame_metadata_value> ids;
+        std::vector<uint64_t> frame_numbers;
+        std::vector<double> timestamps;
+        std::vector<uint64_t> present;                  // metadata_log_mask_words() per row.
+        std::vector<std::vector<int64_t>> values;       // One vector per column.
+    };
+
+    // The stream of frame's profile, described in the file the first time it is seen.
+    uint32_t find_stream( const rs2::frame& frame ) {
+        const rs2::stream_profile profile = frame.get_profile();
+        const int profile_id = profile.unique_id();
+        for ( size_t i = 0; i < _streams.size(); i++ )
+            if ( _streams[i].profile_id == profile_id )
+                return static_cast<uint32_t>(i);
+
+        stream_columns s;
+        s.profile_id = profile_id;
+        s.ids = supported_metadata( frame );
+        s.values.resize( s.ids.size() );
+        const uint32_t stream = static_cast<uint32_t>(_streams.size());
+
+        std::vector<uint8_t> block( metadata_log_stream_tag, metadata_log_stream_tag + 4 );
+        binary_io::put( block, stream );
+        binary_io::put( block, static_cast<uint32_t>(profile.stream_type()) );
+        binary_io::put( block, static_cast<int32_t>(profile.stream_index()) );
+        binary_io::put( block, static_cast<uint32_t>(profile.format()) );
+        binary_io::put( block, static_cast<uint32_t>(s.ids.size()) );
+        for ( auto id : s.ids )
+            binary_io::put( block, static_cast<uint32_t>(id) );
+        write_bytes( block.data(), block.size() );
+
+        _streams.push_back( std::move( s ) );
+        return stream;
+    }
+
+    void flush( uint32_t stream ) {
+        stream_columns& s = _streams[stream];
+        if ( s.frame_numbers.empty() )
+            return;
+        std::vector<uint8_t> header( metadata_log_rows_tag, metadata_log_rows_tag + 4 );
+        binary_io::put( header, stream );
+        binary_io::put( header, static_cast<uint32_t>(s.frame_numbers.size()) );
+        write_bytes( header.data(), header.size() );
+        write_column( s.frame_numbers );
+        write_column( s.timestamps );
+        write_column( s.present );
+        for ( auto& column : s.values ) {
+            write_column( column );
+            column.clear();
+        }
+        s.frame_numbers.clear();
+        s.timestamps.clear();
+        s.present.clear();
+    }
+
+    template <class T>
+    void write_column( const std::vector<T>& column ) {
+        write_bytes( column.data(), column.size() * sizeof( T ) );
+    }
+
+    void write_bytes( const void* data, size_t size ) {
+        _file.write( static_cast<const char*>(data), size );
+        if ( !_file )
+            throw std::runtime_error( "Writing the metadata log failed" );
+    }
+
+    std::ofstream _file;
+    size_t _block_rows;
+    mutable std::mutex _mutex;
+    bool _closed = false;
+    size_t _rows = 0;
+    std::vector<stream_columns> _streams;
+};
+
+// A stream of a metadata log and its columns.
+struct metadata_log_stream {
+    rs2_stream type = RS2_STREAM_ANY;
+    int index = 0;
+    rs2_format format = RS2_FORMAT_ANY;
+    std::vector<rs2_frame_metadata_value> ids;
+};
+
+// A block of rows, its columns pointing into the mapped file.
+struct metadata_log_block {
+    uint32_t stream = 0;
+    size_t rows = 0;
+    const uint8_t* frame_numbers = nullptr;
+    const uint8_t* timestamps = nullptr;
+    const uint8_t* present = nullptr;
+    const uint8_t* values = nullptr;            // rows values of a column, then the next column.
+
+    uint64_t frame_number( size_t row ) const { return load<uint64_t>( frame_numbers, row ); }
+    double timestamp( size_t row ) const { return load<double>( timestamps, row ); }
+
+    // Value of a column in a row, false if the frame did not have it.
+    bool value( size_t row, size_t column, size_t columns, int64_t& value ) const {
+        const uint64_t mask = load<uint64_t>( present, row * metadata_log_mask_words( columns ) + column / 64 );
+        if ( !(mask >> (column % 64) & 1) )
+            return false;
+        value = load<int64_t>( values, column * rows + row );
+        return true;
+    }
+
+private:
+    // The columns follow headers of any length, they are not aligned.
+    template <class T>
+    static T load( const uint8_t* column, size_t i ) {
+        T value;
+        std::memcpy( &value, column + i * sizeof( T ), sizeof( T ) );
+        return value;
+    }
+};
+
+class metadata_log_reader {
+public:
+    // Throws if the file is not a metadata log. A log cut short is read up to its last complete block.
+    explicit metadata_log_reader( const std::string& filename )
+        : _file( filename ) {
+        const uint8_t* p = _file.data();
+        const uint8_t* end = p + _file.size();
+        char magic[8];
+        uint32_t version = 0, reserved = 0;
+        if ( !binary_io::get( p, end, magic ) || std::memcmp( magic, metadata_log_magic, 8 ) != 0
+             || !binary_io::get( p, end, version ) || version != metadata_log_version || !binary_io::get( p, end, reserved ) )
+            throw std::runtime_error( filename + " is not a metadata log" );
+
+        char tag[4];
+        bool ok = true;
+        while ( ok && p != end ) {
+            ok = binary_io::get( p, end, tag );
+            if ( ok && std::memcmp( tag, metadata_log_stream_tag, 4 ) == 0 )
+                ok = read_stream( p, end );
+            else if ( ok && std::memcmp( tag, metadata_log_rows_tag, 4 ) == 0 )
+                ok = read_rows( p, end );
+            else
+                ok = false;
+        }
+        _complete = ok;
+    }
+
+    const std::vector<metadata_log_stream>& streams() const { return _streams; }
+    const std::vector<metadata_log_block>& blocks() const { return _blocks; }
+
+    // False if the file ends in the middle of a block, or with something that is not one.
+    bool complete() const { return _complete; }
+
+private:
+    bool read_stream( const uint8_t*& p, const uint8_t* end ) {
+        uint32_t stream = 0, type = 0, format = 0, columns = 0;
+        int32_t index = 0;
+        if ( !binary_io::get( p, end, stream ) || stream != _streams.size() || !binary_io::get( p, end, type )
+             || !binary_io::get( p, end, index ) || !binary_io::get( p, end, format ) || !binary_io::get( p, end, columns )
+             || static_cast<size_t>(end - p) / sizeof( uint32_t ) < columns )
+            return false;
+        metadata_log_stream s;
+        s.type = static_cast<rs2_stream>(type);
+        s.index = index;
+        s.format = static_cast<rs2_format>(format);
+        for ( uint32_t i = 0; i < columns; i++ ) {
+            uint32_t id = 0;
+            binary_io::get( p, end, id );
+            s.ids.push_back( static_cast<rs2_frame_metadata_value>(id) );
+        }
+        _streams.push_back( std::move( s ) );
+        return true;
+    }
+
+    bool read_rows( const uint8_t*& p, const uint8_t* end ) {
+        metadata_log_block block;
+        uint32_t rows = 0;
+        if ( !binary_io::get( p, end, block.stream ) || block.stream >= _streams.size() || !binary_io::get( p, end, rows ) )
+            return false;
+        block.rows = rows;
+        const size_t columns = _streams[block.stream].ids.size();
+        const uint64_t row_bytes = 8 + 8 + 8 * metadata_log_mask_words( columns ) + 8 * static_cast<uint64_t>(columns);
+        if ( static_cast<uint64_t>(end - p) / row_bytes < rows )
+            return false;
+        block.frame_numbers = p;
+        block.timestamps = block.frame_numbers + 8 * block.rows;
+        block.present = block.timestamps + 8 * block.rows;
+        block.values = block.present + 8 * metadata_log_mask_words( columns ) * block.rows;
+        p += row_bytes * block.rows;
+        _blocks.push_back( block );
+        return true;
+    }
+
+    mapped_file _file;
+    std::vector<metadata_log_stream> _streams;
+    std::vector<metadata_log_block> _blocks;
+    bool _complete = false;
+};
+
+// Writes a metadata log as a csv table, a line per frame: its stream, frame number and timestamp, then a column
+// for every attribute any stream has, empty where the frame has no value. Returns the number of lines of frames.
+inline size_t metadata_log_to_csv( const std::string& log_filename, const std::string& csv_filename ) {
+    metadata_log_reader log( log_filename );
+
+    std::vector<rs2_frame_metadata_value> ids;
+    for ( auto& s : log.streams() )
+        ids.insert( ids.end(), s.ids.begin(), s.ids.end() );
+    std::sort( ids.begin(), ids.end() );
+    ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+
+    std::ofstream csv( csv_filename );
+    if ( !csv )
+        throw std::runtime_error( "Can not create " + csv_filename );
+    csv << "Stream,Frame Number,Timestamp";
+    for ( auto id : ids )
+        csv << "," << rs2_frame_metadata_to_string( id );
+    csv << "\n" << std::fixed << std::setprecision( 3 );
+
+    // Where each column of the table is in a stream's columns, -1 if the stream does not have it.
+    std::vector<std::vector<int>> columns_of( log.streams().size() );
+    std::vector<std::string> names;
+    for ( auto& s : log.streams() ) {
+        auto& columns = columns_of[names.size()];
+        for ( auto id : ids ) {
+            auto found = std::find( s.ids.begin(), s.ids.end(), id );
+            columns.push_back( found == s.ids.end() ? -1 : static_cast<int>(found - s.ids.begin()) );
+        }
+        std::string name = rs2_stream_to_string( s.type );
+        if ( s.index > 0 )
+            name += " " + std::to_string( s.index );
+        names.push_back( name );
+    }
+
+    size_t lines = 0;
+    for ( auto& block : log.blocks() ) {
+        const auto& columns = columns_of[block.stream];
+        const size_t count = log.streams()[block.stream].ids.size();
+        for ( size_t row = 0; row < block.rows; row++ ) {
+            csv << names[block.stream] << "," << block.frame_number( row ) << "," << block.timestamp( row );
+            for ( int column : columns ) {
+                int64_t value;
+                csv << ",";
+                if ( column >= 0 && block.value( row, column, count, value ) )
+                    csv << value;
+            }
+            csv << "\n";
+            lines++;
+        }
+    }
+    if ( !csv )
+        throw std::runtime_error( "Writing " + csv_filename + " failed" );
+    return lines;
+}
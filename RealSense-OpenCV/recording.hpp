@@ -0,0 +1,636 @@
+// recording.hpp : Recording of many frames in one file, read back by seeking to any timestamp.
+//
+// A recording is a header, chunks of frame records, then a stream table, a time index and a fixed size footer.
+// Every record holds a frame's number, timestamp and metadata as binary (id, value) pairs, followed by its
+// pixels: depth coded with rvl_codec, formats with 8-bit channels (color, infrared) with color_codec unless that
+// does not make them smaller, other streams as they are. Records are gathered in memory and written a
+// chunk at a time, so the disk sees a few large writes. The index, written when the recording is closed, is
+// sorted by stream then timestamp, and every stream knows its range of it. A full chunk is given its place in
+// the file under the writer's lock, and written after the lock is released, so other threads keep appending
+// frames while the disk is busy. Chunks are written in the order they were given their places.
+//
+// The reader maps the file and binary searches the index in place: seeking reads a few pages of the index,
+// and a frame's pages are only read when it is decoded. All fields are little-endian.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include "binary-io.hpp"
+#include "mapped-file.hpp"
+#include "metadata-log.hpp"
+#include "color-codec.hpp"
+#include "rvl-codec.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How the pixels of a record are stored.
+enum class frame_codec : uint32_t {
+    raw = 0,        // Tightly packed rows.
+    rvl = 1,        // rvl_codec::encode() output, for Z16.
+    color = 2       // color_codec::encode() output, for formats with 8-bit channels.
+};
+
+// Bytes per pixel of the formats color_codec compresses, 0 for the others.
+inline int color_codec_channels( rs2_format format ) {
+    switch ( format ) {
+    case RS2_FORMAT_Y8:
+        return 1;
+    case RS2_FORMAT_RGB8:
+    case RS2_FORMAT_BGR8:
+        return 3;
+    case RS2_FORMAT_RGBA8:
+    case RS2_FORMAT_BGRA8:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// One entry of the time index, laid out as it is in the file so it is searched in place.
+struct recording_index_entry {
+    double timestamp;           // Milliseconds, as reported by the frame.
+    uint32_t stream;            // Index in the stream table.
+    uint32_t reserved;
+    uint64_t offset;            // Of the record, from the start of the file.
+    uint64_t frame_number;
+};
+static_assert( sizeof( recording_index_entry ) == 32, "The index is read in place, its layout is fixed" );
+
+// What is known of a stream besides its frames.
+struct recording_stream {
+    rs2_stream type = RS2_STREAM_ANY;
+    int index = 0;
+    rs2_format format = RS2_FORMAT_ANY;
+    int width = 0;
+    int height = 0;
+    int bytes_per_pixel = 0;
+    float depth_scale = 0.f;        // Meters per depth unit, 0 for streams other than depth.
+    rs2_intrinsics intrinsics = {};
+    uint64_t first_entry = 0;       // Range of the index holding this stream's frames.
+    uint64_t entry_count = 0;
+};
+
+const char recording_magic[8] = { 'R', 'S', 'R', 'E', 'C', 'O', 'R', 'D' };
+const char recording_end_magic[8] = { 'R', 'S', 'R', 'E', 'C', 'E', 'N', 'D' };
+const char recording_chunk_magic[4] = { 'C', 'H', 'N', 'K' };
+const uint32_t recording_version = 1;
+
+// Sizes of the fixed parts of the file.
+const size_t recording_header_size = 16;       // Magic, version, reserved.
+const size_t recording_chunk_header_size = 16; // Magic, record count, bytes of records.
+const size_t recording_record_header_size = 40; // recording_record_header.
+const size_t recording_footer_size = 40;       // Stream table offset and count, index offset and count, magic.
+
+// A metadata attribute of a frame, as it is given to the writer.
+struct recording_metadata {
+    rs2_frame_metadata_value id;
+    int64_t value;
+};
+
+// A video frame given to the writer: its pixels and what is known of it besides its stream. Filled from an
+// rs2::video_frame by recording_writer::write(), or by hand for frames that do not come from the SDK.
+struct recording_frame {
+    const uint8_t* pixels = nullptr;
+    int stride = 0;                             // Bytes from the start of a row to the next.
+    uint64_t frame_number = 0;
+    double timestamp = 0;                       // Milliseconds.
+    rs2_timestamp_domain timestamp_domain = RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK;
+    const recording_metadata* metadata = nullptr;
+    size_t metadata_count = 0;
+};
+
+// What a thread writing frames keeps between them, so records are built without allocating.
+struct recording_scratch {
+    rvl_codec depth;
+    color_codec color;
+    std::vector<uint8_t> record;
+    std::vector<rs2_frame_metadata_value> metadata_ids;     // Supported by the profile of the frame.
+    std::vector<recording_metadata> metadata;
+};
+
+// Fixed part of a record, followed by metadata_count (uint32 id, int64 value) pairs then data_size bytes of pixels.
+struct recording_record_header {
+    uint32_t stream;
+    uint32_t codec;             // frame_codec.
+    uint64_t frame_number;
+    double timestamp;
+    uint32_t timestamp_domain;
+    uint32_t metadata_count;
+    uint64_t data_size;
+};
+static_assert( sizeof( recording_record_header ) == recording_record_header_size, "Records are copied to and from the file as they are" );
+
+class recording_writer {
+public:
+    // Frames are gathered in chunks of about chunk_bytes before they are written.
+    explicit recording_writer( const std::string& filename, size_t chunk_bytes = 8 << 20 )
+        : _file( filename, std::ios::binary | std::ios::trunc ), _chunk_bytes( chunk_bytes ) {
+        if ( !_file )
+            throw std::runtime_error( "Can not create " + filename );
+        std::vector<uint8_t> header( recording_magic, recording_magic + 8 );
+        binary_io::put( header, recording_version );
+        binary_io::put( header, uint32_t( 0 ) );
+        _file.write( reinterpret_cast<const char*>(header.data()), header.size() );
+        if ( !_file )
+            throw std::runtime_error( "Writing the recording failed" );
+        _written = header.size();
+        start_chunk();
+    }
+
+    recording_writer( const recording_writer& ) = delete;
+    recording_writer& operator=( const recording_writer& ) = delete;
+
+    ~recording_writer() {
+        try {
+            close();
+        }
+        catch ( ... ) {
+        }
+    }
+
+    // Adds a stream described by s, its range of the index is filled when the recording is closed. Returns the
+    // number to write its frames with.
+    uint32_t add_stream( const recording_stream& s ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _streams.push_back( s );
+        return static_cast<uint32_t>(_streams.size() - 1);
+    }
+
+    // Appends a video frame, adding its stream on the first frame of its profile. Returns false for frames that
+    // are not video frames, or once closed.
+    bool write( const rs2::frame& frame, recording_scratch& scratch ) {
+        auto vf = frame.as<rs2::video_frame>();
+        if ( !vf )
+            return false;
+        uint32_t stream = 0;
+        if ( !find_stream( vf, stream, scratch.metadata_ids ) )
+            return false;
+
+        // Only the attributes of the profile are probed, as the metadata log does.
+        scratch.metadata.clear();
+        for ( auto id : scratch.metadata_ids ) {
+            if ( vf.supports_frame_metadata( id ) )
+                scratch.metadata.push_back( { id, static_cast<int64_t>(vf.get_frame_metadata( id )) } );
+        }
+
+        recording_frame f;
+        f.pixels = static_cast<const uint8_t*>(vf.get_data());
+        f.stride = vf.get_stride_in_bytes();
+        f.frame_number = vf.get_frame_number();
+        f.timestamp = vf.get_timestamp();
+        f.timestamp_domain = vf.get_frame_timestamp_domain();
+        f.metadata = scratch.metadata.data();
+        f.metadata_count = scratch.metadata.size();
+        return write( stream, f, scratch );
+    }
+
+    // Appends a frame of a stream returned by add_stream(). The record is built and the pixels are compressed in
+    // scratch, kept by the calling thread, only the copy to the chunk is serialized. Frames from several threads
+    // can be written at once. Returns false for an unknown stream, or once closed.
+    bool write( uint32_t stream, const recording_frame& frame, recording_scratch& scratch ) {
+        recording_stream s;
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            if ( _closed || stream >= _streams.size() )
+                return false;
+            s = _streams[stream];
+        }
+        const bool depth = s.format == RS2_FORMAT_Z16;
+        const bool color = color_codec_channels( s.format ) == s.bytes_per_pixel;
+        const size_t row_bytes = static_cast<size_t>(s.width) * s.bytes_per_pixel;
+
+        recording_record_header header;
+        header.stream = stream;
+        header.frame_number = frame.frame_number;
+        header.timestamp = frame.timestamp;
+        header.timestamp_domain = static_cast<uint32_t>(frame.timestamp_domain);
+        header.metadata_count = static_cast<uint32_t>(frame.metadata_count);
+
+        // The header is copied in once the pixels are coded.
+        std::vector<uint8_t>& record = scratch.record;
+        record.resize( recording_record_header_size );
+
+        for ( size_t i = 0; i < frame.metadata_count; i++ ) {
+            binary_io::put( record, static_cast<uint32_t>(frame.metadata[i].id) );
+            binary_io::put( record, frame.metadata[i].value );
+        }
+
+        // The pool writing frames already runs in parallel, the bands of one frame are coded in turn.
+        const size_t data_at = record.size();
+        frame_codec codec = frame_codec::raw;
+        if ( depth ) {
+            scratch.depth.encode( reinterpret_cast<const uint16_t*>(frame.pixels), s.width, s.height, frame.stride / 2, record, false );
+            codec = frame_codec::rvl;
+        }
+        else if ( color ) {
+            scratch.color.encode( frame.pixels, s.width, s.height, s.bytes_per_pixel, frame.stride, record, false );
+            codec = frame_codec::color;
+            // Noise grows when coded, it is kept as it is.
+            if ( record.size() - data_at >= row_bytes * s.height ) {
+                record.resize( data_at );
+                codec = frame_codec::raw;
+            }
+        }
+        if ( codec == frame_codec::raw ) {
+            record.resize( data_at + row_bytes * s.height );
+            for ( int y = 0; y < s.height; y++ )
+                std::memcpy( &record[data_at + row_bytes * y], frame.pixels + static_cast<size_t>(frame.stride) * y, row_bytes );
+        }
+        header.codec = static_cast<uint32_t>(codec);
+        header.data_size = record.size() - data_at;
+        std::memcpy( record.data(), &header, sizeof( header ) );
+
+        std::unique_lock<std::mutex> lock( _mutex );
+        if ( _closed )
+            return false;
+        recording_index_entry entry;
+        entry.timestamp = frame.timestamp;
+        entry.stream = stream;
+        entry.reserved = 0;
+        entry.offset = _written + _chunk.size();
+        entry.frame_number = frame.frame_number;
+        _index.push_back( entry );
+
+        _chunk.insert( _chunk.end(), record.begin(), record.end() );
+        _chunk_records++;
+        if ( _chunk.size() >= _chunk_bytes ) {
+            pending_write chunk = take_chunk();
+            lock.unlock();
+            write_in_turn( chunk );
+        }
+        return true;
+    }
+
+    // Writes the last chunk, the stream table, the index and the footer, after the chunks other threads are
+    // still writing. Nothing can be written after.
+    void close() {
+        std::unique_lock<std::mutex> lock( _mutex );
+        if ( _closed )
+            return;
+        _closed = true;
+        pending_write last;
+        const bool has_last = _chunk_records > 0;
+        if ( has_last )
+            last = take_chunk();
+
+        // One range of the index per stream, timestamps in order within it.
+        std::sort( _index.begin(), _index.end(), []( const recording_index_entry& a, const recording_index_entry& b ) {
+            if ( a.stream != b.stream )
+                return a.stream < b.stream;
+            return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.frame_number < b.frame_number;
+        } );
+        for ( auto& s : _streams )
+            s.entry_count = 0;
+        for ( size_t i = _index.size(); i-- > 0; ) {
+            _streams[_index[i].stream].first_entry = i;
+            _streams[_index[i].stream].entry_count++;
+        }
+
+        pending_write end;
+        std::vector<uint8_t>& tail = end.bytes;
+        const uint64_t streams_offset = _written;
+        for ( auto& s : _streams ) {
+            binary_io::put( tail, static_cast<uint32_t>(s.type) );
+            binary_io::put( tail, static_cast<int32_t>(s.index) );
+            binary_io::put( tail, static_cast<uint32_t>(s.format) );
+            binary_io::put( tail, static_cast<int32_t>(s.width) );
+            binary_io::put( tail, static_cast<int32_t>(s.height) );
+            binary_io::put( tail, static_cast<int32_t>(s.bytes_per_pixel) );
+            binary_io::put( tail, s.depth_scale );
+            binary_io::put_intrinsics( tail, s.intrinsics );
+            binary_io::put( tail, s.first_entry );
+            binary_io::put( tail, s.entry_count );
+        }
+        // The index is aligned, so the reader can use it in place.
+        while ( (streams_offset + tail.size()) % 8 )
+            tail.push_back( 0 );
+        const uint64_t index_offset = streams_offset + tail.size();
+        const uint8_t* index = reinterpret_cast<const uint8_t*>(_index.data());
+        tail.insert( tail.end(), index, index + _index.size() * sizeof( recording_index_entry ) );
+
+        binary_io::put( tail, streams_offset );
+        binary_io::put( tail, static_cast<uint64_t>(_streams.size()) );
+        binary_io::put( tail, index_offset );
+        binary_io::put( tail, static_cast<uint64_t>(_index.size()) );
+        tail.insert( tail.end(), recording_end_magic, recording_end_magic + 8 );
+        end.turn = _next_turn++;
+        _written += tail.size();
+        lock.unlock();
+
+        if ( has_last )
+            write_in_turn( last );
+        write_in_turn( end );
+        _file.close();
+    }
+
+    size_t frames() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _index.size();
+    }
+
+    uint64_t bytes() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _written + (_chunk_records ? _chunk.size() : 0);
+    }
+
+private:
+    // A stream profile of the SDK, its stream, and the metadata attributes its first frame supports.
+    struct profile_stream {
+        int profile_id;
+        uint32_t stream;
+        std::vector<rs2_frame_metadata_value> metadata_ids;
+    };
+
+    // Stream of the frame's profile and the metadata attributes to probe, both found on the first frame of the
+    // profile. Returns false once closed.
+    bool find_stream( const rs2::video_frame& vf, uint32_t& stream, std::vector<rs2_frame_metadata_value>& metadata_ids ) {
+        const rs2::stream_profile profile = vf.get_profile();
+        const int profile_id = profile.unique_id();
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            if ( _closed )
+                return false;
+            if ( const profile_stream* known = find_profile( profile_id ) ) {
+                stream = known->stream;
+                metadata_ids = known->metadata_ids;
+                return true;
+            }
+        }
+
+        // Described without the lock, the depth units, intrinsics and metadata are queried from the SDK.
+        profile_stream added;
+        added.profile_id = profile_id;
+        added.metadata_ids = supported_metadata( vf );
+        recording_stream s;
+        s.type = profile.stream_type();
+        s.index = profile.stream_index();
+        s.format = profile.format();
+        s.width = vf.get_width();
+        s.height = vf.get_height();
+        s.bytes_per_pixel = vf.get_bytes_per_pixel();
+        if ( s.format == RS2_FORMAT_Z16 )
+            s.depth_scale = vf.as<rs2::depth_frame>().get_units();
+        if ( auto video = profile.as<rs2::video_stream_profile>() )
+            s.intrinsics = video.get_intrinsics();
+
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _closed )
+            return false;
+        // Another thread may have added the profile meanwhile.
+        if ( const profile_stream* known = find_profile( profile_id ) ) {
+            stream = known->stream;
+            metadata_ids = known->metadata_ids;
+            return true;
+        }
+        _streams.push_back( s );
+        added.stream = static_cast<uint32_t>(_streams.size() - 1);
+        stream = added.stream;
+        metadata_ids = added.metadata_ids;
+        _profiles.push_back( std::move( added ) );
+        return true;
+    }
+
+    // Called with _mutex held.
+    const profile_stream* find_profile( int profile_id ) const {
+        for ( auto& p : _profiles )
+            if ( p.profile_id == profile_id )
+                return &p;
+        return nullptr;
+    }
+
+    // Bytes given their place in the file, waiting for their turn to be written.
+    struct pending_write {
+        uint64_t turn = 0;
+        std::vector<uint8_t> bytes;
+    };
+
+    // A chunk starts with its header, filled in when the chunk is full.
+    void start_chunk() {
+        _chunk.assign( recording_chunk_magic, recording_chunk_magic + 4 );
+        _chunk.resize( recording_chunk_header_size, 0 );
+        _chunk.reserve( _chunk_bytes + (4 << 20) );
+        _chunk_records = 0;
+    }
+
+    // Gives the chunk its place in the file, and the next records a buffer of those already written.
+    // Called with _mutex held.
+    pending_write take_chunk() {
+        const uint32_t records = static_cast<uint32_t>(_chunk_records);
+        const uint64_t records_bytes = _chunk.size() - recording_chunk_header_size;
+        std::memcpy( &_chunk[4], &records, sizeof( records ) );
+        std::memcpy( &_chunk[8], &records_bytes, sizeof( records_bytes ) );
+
+        pending_write chunk;
+        chunk.turn = _next_turn++;
+        if ( !_spare_chunks.empty() ) {
+            chunk.bytes = std::move( _spare_chunks.back() );
+            _spare_chunks.pop_back();
+        }
+        chunk.bytes.swap( _chunk );
+        _written += chunk.bytes.size();
+        start_chunk();
+        return chunk;
+    }
+
+    // Called without _mutex. Waits for the writes given an earlier place, so the file is written in order.
+    void write_in_turn( pending_write& pending ) {
+        {
+            std::unique_lock<std::mutex> lock( _file_mutex );
+            _file_turn.wait( lock, [&] { return _turn == pending.turn; } );
+        }
+        // Only the thread whose turn it is touches the file.
+        _file.write( reinterpret_cast<const char*>(pending.bytes.data()), pending.bytes.size() );
+        const bool ok = static_cast<bool>(_file);
+        {
+            std::lock_guard<std::mutex> lock( _file_mutex );
+            _turn++;
+        }
+        _file_turn.notify_all();
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            _spare_chunks.push_back( std::move( pending.bytes ) );
+        }
+        if ( !ok )
+            throw std::runtime_error( "Writing the recording failed" );
+    }
+
+    std::ofstream _file;
+    size_t _chunk_bytes;
+    mutable std::mutex _mutex;
+    bool _closed = false;
+    uint64_t _written = 0;                      // Bytes given their place in the file, written or not.
+    std::vector<uint8_t> _chunk;
+    size_t _chunk_records = 0;
+    std::vector<std::vector<uint8_t>> _spare_chunks;
+    uint64_t _next_turn = 0;
+
+    // Order of the writes to the file.
+    std::mutex _file_mutex;
+    std::condition_variable _file_turn;
+    uint64_t _turn = 0;
+    std::vector<recording_stream> _streams;
+    std::vector<profile_stream> _profiles;
+    std::vector<recording_index_entry> _index;
+};
+
+// A record of the recording, pointing into the mapped file.
+struct recorded_frame {
+    uint32_t stream = 0;
+    frame_codec codec = frame_codec::raw;
+    uint64_t frame_number = 0;
+    double timestamp = 0;
+    rs2_timestamp_domain timestamp_domain = RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK;
+    uint32_t metadata_count = 0;
+    const uint8_t* metadata = nullptr;      // metadata_count (uint32 id, int64 value) pairs.
+    const uint8_t* data = nullptr;
+    uint64_t data_size = 0;
+
+    bool get_metadata( rs2_frame_metadata_value id, rs2_metadata_type& value ) const {
+        for ( uint32_t i = 0; i < metadata_count; i++ ) {
+            uint32_t stored;
+            std::memcpy( &stored, metadata + i * 12, sizeof( stored ) );
+            if ( stored == static_cast<uint32_t>(id) ) {
+                int64_t v;
+                std::memcpy( &v, metadata + i * 12 + 4, sizeof( v ) );
+                value = static_cast<rs2_metadata_type>(v);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class recording_reader {
+public:
+    // Throws if the file is not a closed recording.
+    explicit recording_reader( const std::string& filename )
+        : _file( filename ) {
+        const uint8_t* begin = _file.data();
+        const size_t size = _file.size();
+        if ( size < recording_header_size + recording_footer_size || std::memcmp( begin, recording_magic, 8 ) != 0 )
+            throw std::runtime_error( filename + " is not a recording" );
+        if ( std::memcmp( begin + size - 8, recording_end_magic, 8 ) != 0 )
+            throw std::runtime_error( filename + " has no index, the recording was not closed" );
+
+        const uint8_t* p = begin + size - recording_footer_size;
+        const uint8_t* end = begin + size;
+        uint64_t streams_offset = 0, stream_count = 0, index_offset = 0, index_count = 0;
+        binary_io::get( p, end, streams_offset );
+        binary_io::get( p, end, stream_count );
+        binary_io::get( p, end, index_offset );
+        binary_io::get( p, end, index_count );
+        const uint64_t footer_offset = size - recording_footer_size;
+        if ( streams_offset > index_offset || index_offset % 8 || index_offset > footer_offset
+             || index_count > (footer_offset - index_offset) / sizeof( recording_index_entry ) )
+            throw std::runtime_error( filename + " has a corrupt index" );
+        _index = reinterpret_cast<const recording_index_entry*>(begin + index_offset);
+        _index_count = static_cast<size_t>(index_count);
+
+        p = begin + streams_offset;
+        end = begin + index_offset;
+        for ( uint64_t i = 0; i < stream_count; i++ ) {
+            recording_stream s;
+            uint32_t type = 0, format = 0;
+            int32_t index = 0, width = 0, height = 0, bpp = 0;
+            const bool ok = binary_io::get( p, end, type ) && binary_io::get( p, end, index ) && binary_io::get( p, end, format )
+                && binary_io::get( p, end, width ) && binary_io::get( p, end, height ) && binary_io::get( p, end, bpp )
+                && binary_io::get( p, end, s.depth_scale ) && binary_io::get_intrinsics( p, end, s.intrinsics )
+                && binary_io::get( p, end, s.first_entry ) && binary_io::get( p, end, s.entry_count );
+            if ( !ok || s.first_entry > _index_count || s.entry_count > _index_count - s.first_entry )
+                throw std::runtime_error( filename + " has a corrupt stream table" );
+            s.type = static_cast<rs2_stream>(type);
+            s.index = index;
+            s.format = static_cast<rs2_format>(format);
+            s.width = width;
+            s.height = height;
+            s.bytes_per_pixel = bpp;
+            _streams.push_back( s );
+        }
+    }
+
+    const std::vector<recording_stream>& streams() const { return _streams; }
+
+    // First stream of a type, -1 if there is none.
+    int find_stream( rs2_stream type ) const {
+        for ( size_t i = 0; i < _streams.size(); i++ )
+            if ( _streams[i].type == type )
+                return static_cast<int>(i);
+        return -1;
+    }
+
+    // Index entries, grouped by stream and sorted by timestamp within a stream.
+    size_t entry_count() const { return _index_count; }
+    const recording_index_entry& entry( size_t i ) const { return _index[i]; }
+
+    // Entry of the first frame of stream at or after timestamp, by binary search. Returns entry_count() if the
+    // stream ends before.
+    size_t seek( uint32_t stream, double timestamp ) const {
+        if ( stream >= _streams.size() )
+            return _index_count;
+        const recording_index_entry* first = _index + _streams[stream].first_entry;
+        const recording_index_entry* last = first + _streams[stream].entry_count;
+        const recording_index_entry* found = std::lower_bound( first, last, timestamp,
+            []( const recording_index_entry& e, double t ) { return e.timestamp < t; } );
+        return found == last ? _index_count : static_cast<size_t>(found - _index);
+    }
+
+    // Parses the record of an index entry. Returns false if it does not fit in the file.
+    bool frame( size_t entry, recorded_frame& frame ) const {
+        if ( entry >= _index_count )
+            return false;
+        const uint8_t* begin = _file.data();
+        const uint8_t* end = begin + _file.size();
+        const uint64_t offset = _index[entry].offset;
+        if ( offset > _file.size() )
+            return false;
+        const uint8_t* p = begin + offset;
+        recording_record_header header;
+        if ( !binary_io::get( p, end, header ) || header.stream >= _streams.size() || static_cast<uint64_t>(end - p) / 12 < header.metadata_count )
+            return false;
+        frame.stream = header.stream;
+        frame.codec = static_cast<frame_codec>(header.codec);
+        frame.frame_number = header.frame_number;
+        frame.timestamp = header.timestamp;
+        frame.timestamp_domain = static_cast<rs2_timestamp_domain>(header.timestamp_domain);
+        frame.metadata_count = header.metadata_count;
+        frame.data_size = header.data_size;
+        frame.metadata = p;
+        p += static_cast<size_t>(frame.metadata_count) * 12;
+        if ( static_cast<uint64_t>(end - p) < frame.data_size )
+            return false;
+        frame.data = p;
+        return true;
+    }
+
+    // Decodes the pixels of a frame, tightly packed (depth as 16-bit values). Returns false on corrupt data.
+    bool decode( const recorded_frame& frame, std::vector<uint8_t>& pixels, rvl_codec& depth, color_codec& color ) const {
+        const recording_stream& s = _streams[frame.stream];
+        const size_t bytes = static_cast<size_t>(s.width) * s.height * s.bytes_per_pixel;
+        pixels.resize( bytes );
+        if ( frame.codec == frame_codec::raw ) {
+            if ( frame.data_size != bytes )
+                return false;
+            std::memcpy( pixels.data(), frame.data, bytes );
+            return true;
+        }
+        if ( frame.codec == frame_codec::rvl && s.bytes_per_pixel == 2 )
+            return depth.decode( frame.data, static_cast<size_t>(frame.data_size), s.width, s.height, reinterpret_cast<uint16_t*>(pixels.data()) );
+        if ( frame.codec == frame_codec::color )
+            return color.decode( frame.data, static_cast<size_t>(frame.data_size), s.width, s.height, s.bytes_per_pixel, pixels.data() );
+        return false;
+    }
+
+private:
+    mapped_file _file;
+    const recording_index_entry* _index = nullptr;
+    size_t _index_count = 0;
+    std::vector<recording_stream> _streams;
+};
@@ -0,0 +1,457 @@
+// rvl-codec.hpp : Lossless compression of Z16 depth frames, in the spirit of RVL (Wilson, 2017).
+//
+// Depth is mostly runs of valid pixels that change slowly, broken by holes of zeros. The encoder alternates the
+// length of a run of zeros, the length of the following run of valid pixels, and the valid pixels themselves as
+// zigzag deltas from the previous valid pixel. Every number is a variable-length code of 4-bit nibbles, 3 bits of
+// value and a continuation bit, packed 8 to a 32-bit word starting from the low bits.
+//
+// The nibble stream is inherently serial, so frames are cut in bands of rows coded independently: bands are
+// encoded and decoded in parallel, and the decoder fills zero runs with memset. A .rvl file holds one frame
+// with its depth scale and intrinsics, all integers little-endian.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include "binary-io.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Index of the highest set bit of a non-zero value.
+inline int highest_set_bit( uint64_t value ) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64( &index, value );
+    return static_cast<int>(index);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if ( _BitScanReverse( &index, static_cast<unsigned long>(value >> 32) ) )
+        return static_cast<int>(index) + 32;
+    _BitScanReverse( &index, static_cast<unsigned long>(value) );
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll( value );
+#endif
+}
+
+// Index of the lowest set bit of a non-zero value.
+inline int lowest_set_bit( uint64_t value ) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64( &index, value );
+    return static_cast<int>(index);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if ( _BitScanForward( &index, static_cast<unsigned long>(value) ) )
+        return static_cast<int>(index);
+    _BitScanForward( &index, static_cast<unsigned long>(value >> 32) );
+    return static_cast<int>(index) + 32;
+#else
+    return __builtin_ctzll( value );
+#endif
+}
+
+// Writes 4-bit codes into 32-bit words, the first nibble in the low bits. Values below 2^18, which covers every
+// delta, are spread to nibbles and appended without a branch.
+class nibble_writer {
+public:
+    explicit nibble_writer( uint32_t* out )
+        : _out( out ), _begin( out ) {}
+
+    void put( uint32_t value ) {
+        const int nibbles = (highest_set_bit( value | 1 ) + 3) / 3;
+        // Every nibble but the last has its continuation bit set.
+        const uint64_t continuation = 0x88888888888ull & ((uint64_t( 1 ) << (4 * (nibbles - 1))) - 1);
+        if ( nibbles <= 6 ) {
+            const uint64_t v = value;
+            append( (v & 07) | ((v & 070) << 1) | ((v & 0700) << 2) | ((v & 07000) << 3) | ((v & 070000) << 4) | ((v & 0700000) << 5) | continuation, nibbles );
+            return;
+        }
+        uint64_t code = continuation;
+        for ( int i = 0; i < nibbles; i++ )
+            code |= static_cast<uint64_t>((value >> (3 * i)) & 0x7) << (4 * i);
+        append( code & 0xFFFFFFFF, std::min( nibbles, 8 ) );
+        if ( nibbles > 8 )
+            append( code >> 32, nibbles - 8 );
+    }
+
+    // Flushes the last, partial word. Returns the number of words written.
+    size_t finish() {
+        if ( _nibbles ) {
+            *_out++ = static_cast<uint32_t>(_buffer);
+            _buffer = 0;
+            _nibbles = 0;
+        }
+        return static_cast<size_t>(_out - _begin);
+    }
+
+private:
+    // Up to 8 nibbles. The low word is always stored, and only kept once complete.
+    void append( uint64_t code, int nibbles ) {
+        _buffer |= code << (4 * _nibbles);
+        _nibbles += nibbles;
+        *_out = static_cast<uint32_t>(_buffer);
+        const int full = _nibbles >= 8;
+        _out += full;
+        _buffer >>= 32 * full;
+        _nibbles -= 8 * full;
+    }
+
+    uint32_t* _out;
+    uint32_t* _begin;
+    uint64_t _buffer = 0;
+    int _nibbles = 0;
+};
+
+// Values of the codes of at most 3 nibbles, for every 12 bits of input: the value in the low 9 bits, the number
+// of nibbles of its code above, 0 if the code is longer.
+struct nibble_code_table {
+    uint16_t value[4096];
+
+    nibble_code_table() {
+        for ( uint32_t x = 0; x < 4096; x++ ) {
+            value[x] = 0;
+            uint32_t v = 0;
+            for ( uint32_t i = 0; i < 3; i++ ) {
+                const uint32_t nibble = (x >> (4 * i)) & 0xF;
+                v |= (nibble & 07) << (3 * i);
+                if ( !(nibble & 010) ) {
+                    value[x] = static_cast<uint16_t>(v | ((i + 1) << 9));
+                    break;
+                }
+            }
+        }
+    }
+};
+
+inline const nibble_code_table& nibble_codes() {
+    static const nibble_code_table table;
+    return table;
+}
+
+// Reads what nibble_writer wrote, checking every read against the end of the input. Codes of up to 3 nibbles,
+// the zero runs and most deltas, take a table lookup. Longer ones are found from the continuation bits of the
+// up to 16 buffered nibbles.
+class nibble_reader {
+public:
+    nibble_reader( const uint32_t* in, size_t words )
+        : _in( in ), _end( in + words ), _codes( nibble_codes().value ) {}
+
+    // Returns false past the end of the input or on a code longer than 32 bits.
+    bool get( uint32_t& value ) {
+        refill();
+        const uint32_t entry = _codes[_buffer & 0xFFF];
+        const int short_nibbles = static_cast<int>(entry >> 9);
+        if ( short_nibbles != 0 && short_nibbles <= _nibbles ) {
+            value = entry & 0x1FF;
+            _buffer >>= 4 * short_nibbles;
+            _nibbles -= short_nibbles;
+            return true;
+        }
+        const uint64_t buffered = _nibbles >= 16 ? ~0ull : (uint64_t( 1 ) << (4 * _nibbles)) - 1;
+        const uint64_t last = ~_buffer & 0x8888888888888888ull & buffered;
+        if ( !last )
+            return get_long( value );
+        const int nibbles = lowest_set_bit( last ) / 4 + 1;
+        if ( nibbles > 6 )
+            return get_long( value );
+        const uint64_t x = _buffer & ((uint64_t( 1 ) << (4 * nibbles)) - 1);
+        value = static_cast<uint32_t>((x & 07) | ((x >> 1) & 070) | ((x >> 2) & 0700) | ((x >> 3) & 07000) | ((x >> 4) & 070000) | ((x >> 5) & 0700000));
+        _buffer >>= 4 * nibbles;
+        _nibbles -= nibbles;
+        return true;
+    }
+
+private:
+    // Adds a word below 9 buffered nibbles, the pointer is only moved when there is one to read.
+    void refill() {
+        const int take = _nibbles <= 8 && _in != _end;
+        const uint32_t word = take ? *_in : 0;
+        _buffer |= static_cast<uint64_t>(word) << ((4 * _nibbles) & 63);
+        _in += take;
+        _nibbles += 8 * take;
+    }
+
+    // A nibble at a time, for codes longer than 6 nibbles or running past the buffer.
+    bool get_long( uint32_t& value ) {
+        value = 0;
+        for ( int shift = 0; shift < 33; shift += 3 ) {
+            refill();
+            if ( _nibbles == 0 )
+                return false;
+            const uint32_t nibble = static_cast<uint32_t>(_buffer & 0xF);
+            _buffer >>= 4;
+            _nibbles--;
+            value |= (nibble & 0x7) << shift;
+            if ( !(nibble & 0x8) )
+                return true;
+        }
+        return false;
+    }
+
+    const uint32_t* _in;
+    const uint32_t* _end;
+    const uint16_t* _codes;
+    uint64_t _buffer = 0;
+    int _nibbles = 0;
+};
+
+// Room rvl_encode() needs for count pixels. A pair of runs covering k pixels takes at most 2k nibbles for the
+// two lengths and 6 per valid pixel, so a pixel never takes more than a word. The writer also stores the word
+// after the last complete one.
+inline size_t rvl_max_words( size_t count ) {
+    return count + 2;
+}
+
+// Encodes count pixels as one stream into out, which has room for rvl_max_words( count ) words.
+// Returns the number of words written.
+inline size_t rvl_encode( const uint16_t* depth, size_t count, uint32_t* out ) {
+    nibble_writer writer( out );
+    const uint16_t* end = depth + count;
+    int previous = 0;
+    while ( depth < end ) {
+        const uint16_t* zeros = depth;
+        while ( depth < end && *depth == 0 )
+            depth++;
+        writer.put( static_cast<uint32_t>(depth - zeros) );
+
+        const uint16_t* valid = depth;
+        while ( depth < end && *depth != 0 )
+            depth++;
+        writer.put( static_cast<uint32_t>(depth - valid) );
+
+        for ( ; valid < depth; valid++ ) {
+            const int delta = *valid - previous;
+            previous = *valid;
+            // Zigzag, small deltas of either sign get short codes.
+            writer.put( (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31) );
+        }
+    }
+    return writer.finish();
+}
+
+// Decodes exactly count pixels. Returns false if the stream is truncated or does not match count.
+inline bool rvl_decode( const uint32_t* in, size_t words, uint16_t* depth, size_t count ) {
+    nibble_reader reader( in, words );
+    size_t done = 0;
+    int previous = 0;
+    while ( done < count ) {
+        uint32_t zeros, valid;
+        if ( !reader.get( zeros ) || zeros > count - done )
+            return false;
+        std::memset( depth + done, 0, zeros * sizeof( uint16_t ) );
+        done += zeros;
+
+        if ( !reader.get( valid ) || valid > count - done )
+            return false;
+        for ( uint32_t i = 0; i < valid; i++ ) {
+            uint32_t zigzag;
+            if ( !reader.get( zigzag ) )
+                return false;
+            previous += static_cast<int>(zigzag >> 1) ^ -static_cast<int>(zigzag & 1);
+            depth[done++] = static_cast<uint16_t>(previous);
+        }
+        if ( zeros == 0 && valid == 0 )
+            return false;
+    }
+    return true;
+}
+
+// Frames are coded in bands of rows, stored as the band count, the size in words of every band, then the bands.
+// Appends the first sizes[i] words of every bands[i] to out.
+inline void put_bands( const std::vector<std::vector<uint32_t>>& bands, const std::vector<uint32_t>& sizes, std::vector<uint8_t>& out ) {
+    const size_t count = sizes.size();
+    size_t total = 0;
+    for ( uint32_t size : sizes )
+        total += size;
+    const size_t start = out.size();
+    out.resize( start + sizeof( uint32_t ) * (1 + count + total) );
+    uint8_t* p = &out[start];
+    const uint32_t count_value = static_cast<uint32_t>(count);
+    std::memcpy( p, &count_value, sizeof( uint32_t ) );
+    std::memcpy( p + sizeof( uint32_t ), sizes.data(), sizeof( uint32_t ) * count );
+    p += sizeof( uint32_t ) * (1 + count);
+    for ( size_t band = 0; band < count; band++ ) {
+        std::memcpy( p, bands[band].data(), sizeof( uint32_t ) * sizes[band] );
+        p += sizeof( uint32_t ) * sizes[band];
+    }
+}
+
+// Reads what put_bands() wrote: the words of all bands, and the offset of every band in them followed by the
+// total. Returns false if data does not hold count bands.
+inline bool get_bands( const uint8_t* data, size_t size, int count, std::vector<uint32_t>& sizes, std::vector<size_t>& offsets, std::vector<uint32_t>& words ) {
+    uint32_t stored_count = 0;
+    if ( size < sizeof( uint32_t ) )
+        return false;
+    std::memcpy( &stored_count, data, sizeof( uint32_t ) );
+    if ( stored_count != static_cast<uint32_t>(count) || size < sizeof( uint32_t ) * (1 + static_cast<size_t>(count)) )
+        return false;
+
+    sizes.resize( count );
+    offsets.resize( count + 1 );
+    std::memcpy( sizes.data(), data + sizeof( uint32_t ), sizeof( uint32_t ) * count );
+    offsets[0] = 0;
+    for ( int band = 0; band < count; band++ )
+        offsets[band + 1] = offsets[band] + sizes[band];
+    const size_t header = sizeof( uint32_t ) * (1 + static_cast<size_t>(count));
+    if ( (size - header) / sizeof( uint32_t ) < offsets[count] )
+        return false;
+
+    // The words may not be aligned in the byte buffer.
+    words.resize( offsets[count] );
+    std::memcpy( words.data(), data + header, sizeof( uint32_t ) * words.size() );
+    return true;
+}
+
+// Z16 frame coded in bands of rows. The scratch buffers are kept between frames, one codec per thread.
+class rvl_codec {
+public:
+    // Rows per band, small enough for a few bands per thread on decimated frames.
+    static const int band_rows = 32;
+
+    // Appends the coded frame to out: the band count, the size in words of every band, then the bands.
+    // stride is in pixels. Bands are coded on several threads if parallel is set.
+    void encode( const uint16_t* depth, int width, int height, int stride, std::vector<uint8_t>& out, bool parallel = true ) {
+        const int bands = band_count( height );
+        _bands.resize( bands );
+        _sizes.resize( bands );
+
+#pragma omp parallel for schedule(dynamic, 1) if(parallel)
+        for ( int band = 0; band < bands; band++ ) {
+            const int y_begin = band * band_rows;
+            const int y_end = std::min( height, y_begin + band_rows );
+            const int rows = y_end - y_begin;
+            std::vector<uint32_t>& words = _bands[band];
+            const uint16_t* rows_begin = depth + static_cast<size_t>(y_begin) * stride;
+            if ( stride == width ) {
+                words.resize( rvl_max_words( static_cast<size_t>(width) * rows ) );
+                _sizes[band] = static_cast<uint32_t>(rvl_encode( rows_begin, static_cast<size_t>(width) * rows, words.data() ));
+            }
+            else {
+                // Pack the rows first, the stream must not see the padding.
+                std::vector<uint16_t> packed( static_cast<size_t>(width) * rows );
+                for ( int y = 0; y < rows; y++ )
+                    std::memcpy( &packed[static_cast<size_t>(y) * width], rows_begin + static_cast<size_t>(y) * stride, width * sizeof( uint16_t ) );
+                words.resize( rvl_max_words( packed.size() ) );
+                _sizes[band] = static_cast<uint32_t>(rvl_encode( packed.data(), packed.size(), words.data() ));
+            }
+        }
+
+        put_bands( _bands, _sizes, out );
+    }
+
+    // Decodes what encode() wrote into a tightly packed width x height frame. Returns false on corrupt data.
+    bool decode( const uint8_t* data, size_t size, int width, int height, uint16_t* depth, bool parallel = true ) {
+        const int bands = band_count( height );
+        if ( !get_bands( data, size, bands, _sizes, _offsets, _words ) )
+            return false;
+
+        int failed = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:failed) if(parallel)
+        for ( int band = 0; band < bands; band++ ) {
+            const int y_begin = band * band_rows;
+            const int y_end = std::min( height, y_begin + band_rows );
+            if ( !rvl_decode( _words.data() + _offsets[band], _sizes[band], depth + static_cast<size_t>(y_begin) * width,
+                              static_cast<size_t>(width) * (y_end - y_begin) ) )
+                failed++;
+        }
+        return failed == 0;
+    }
+
+private:
+    static int band_count( int height ) {
+        return (height + band_rows - 1) / band_rows;
+    }
+
+    std::vector<std::vector<uint32_t>> _bands;
+    std::vector<uint32_t> _sizes;
+    std::vector<size_t> _offsets;
+    std::vector<uint32_t> _words;
+};
+
+// What a .rvl file knows about its frame besides the pixels.
+struct rvl_frame_info {
+    int width = 0;
+    int height = 0;
+    float depth_scale = 0.f;        // Meters per depth unit.
+    rs2_intrinsics intrinsics = {};
+    uint64_t frame_number = 0;
+    double timestamp = 0;           // Milliseconds, as reported by the frame.
+};
+
+// Header of a .rvl file: magic, version, then the fields of rvl_frame_info in order, then the coded frame.
+const char rvl_file_magic[4] = { 'R', 'V', 'L', 'Z' };
+const uint32_t rvl_file_version = 1;
+
+// Appends the file header for info to out.
+inline void rvl_write_header( const rvl_frame_info& info, std::vector<uint8_t>& out ) {
+    using binary_io::put;
+    out.insert( out.end(), rvl_file_magic, rvl_file_magic + 4 );
+    put( out, rvl_file_version );
+    put( out, static_cast<int32_t>(info.width) );
+    put( out, static_cast<int32_t>(info.height) );
+    put( out, info.depth_scale );
+    binary_io::put_intrinsics( out, info.intrinsics );
+    put( out, info.frame_number );
+    put( out, info.timestamp );
+}
+
+// Parses a header written by rvl_write_header, advancing p past it. Returns false if it is not one.
+inline bool rvl_read_header( const uint8_t*& p, const uint8_t* end, rvl_frame_info& info ) {
+    using binary_io::get;
+    char magic[4];
+    uint32_t version = 0;
+    int32_t width = 0, height = 0;
+    if ( !get( p, end, magic ) || std::memcmp( magic, rvl_file_magic, 4 ) != 0 || !get( p, end, version ) || version != rvl_file_version )
+        return false;
+    const bool ok = get( p, end, width ) && get( p, end, height ) && get( p, end, info.depth_scale )
+        && binary_io::get_intrinsics( p, end, info.intrinsics ) && get( p, end, info.frame_number ) && get( p, end, info.timestamp );
+    if ( !ok || width <= 0 || height <= 0 )
+        return false;
+    info.width = width;
+    info.height = height;
+    return true;
+}
+
+// Fills info from an SDK depth frame.
+inline rvl_frame_info rvl_frame_info_from( const rs2::depth_frame& frame ) {
+    rvl_frame_info info;
+    info.width = frame.get_width();
+    info.height = frame.get_height();
+    info.depth_scale = frame.get_units();
+    info.intrinsics = frame.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    info.frame_number = frame.get_frame_number();
+    info.timestamp = frame.get_timestamp();
+    return info;
+}
+
+// Writes a depth frame to a .rvl file. buffer is scratch space, kept by the caller between frames.
+inline bool rvl_write_file( const std::string& filename, const rs2::depth_frame& frame, rvl_codec& codec, std::vector<uint8_t>& buffer, bool parallel = true ) {
+    buffer.clear();
+    rvl_write_header( rvl_frame_info_from( frame ), buffer );
+    codec.encode( reinterpret_cast<const uint16_t*>(frame.get_data()), frame.get_width(), frame.get_height(),
+                  frame.get_stride_in_bytes() / static_cast<int>(sizeof( uint16_t )), buffer, parallel );
+    std::ofstream file( filename, std::ios::binary );
+    file.write( reinterpret_cast<const char*>(buffer.data()), buffer.size() );
+    return static_cast<bool>(file);
+}
+
+// Reads a .rvl file into info and a tightly packed depth frame. Returns false if the file can not be decoded.
+inline bool rvl_read_file( const std::string& filename, rvl_frame_info& info, std::vector<uint16_t>& depth, rvl_codec& codec ) {
+    std::ifstream file( filename, std::ios::binary );
+    std::vector<uint8_t> buffer( (std::istreambuf_iterator<char>( file )), std::istreambuf_iterator<char>() );
+    const uint8_t* p = buffer.data();
+    const uint8_t* end = p + buffer.size();
+    if ( !rvl_read_header( p, end, info ) )
+        return false;
+    depth.resize( static_cast<size_t>(info.width) * info.height );
+    return codec.decode( p, static_cast<size_t>(end - p), info.width, info.height, depth.data() );
+}
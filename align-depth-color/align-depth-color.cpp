@@ -4,6 +4,16 @@
 #include "example.hpp"
 #include <imgui.h>
 #include "imgui_impl_glfw.h"
+#include "auto-clipping.hpp"
+#include "bounded-queue.hpp"
+#include "depth-background.hpp"
+#include "depth-clipping.hpp"
+#include "blob-tracker.hpp"
+#include "connected-components.hpp"
+#include "fast-align.hpp"
+#include "filter-chain.hpp"
+#include "frame-pool.hpp"
+#include "plane-removal.hpp"
 
 #include <algorithm>
 #include <iterator>
@@ -13,20 +23,106 @@
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Command line options.
+const char* usage = "Usage: align-depth-color [--policy latest|every] [--workers N] [--queue-size N] [--filters LIST | --filters-file FILE] [--fused | --background-model] [--remove-plane] [--highlight-closest] [--auto-clipping otsu|valley]";
+struct app_options {
+    queue_policy policy = queue_policy::latest_frame_wins;
+    int workers = 0;            // 0 picks a count from the number of cores.
+    int queue_size = 2;
+    std::string filters = "decimation:magnitude=3";    // Post-processing applied to depth before alignment, see filter-chain.hpp.
+    std::string filters_file;
+    bool fused = false;         // Align and clip in one pass, without an aligned depth frame (the preview shows raw depth).
+    bool background_model = false;  // Learn the background depth of every pixel, the slider only clips what is closer.
+    bool remove_plane = false;      // Remove the dominant plane (floor, table) and what is behind it.
+    bool highlight_closest = false; // Only keep the tracked blobs closer than the clipping distance, and mark their centroids.
+    bool auto_clipping = false;     // Split the depth histogram to pick the clipping distance, the slider only shows it.
+    clipping_split split = clipping_split::otsu;
+};
+
+// A frameset straight from the camera, with what the processing stage needs to know about the active profile.
+struct captured_frames {
+    rs2::frameset frameset;
+    uint64_t sequence = 0;
+    rs2_stream align_to = RS2_STREAM_ANY;
+    float depth_scale = 0.f;
+};
+
+// Result of the processing stage, ready to be uploaded by the render stage.
+// Both frames are empty if alignment failed, the sequence number is still used to keep ordering.
+// The stripped image lives in a worker's frame pool, the SDK frames it was made from are never written to.
+struct processed_frames {
+    pooled_frame other_frame;
+    rs2_format other_format = RS2_FORMAT_ANY;
+    rs2_stream other_stream = RS2_STREAM_ANY;
+    rs2::frame colorized_depth;
+    uint64_t sequence = 0;
+};
+
+// Threads of the capture and processing stages. They are stopped and joined when this goes out of scope, also
+// when an exception leaves main: a thread still joinable at that point would call std::terminate.
+struct stage_threads {
+    std::function<void()> stop;     // Makes every stage return: clears the running flag and closes the queues.
+    std::vector<std::thread> threads;
+
+    stage_threads() = default;
+    stage_threads( const stage_threads& ) = delete;
+    stage_threads& operator=( const stage_threads& ) = delete;
+
+    ~stage_threads() {
+        join();
+    }
+
+    void join() {
+        if ( stop )
+            stop();
+        for ( auto& thread : threads )
+            if ( thread.joinable() )
+                thread.join();
+    }
+};
 
+// What a worker keeps between frames to find the closest objects, the tracks themselves are shared.
+struct closest_objects {
+    static const int full_frame_every = 10;     // The other frames are only labeled around the tracked objects.
+    static const int region_margin = 32;
+
+    connected_components components;
+    std::vector<tracked_blob> tracks;
+    std::vector<uint8_t> keep;                  // Per blob.
+};
+
+app_options parse_options( int argc, char* argv[] );
+void capture_frames( rs2::pipeline& pipe, rs2::pipeline_profile profile, filter_chain& filters, bounded_queue<captured_frames>& captured, const std::atomic<bool>& running );
+void process_frames( bounded_queue<captured_frames>& captured, bounded_queue<processed_frames>& processed, const std::atomic<float>& clipping_dist, bool fused, depth_background* background, plane_remover* plane, blob_tracker* tracker, auto_clipping* auto_clip, int omp_threads );
 void render_slider( rect location, float& clipping_dist );
-void remove_background( rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist );
-void highlight_closest( rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, float depth_scale, float clipping_dist );
-void array_to_csv( uint16_t* array, uint16_t length, const std::string& filename );
+void remove_background( const rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, pooled_frame& output, float depth_scale, float clipping_dist );
+void remove_filtered_background( const rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, pooled_frame& output, depth_background* background, plane_remover* plane, std::vector<uint16_t>& filtered_depth, float depth_scale, float clipping_dist );
+void remove_background_fused( fast_align& align, const rs2::frameset& frames, const rs2::video_frame& other_frame, pooled_frame& output, float depth_scale, float clipping_dist );
+void highlight_closest( const rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame, pooled_frame& output, closest_objects& objects, blob_tracker& tracker, uint64_t sequence, float depth_scale, float clipping_dist );
+void array_to_csv( const uint32_t* array, int length, const std::string& filename );
 float get_depth_scale( rs2::device dev );
 rs2_stream find_stream_to_align( const std::vector<rs2::stream_profile>& streams );
 bool profile_changed( const std::vector<rs2::stream_profile>& current, const std::vector<rs2::stream_profile>& prev );
 
 int main( int argc, char* argv[] ) try {
+    app_options options = parse_options( argc, argv );
+
     // Create and initialize GUI related objects.
     window app( 1280, 720, "Align" );		// Simple window handling.
     ImGui_ImplGlfw_Init( app, false );	// ImGui lib init.
-    rs2::colorizer c;					// Helper to colorize depth image.
     texture renderer;					// Helper for rendering images.
 
     // Create a pipeline to config and init camera.
@@ -42,12 +138,220 @@ int main( int argc, char* argv[] ) try {
     if ( depth_sensor.supports( RS2_OPTION_EMITTER_ENABLED ) )
         depth_sensor.set_option( RS2_OPTION_EMITTER_ENABLED, 0.f );
 
-    // Declare filters.
-    rs2::decimation_filter dec_filter;
+    // Declare the post-processing filters, applied to depth before alignment.
+    // Decimating first means alignment and everything after it work on a fraction of the depth pixels.
+    filter_chain filters = options.filters_file.empty() ? filter_chain( options.filters ) : filter_chain::from_file( options.filters_file );
+
+    // Define a variable for controlling the distance to clip.
+    // The slider writes it from this thread while the workers read it.
+    float depth_clipping_distance = 1.f;
+    std::atomic<float> shared_clipping_distance( depth_clipping_distance );
+
+    // The learned background is shared by the workers, they take turns updating it.
+    std::unique_ptr<depth_background> background;
+    if ( options.background_model )
+        background.reset( new depth_background() );
+
+    // Same for the tracked plane.
+    std::unique_ptr<plane_remover> plane;
+    if ( options.remove_plane )
+        plane.reset( new plane_remover() );
+
+    // And for the tracked objects.
+    std::unique_ptr<blob_tracker> tracker;
+    if ( options.highlight_closest )
+        tracker.reset( new blob_tracker() );
+
+    // And for the automatic clipping distance.
+    std::unique_ptr<auto_clipping> auto_clip;
+    if ( options.auto_clipping ) {
+        auto_clipping_options clipping_options;
+        clipping_options.split = options.split;
+        auto_clip.reset( new auto_clipping( clipping_options ) );
+    }
+
+    // The frame loop is split in three stages so frame N+1 can be captured and aligned while frame N is rendered:
+    //  - one capture thread waits for framesets, runs the filter chain and tags them with a sequence number,
+    //  - a pool of workers aligns, removes the background and colorizes depth,
+    //  - this thread uploads the results to OpenGL and draws the UI (the GL context belongs to it).
+    const int cores = static_cast<int>(std::max( 1u, std::thread::hardware_concurrency() ));
+    const int workers = options.workers > 0 ? options.workers : std::max( 1, cores - 2 );
+    bounded_queue<captured_frames> captured( options.queue_size, options.policy );
+    bounded_queue<processed_frames> processed( std::max( options.queue_size, workers + 1 ), options.policy );
+
+    // An exception in any stage stops the whole pipeline and is rethrown here.
+    std::atomic<bool> running( true );
+    std::mutex error_mutex;
+    std::exception_ptr stage_error;
+    // Declared after everything the stages use, so it is destroyed, and the threads joined, first.
+    stage_threads stages;
+    stages.stop = [&] {
+        running = false;
+        captured.close();
+        processed.close();
+    };
+    auto start_stage = [&]( std::function<void()> body ) {
+        return std::thread( [&, body] {
+            try {
+                body();
+            }
+            catch ( ... ) {
+                std::lock_guard<std::mutex> lock( error_mutex );
+                if ( !stage_error )
+                    stage_error = std::current_exception();
+                stages.stop();
+            }
+        } );
+    };
+
+    stages.threads.push_back( start_stage( [&] { capture_frames( pipe, profile, filters, captured, running ); } ) );
+    for ( int i = 0; i < workers; i++ ) {
+        // Share the cores between the workers, each one also runs OpenMP loops.
+        int omp_threads = std::max( 1, cores / workers );
+        stages.threads.push_back( start_stage( [&, omp_threads] { process_frames( captured, processed, shared_clipping_distance, options.fused, background.get(), plane.get(), tracker.get(), auto_clip.get(), omp_threads ); } ) );
+    }
+
+    // Results of the processing stage waiting for their turn to be shown, with process_every_frame.
+    std::map<uint64_t, processed_frames> out_of_order;
+    uint64_t next_sequence = 0;
+    processed_frames shown;
+
+    while ( app && !processed.closed() )	// Application still alive?
+    {
+        processed_frames result;
+        if ( options.policy == queue_policy::latest_frame_wins ) {
+            // Only the most recent result is worth showing, skip anything older than what is on screen.
+            if ( processed.pop_for( result, std::chrono::milliseconds( 50 ) ) ) {
+                do {
+                    if ( result.sequence >= next_sequence ) {
+                        next_sequence = result.sequence + 1;
+                        if ( result.other_frame )
+                            shown = std::move( result );
+                    }
+                } while ( processed.try_pop( result ) );
+            }
+        }
+        else {
+            // Workers can finish out of order, show results strictly by sequence number.
+            if ( processed.pop_for( result, std::chrono::milliseconds( 50 ) ) ) {
+                out_of_order[result.sequence] = std::move( result );
+            }
+            while ( !out_of_order.empty() && out_of_order.begin()->first == next_sequence ) {
+                if ( out_of_order.begin()->second.other_frame )
+                    shown = std::move( out_of_order.begin()->second );
+                out_of_order.erase( out_of_order.begin() );
+                next_sequence++;
+                // Show one frame per iteration, the others wait for the next buffer swap.
+                if ( shown.sequence + 1 == next_sequence )
+                    break;
+            }
+        }
+
+        // Taking dimensions of the window for rendering purposes.
+        float w = static_cast<float>(app.width());
+        float h = static_cast<float>(app.height());
 
-    // Configure filter parameters.
-    dec_filter.set_option( RS2_OPTION_FILTER_MAGNITUDE, 3 );
+        if ( shown.other_frame ) {
+            // At this point, "other_frame" is a copy of the other frame, stripped from its background.
+            const pooled_frame& other_frame = shown.other_frame;
+            rs2::video_frame colorized_depth = shown.colorized_depth;
+
+            // Calculating the position to place the frame in the window.
+            rect altered_other_frame_rect{ 0, 0, w, h };
+            altered_other_frame_rect = altered_other_frame_rect.adjust_ratio( { static_cast<float>(other_frame.width()), static_cast<float>(other_frame.height()) } );
+
+            // Render aligned image.
+            renderer.upload( other_frame.data(), other_frame.width(), other_frame.height(), shown.other_format, shown.other_stream );
+            renderer.show( altered_other_frame_rect );
+
+            // Renders the depth frame, as a picture-in-picture.
+            // Calculating the postition to place the depth frame in the window.
+            rect pip_stream{ 0, 0, w / 5, h / 5 };
+            pip_stream = pip_stream.adjust_ratio( { static_cast<float>(colorized_depth.get_width()), static_cast<float>(colorized_depth.get_height()) } );
+            pip_stream.x = altered_other_frame_rect.x + altered_other_frame_rect.w - pip_stream.w - (std::max( w, h ) / 25);
+            pip_stream.y = altered_other_frame_rect.y + (std::max( w, h ) / 25);
+
+            // Render depth (as picture in picture).
+            renderer.upload( colorized_depth );
+            renderer.show( pip_stream );
+        }
 
+        // Using ImGui lib to provide a slide controller to select the depth clipping distance.
+        // With automatic clipping the workers pick the distance, the slider follows it.
+        ImGui_ImplGlfw_NewFrame( 1 );
+        if ( auto_clip )
+            depth_clipping_distance = auto_clip->distance( depth_clipping_distance );
+        render_slider( { 5.f, 0, w, h }, depth_clipping_distance );
+        ImGui::Render();
+        shared_clipping_distance = depth_clipping_distance;
+    }
+
+    // Stop every stage and wait for them before the pipeline goes away.
+    stages.join();
+
+    if ( stage_error )
+        std::rethrow_exception( stage_error );
+
+    std::cout << "Dropped " << captured.dropped() << " captured and " << processed.dropped() << " processed framesets" << std::endl;
+    return EXIT_SUCCESS;
+}
+catch ( const rs2::error & e ) {
+    std::cerr << "RealSense error calling " << e.get_failed_function() << "(" << e.get_failed_args() << "):\n\t" << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
+catch ( const std::exception & e ) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
+
+app_options parse_options( int argc, char* argv[] ) {
+    app_options options;
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg = argv[i];
+        if ( arg == "--fused" ) {
+            options.fused = true;
+            continue;
+        }
+        if ( arg == "--background-model" ) {
+            options.background_model = true;
+            continue;
+        }
+        if ( arg == "--remove-plane" ) {
+            options.remove_plane = true;
+            continue;
+        }
+        if ( arg == "--highlight-closest" ) {
+            options.highlight_closest = true;
+            continue;
+        }
+        if ( i + 1 >= argc )
+            throw std::invalid_argument( "Missing value for " + arg + "\n" + usage );
+        std::string value = argv[++i];
+
+        if ( arg == "--policy" )
+            options.policy = parse_queue_policy( value );
+        else if ( arg == "--workers" )
+            options.workers = std::stoi( value );
+        else if ( arg == "--queue-size" )
+            options.queue_size = std::max( 1, std::stoi( value ) );
+        else if ( arg == "--filters" )
+            options.filters = value;
+        else if ( arg == "--filters-file" )
+            options.filters_file = value;
+        else if ( arg == "--auto-clipping" ) {
+            options.auto_clipping = true;
+            options.split = parse_clipping_split( value );
+        }
+        else
+            throw std::invalid_argument( "Unknown option " + arg + "\n" + usage );
+    }
+    // The model and the plane need whole aligned depth frames, the fused path never has one.
+    if ( options.fused && (options.background_model || options.remove_plane || options.highlight_closest) )
+        throw std::invalid_argument( std::string( "--fused can not be used with --background-model, --remove-plane or --highlight-closest\n" ) + usage );
+    return options;
+}
+
+void capture_frames( rs2::pipeline& pipe, rs2::pipeline_profile profile, filter_chain& filters, bounded_queue<captured_frames>& captured, const std::atomic<bool>& running ) {
     // Each depth camera might have different units for depth pixels, so we git it here.
     float depth_scale = get_depth_scale( profile.get_device() );
 
@@ -55,84 +359,117 @@ int main( int argc, char* argv[] ) try {
     // If there is no color stream, choose to align depth to another stream.
     rs2_stream align_to = find_stream_to_align( profile.get_streams() );
 
-    // rs2::align allows to perform alignement of depth frames to other frames.
-    // "align_to" is the stream type to which we plan to align depth frames.
-    rs2::align align( align_to );
-
-    // Define a variable for controlling the distance to clip.
-    float depth_clipping_distance = 1.f;
-
-    while ( app )	// Application still alive?
-    {
-        // Using the align object, we block the application until a framset is available.
-        rs2::frameset frameset = pipe.wait_for_frames();
+    uint64_t sequence = 0;
+    while ( running ) {
+        // Block until a framset is available.
+        captured_frames item;
+        item.frameset = pipe.wait_for_frames();
 
         // rs2::pipeline::wait_for_frames() can replace the device it uses in case of device error or disconnection.
         // Since rs2::align is aligning depth to some other stream, we need to make sure that the stream was not changed
         // after the call to wait_for_frames();
         if ( profile_changed( pipe.get_active_profile().get_streams(), profile.get_streams() ) ) {
-            // If the profile was changed, update the align object, and also get the new device's depth scale.
+            // If the profile was changed, tell the workers to update their align object, and also get the new device's depth scale.
             profile = pipe.get_active_profile();
             align_to = find_stream_to_align( profile.get_streams() );
-            align = rs2::align( align_to );
             depth_scale = get_depth_scale( profile.get_device() );
         }
 
-        // Get processed aligned frame.
-        auto processed = align.process( frameset );
-
-        // Trying to get both other and aligned depth frames.
-        rs2::video_frame other_frame = processed.first( align_to );
-        rs2::depth_frame aligned_depth_frame = processed.get_depth_frame();
+        // Filters run here rather than in the workers: the temporal filter keeps history and must see every frame in order.
+        item.frameset = filters.process( item.frameset );
 
-        // If one of them is unavailable, continue iteration.
-        if ( !aligned_depth_frame || !other_frame ) {
-            continue;
+        // Print how long each filter takes every few seconds.
+        if ( !filters.empty() && sequence % 300 == 299 ) {
+            std::ostringstream timings;
+            filters.report( timings );
+            std::cout << "Filters: " << timings.str() << std::endl;
         }
 
-        // Passing both frames to remove_background so it will "strip" the background.
-        // NOTE: we alter the buffer of the other frame instead of copying and altering the copy.
-        //		 This behavior is not recommened in real application since the other frame could be used elsewhere.
-        remove_background( other_frame, aligned_depth_frame, depth_scale, depth_clipping_distance );
-        //highlight_closest( other_frame, aligned_depth_frame, depth_scale, depth_clipping_distance );
+        item.sequence = sequence++;
+        item.align_to = align_to;
+        item.depth_scale = depth_scale;
+        if ( !captured.push( std::move( item ) ) )
+            break;
+    }
+}
 
-        // Taking dimensions of the window for rendering purposes.
-        float w = static_cast<float>(app.width());
-        float h = static_cast<float>(app.height());
+void process_frames( bounded_queue<captured_frames>& captured, bounded_queue<processed_frames>& processed, const std::atomic<float>& clipping_dist, bool fused, depth_background* background, plane_remover* plane, blob_tracker* tracker, auto_clipping* auto_clip, int omp_threads ) {
+#ifdef _OPENMP
+    omp_set_num_threads( omp_threads );
+#else
+    (void)omp_threads;
+#endif
 
-        // At this point, "other_frame" is an altered frame, stripped from its background.
-        // Calculating the position to place the frame in the window.
-        rect altered_other_frame_rect{ 0, 0, w, h };
-        altered_other_frame_rect = altered_other_frame_rect.adjust_ratio( { static_cast<float>(other_frame.get_width()), static_cast<float>(other_frame.get_height()) } );
+    // Processing blocks are not meant to be called from several threads at once, every worker has its own.
+    rs2::colorizer c;					// Helper to colorize depth image.
+    std::unique_ptr<fast_align> align;
+    rs2_stream align_to = RS2_STREAM_ANY;
+    closest_objects objects;            // Only used by highlight_closest.
+    frame_pool pool;                    // Output images, recycled once the render stage is done with them.
+    std::vector<uint16_t> filtered_depth;   // Only used with a background model or plane removal.
+    depth_histogram histogram( 32 );    // Only used with automatic clipping.
+
+    captured_frames item;
+    while ( captured.pop( item ) ) {
+        // fast_align allows to perform alignement of depth frames to other frames, like rs2::align but with cached tables.
+        // "align_to" is the stream type to which we plan to align depth frames.
+        if ( !align || item.align_to != align_to ) {
+            align_to = item.align_to;
+            align.reset( new fast_align( align_to ) );
+        }
 
-        // Render aligned image.
-        renderer.render( other_frame, altered_other_frame_rect );
+        processed_frames result;
+        result.sequence = item.sequence;
 
-        // Renders the depth frame, as a picture-in-picture.
-        // Calculating the postition to place the depth frame in the window.
-        rect pip_stream{ 0, 0, w / 5, h / 5 };
-        pip_stream = pip_stream.adjust_ratio( { static_cast<float>(aligned_depth_frame.get_width()), static_cast<float>(aligned_depth_frame.get_height()) } );
-        pip_stream.x = altered_other_frame_rect.x + altered_other_frame_rect.w - pip_stream.w - (std::max( w, h ) / 25);
-        pip_stream.y = altered_other_frame_rect.y + (std::max( w, h ) / 25);
+        // The histogram is built on the depth before alignment, it has the same values on fewer pixels.
+        float clip = clipping_dist;
+        if ( auto_clip ) {
+            if ( rs2::depth_frame depth_frame = item.frameset.get_depth_frame() )
+                clip = auto_clip->update( histogram, reinterpret_cast<const uint16_t*>(depth_frame.get_data()), depth_frame.get_width(), depth_frame.get_height(),
+                                          item.depth_scale, item.sequence, clip );
+        }
 
-        // Render depth (as picture in picture).
-        renderer.upload( c.process( aligned_depth_frame ) );
-        renderer.show( pip_stream );
+        if ( fused ) {
+            // Align, clip and composite in a single traversal of the other frame.
+            rs2::video_frame other_frame = item.frameset.first( align_to );
+            rs2::depth_frame depth_frame = item.frameset.get_depth_frame();
+            if ( depth_frame && other_frame ) {
+                result.other_frame = pool.acquire( other_frame.get_width(), other_frame.get_height(), other_frame.get_bytes_per_pixel() );
+                remove_background_fused( *align, item.frameset, other_frame, result.other_frame, item.depth_scale, clip );
+                result.other_format = other_frame.get_profile().format();
+                result.other_stream = align_to;
+                result.colorized_depth = c.process( depth_frame );
+            }
+        }
+        else {
+            // Get processed aligned frame.
+            auto aligned = align->process( item.frameset );
+
+            // Trying to get both other and aligned depth frames.
+            rs2::video_frame other_frame = aligned.first( align_to );
+            rs2::depth_frame aligned_depth_frame = aligned.get_depth_frame();
+
+            // If one of them is unavailable, pass an empty result so the render stage does not wait for this sequence number.
+            if ( aligned_depth_frame && other_frame ) {
+                // Passing both frames to remove_background so it will "strip" the background.
+                // The result is written to a pooled buffer, the other frame could be used elsewhere.
+                result.other_frame = pool.acquire( other_frame.get_width(), other_frame.get_height(), other_frame.get_bytes_per_pixel() );
+                if ( tracker )
+                    highlight_closest( other_frame, aligned_depth_frame, result.other_frame, objects, *tracker, item.sequence, item.depth_scale, clip );
+                else if ( background || plane )
+                    remove_filtered_background( other_frame, aligned_depth_frame, result.other_frame, background, plane, filtered_depth, item.depth_scale, clip );
+                else
+                    remove_background( other_frame, aligned_depth_frame, result.other_frame, item.depth_scale, clip );
+
+                result.other_format = other_frame.get_profile().format();
+                result.other_stream = align_to;
+                result.colorized_depth = c.process( aligned_depth_frame );
+            }
+        }
 
-        // Using ImGui lib to provide a slide controller to select the depth clipping distance.
-        ImGui_ImplGlfw_NewFrame( 1 );
-        render_slider( { 5.f, 0, w, h }, depth_clipping_distance );
-        ImGui::Render();
+        if ( !processed.push( std::move( result ) ) )
+            break;
     }
-    return EXIT_SUCCESS;
-}
-catch ( const rs2::error & e ) {
-    std::cerr << "RealSense error calling " << e.get_failed_function() << "(" << e.get_failed_args() << "):\n\t" << e.what() << std::endl;
-    return EXIT_FAILURE;
-}
-catch ( const std::exception & e ) {
-    std::cerr << e.what() << std::endl;
-    return EXIT_FAILURE;
 }
 
 void render_slider( rect location, float& clipping_dist ) {
@@ -170,166 +507,138 @@ void render_slider( rect location, float& clipping_dist ) {
     ImGui::End();
 }
 
-void remove_background( rs2::video_frame & other_frame, const rs2::depth_frame & depth_frame, float depth_scale, float clipping_dist ) {
+void remove_background( const rs2::video_frame & other_frame, const rs2::depth_frame & depth_frame, pooled_frame & output, float depth_scale, float clipping_dist ) {
     const uint16_t* p_depth_frame = reinterpret_cast<const uint16_t*>(depth_frame.get_data());
-    uint8_t* p_other_frame = reinterpret_cast<uint8_t*>(const_cast<void*>(other_frame.get_data()));
+    const uint8_t* p_other_frame = reinterpret_cast<const uint8_t*>(other_frame.get_data());
 
     int width = other_frame.get_width();
     int height = other_frame.get_height();
     int other_bpp = other_frame.get_bytes_per_pixel();
 
-#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
-    for ( int y = 0; y < height; y++ ) {
-        auto depth_pixel_index = y * width;
-        for ( int x = 0; x < width; x++, ++depth_pixel_index ) {
-            // Get the depth value of the current pixel.
-            auto pixels_distance = depth_scale * p_depth_frame[depth_pixel_index];
-
-            // Check if the depth value is invalid (<=0) or greater than the treashold.
-            if ( pixels_distance <= 0.f || pixels_distance > clipping_dist ) {
-                // Calculate the offset in other frame's buffer to current pixel.
-                auto offset = depth_pixel_index * other_bpp;
-
-                // Set pixel to "background" color (0x999999).
-                std::memset( &p_other_frame[offset], 0x99, other_bpp );
-            }
-        }
-    }
-}
+    // Convert the clipping distance to depth units once, instead of scaling every pixel to meters.
+    uint16_t max_depth_units = clipping_dist_to_depth_units( depth_scale, clipping_dist );
 
-void highlight_closest( rs2::video_frame & other_frame, const rs2::depth_frame & depth_frame, float depth_scale, float clipping_dist ) {
-    const int slotSizeFactor = 5;
-    const int noOfSlots = 65536 >> slotSizeFactor;
-    uint16_t slot_counts[noOfSlots];
-
-    // Clear the depth counters in each slot.
-    for ( int i = 0; i < sizeof( slot_counts ) / sizeof( *slot_counts ); i++ )
-        slot_counts[i] = 0;
+    // Copy the other frame to the output, setting every pixel that is invalid (0) or further than the treshold to "background" color (0x999999).
+    clip_background( p_depth_frame, p_other_frame, output.data(), width, height, other_bpp, max_depth_units );
+}
 
-    uint16_t * p_depth_frame = reinterpret_cast<uint16_t*>(const_cast<void*>(depth_frame.get_data()));
-    uint8_t * p_other_frame = reinterpret_cast<uint8_t*>(const_cast<void*>(other_frame.get_data()));
+void remove_filtered_background( const rs2::video_frame & other_frame, const rs2::depth_frame & depth_frame, pooled_frame & output, depth_background * background,
+                                 plane_remover * plane, std::vector<uint16_t> & filtered_depth, float depth_scale, float clipping_dist ) {
+    const uint16_t* p_depth_frame = reinterpret_cast<const uint16_t*>(depth_frame.get_data());
+    const uint8_t* p_other_frame = reinterpret_cast<const uint8_t*>(other_frame.get_data());
 
-    const int width = other_frame.get_width();
-    const int height = other_frame.get_height();
+    int width = other_frame.get_width();
+    int height = other_frame.get_height();
     int other_bpp = other_frame.get_bytes_per_pixel();
 
-#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
-    // Make a pass through the image counting depth pixels.
-    for ( int y = 0; y < height; y++ ) {
-        auto depth_pixel_index = y * width;
-        for ( int x = 0; x < width; x++, ++depth_pixel_index ) {
-            // Get the depth value of the current pixel.
-            auto pixels_distance = p_depth_frame[depth_pixel_index];
+    // Each stage sets the depth of what it removes to 0, which the clipping kernels already paint as background.
+    filtered_depth.resize( static_cast<size_t>(width) * height );
+    const uint16_t* p_filtered = p_depth_frame;
+    if ( background ) {
+        background->apply( p_depth_frame, width, height, depth_scale, filtered_depth.data() );
+        p_filtered = filtered_depth.data();
+    }
+    if ( plane ) {
+        // The plane is fitted on the whole depth, the aligned depth has the intrinsics of the other frame.
+        const rs2_intrinsics intrinsics = other_frame.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+        plane->apply( intrinsics, depth_scale, p_depth_frame, p_filtered, filtered_depth.data() );
+        p_filtered = filtered_depth.data();
+    }
+    clip_background( p_filtered, p_other_frame, output.data(), width, height, other_bpp, clipping_dist_to_depth_units( depth_scale, clipping_dist ) );
+}
 
-            // If invalid value
-            if ( pixels_distance * depth_scale <= 0.f || pixels_distance * depth_scale > clipping_dist )
-                continue;
+void remove_background_fused( fast_align & align, const rs2::frameset & frames, const rs2::video_frame & other_frame, pooled_frame & output, float depth_scale, float clipping_dist ) {
+    const uint8_t* p_other_frame = reinterpret_cast<const uint8_t*>(other_frame.get_data());
 
-            // Find the slot and increase the counter.
-            slot_counts[pixels_distance >> slotSizeFactor]++;
+    int width = other_frame.get_width();
+    int other_bpp = other_frame.get_bytes_per_pixel();
+    uint16_t max_depth_units = clipping_dist_to_depth_units( depth_scale, clipping_dist );
+    simd_level level = get_simd_level();
+
+    // Each band of aligned depth is clipped against the matching rows of the other frame while it is still in cache.
+    align.align_bands( frames, [&]( const uint16_t* aligned_rows, int v_begin, int v_end ) {
+        for ( int v = v_begin; v < v_end; v++ ) {
+            clip_background_row( aligned_rows + static_cast<size_t>(v - v_begin) * width,
+                                 p_other_frame + static_cast<size_t>(v) * width * other_bpp, output.row( v ),
+                                 width, other_bpp, max_depth_units, level );
         }
-    }
+    } );
+}
+
+void highlight_closest( const rs2::video_frame & other_frame, const rs2::depth_frame & depth_frame, pooled_frame & output, closest_objects & objects, blob_tracker & tracker,
+                        uint64_t sequence, float depth_scale, float clipping_dist ) {
+    const uint16_t * p_depth_frame = reinterpret_cast<const uint16_t*>(depth_frame.get_data());
+    const uint8_t * p_other_frame = reinterpret_cast<const uint8_t*>(other_frame.get_data());
+    uint8_t * p_output = output.data();
 
-    // Now find the depth with the most pixels.
-    int max_count = 0;
-    int max_pos = 0;
+    const int width = other_frame.get_width();
+    const int height = other_frame.get_height();
+    int other_bpp = other_frame.get_bytes_per_pixel();
 
-#pragma omp parallel for schedule(dynamic)
-    for ( int i = 0; i < sizeof( slot_counts ) / sizeof( *slot_counts ); i++ ) {
-        if ( slot_counts[i] > max_count ) {
-            max_count = slot_counts[i];
-            max_pos = i;
+    // Label the blobs of valid depth closer than the clipping distance. Neighbours more than 5cm apart in depth
+    // are not connected, so objects next to each other in the image but not in the room stay apart.
+    // Between full frames, only the region around the tracked objects is labeled.
+    const uint16_t max_units = clipping_dist_to_depth_units( depth_scale, clipping_dist );
+    const uint16_t max_step = clipping_dist_to_depth_units( depth_scale, 0.05f );
+    connected_components & components = objects.components;
+    int rx = 0, ry = 0, rw = width, rh = height;
+    if ( sequence % closest_objects::full_frame_every != 0 && tracker.region( width, height, closest_objects::region_margin, rx, ry, rw, rh ) )
+        components.label_region( p_depth_frame, width, rx, ry, rw, rh, max_units, max_step );
+    else
+        components.label( p_depth_frame, width, height, max_units, max_step );
+
+    // The other workers share the tracker, the matches have to come from the same call as the update.
+    const std::vector<blob> & blobs = components.blobs();
+    tracker.update( blobs, sequence, objects.tracks );
+
+    // Keep the blobs of the confirmed tracks, or the biggest blob while none of them matched.
+    objects.keep.assign( blobs.size(), 0 );
+    bool any_confirmed = false;
+    for ( auto & t : objects.tracks ) {
+        if ( t.confirmed && t.blob >= 0 && t.blob < static_cast<int>(blobs.size()) ) {
+            objects.keep[t.blob] = 1;
+            any_confirmed = true;
         }
     }
+    if ( !any_confirmed && components.largest() >= 0 )
+        objects.keep[components.largest()] = 1;
 
-//#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
-//    // Make a pass through the image counting depth pixels.
-//    for ( int y = 0; y < height; y++ ) {
-//        auto depth_pixel_index = y * width;
-//        auto from_x = (width * height) + 1;
-//        for ( int x = 0; x < width; x++, ++depth_pixel_index ) {
-//            // Get the depth value of the current pixel.
-//            auto pixels_distance = p_depth_frame[depth_pixel_index];
-//
-//            if ( pixels_distance >> slotSizeFactor == max_pos ) {
-//                if ( p_depth_frame[depth_pixel_index + 1] <= 0 ) {
-//                    from_x = depth_pixel_index;
-//                }
-//                if ( p_depth_frame[depth_pixel_index - 1] <= 0 && from_x < ((width * height) + 1) ) {
-//                    if ( depth_pixel_index - from_x > 50 )
-//                        continue;
-//                    for ( auto i = from_x + 1; i < depth_pixel_index; i++ ) {
-//                        p_depth_frame[i] = p_depth_frame[from_x];
-//                    }
-//                    auto from_x = (width * height) + 1;
-//                }
-//            }
-//        }
-//    }
-
-    uint32_t x_total = 0;
-    uint32_t y_total = 0;
-    // Now Remove the background
-#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
+    // Now Remove the background. Background pixels are labeled -1 and never kept, even when there is no blob.
+    const int32_t * labels = components.labels();
+#pragma omp parallel for schedule(static)
     for ( int y = 0; y < height; y++ ) {
-        auto depth_pixel_index = y * width;
-        for ( int x = 0; x < width; x++, ++depth_pixel_index ) {
-            // Get the depth value of the current pixel.
-            auto pixels_distance = p_depth_frame[depth_pixel_index];
-            // Calculate the offset in other frame's buffer to current pixel.
-            auto offset = depth_pixel_index * other_bpp;
-            if ( pixels_distance >> slotSizeFactor == max_pos ) {
-                x_total += x;
-                y_total += y;
-                //std::memset( &p_other_frame[offset], 0x00, other_bpp );
-            }
-            else {
-                // Remove background
-                p_other_frame[offset] = 0x00;   // R
-                p_other_frame[offset+1] = 0x00; // G
-                p_other_frame[offset+2] = 0x00; // B
-            }
+        const size_t row = static_cast<size_t>(y) * width;
+        for ( int x = 0; x < width; x++ ) {
+            const size_t offset = (row + x) * other_bpp;
+            const bool inside = x >= rx && x < rx + rw && y >= ry && y < ry + rh;
+            const int32_t label = inside ? labels[static_cast<size_t>(y - ry) * rw + (x - rx)] : -1;
+            if ( label >= 0 && objects.keep[label] )
+                std::memcpy( &p_output[offset], &p_other_frame[offset], other_bpp );
+            else
+                std::memset( &p_output[offset], 0x00, other_bpp );
         }
     }
 
-//    uint32_t x;
-//    uint32_t y;
-//
-//    if ( slot_counts[max_pos] == 0 ) {
-//        x = width / 2;
-//        y = height / 2;
-//    }
-//    else {
-//        x = x_total / slot_counts[max_pos];
-//        y = y_total / slot_counts[max_pos];
-//    }
-//
-//    if ( x + 10 > width ) x = width - 10;
-//    else if ( x - 10 > width )x = 10;   // If x-10 would be < 0.
-//    if ( y + 10 > height ) y = height - 10;
-//    else if ( y - 10 > height )y = 10;   // If y-10 would be < 0.
-//
-//    std::cout << "Biggest object at (" << x << ", " << y << ")     \r";
-//#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
-//    for ( auto iy = y - 10; iy <= y + 10; iy++ ) {
-//        for ( auto ix = x - 1; ix <= x + 1; ix++ ) {
-//            auto depth_pixel_index = (iy * width) + ix;
-//            std::memset( &p_other_frame[depth_pixel_index * other_bpp], 0xFF, other_bpp );
-//        }
-//    }
-//#pragma omp parallel for schedule(dynamic)  // Using OpenMP to try to parallelise the loop.
-//    for ( auto iy = y - 1; iy <= y + 1; iy++ ) {
-//        for ( auto ix = x - 10; ix <= x + 10; ix++ ) {
-//            auto depth_pixel_index = (iy * width) + ix;
-//            std::memset( &p_other_frame[depth_pixel_index * other_bpp], 0xFF, other_bpp );
-//        }
-//    }
+    // Mark the filtered centroid of every confirmed object with a cross, kept inside the image.
+    auto paint = [&]( int x_begin, int x_end, int y_begin, int y_end ) {
+        for ( int iy = std::max( 0, y_begin ); iy <= std::min( height - 1, y_end ); iy++ )
+            for ( int ix = std::max( 0, x_begin ); ix <= std::min( width - 1, x_end ); ix++ )
+                std::memset( &p_output[(static_cast<size_t>(iy) * width + ix) * other_bpp], 0xFF, other_bpp );
+    };
+    for ( auto & t : objects.tracks ) {
+        if ( !t.confirmed )
+            continue;
+        const int cx = static_cast<int>(std::floor( t.x.position + 0.5f ));
+        const int cy = static_cast<int>(std::floor( t.y.position + 0.5f ));
+        paint( cx - 1, cx + 1, cy - 10, cy + 10 );
+        paint( cx - 10, cx + 10, cy - 1, cy + 1 );
+    }
 }
 
-void array_to_csv( uint16_t * array, uint16_t length, const std::string & filename ) {
+void array_to_csv( const uint32_t * array, int length, const std::string & filename ) {
     std::ofstream csv;
     csv.open( filename );
-    for ( uint16_t i = 0; i < length; i++ ) {
+    for ( int i = 0; i < length; i++ ) {
         csv << array[i] << "\n";
     }
     csv.close();
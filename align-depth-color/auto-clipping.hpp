@@ -0,0 +1,109 @@
+// auto-clipping.hpp : Picks the clipping distance from the depth histogram instead of the slider.
+//
+// Every frame's histogram, built on a subsampled grid, is split in two classes: what is near the camera and the
+// rest of the room. The split moves the clipping distance with hysteresis: a new split has to stay away from the
+// current target for a few frames before it is adopted, and the distance then eases towards it, so a hand
+// passing by or a noisy frame does not make the cut jump around.
+#pragma once
+
+#include "depth-clipping.hpp"
+#include "depth-histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class clipping_split {
+    otsu,       // Maximize the variance between the two classes.
+    valley      // Lowest point between the two main peaks.
+};
+
+inline clipping_split parse_clipping_split( const std::string& name ) {
+    if ( name == "otsu" )
+        return clipping_split::otsu;
+    if ( name == "valley" )
+        return clipping_split::valley;
+    throw std::invalid_argument( "Unknown clipping split '" + name + "', expected 'otsu' or 'valley'" );
+}
+
+struct auto_clipping_options {
+    clipping_split split = clipping_split::otsu;
+    int step = 4;                       // Only one pixel out of step in each direction is counted.
+    float min_meters = 0.2f;
+    float max_meters = 6.f;             // Farther depth is left out of the histogram, same range as the slider.
+    float hysteresis_meters = 0.1f;     // Splits closer than this to the target do not move it.
+    int hold_frames = 3;                // Frames a split must stay out of the band before it becomes the target.
+    float smoothing = 0.2f;             // Fraction of the way to the target covered every frame.
+    int valley_radius = 2;              // Smoothing of the histogram before looking for peaks, in bins.
+    int valley_separation = 4;          // Closest two peaks can be, in bins.
+};
+
+class auto_clipping {
+public:
+    explicit auto_clipping( auto_clipping_options options = auto_clipping_options() )
+        : _options( options ) {}
+
+    const auto_clipping_options& options() const { return _options; }
+
+    // Current clipping distance in meters, fallback until a frame could be split.
+    float distance( float fallback ) const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _valid ? _distance : fallback;
+    }
+
+    // Fills histogram from depth, which is the only pass over the frame, then moves the clipping distance
+    // towards its split. Frames older than the last one only read the distance.
+    // Frames from several threads are applied one at a time, each thread brings its own histogram.
+    float update( depth_histogram& histogram, const uint16_t* depth, int width, int height, float depth_scale, uint64_t sequence, float fallback ) {
+        const uint16_t max_units = clipping_dist_to_depth_units( depth_scale, _options.max_meters );
+        histogram.compute( depth, width, height, max_units, _options.step );
+
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _updated && sequence <= _sequence )
+            return _valid ? _distance : fallback;
+        _sequence = sequence;
+        _updated = true;
+
+        const int last_bin = histogram.bin_of( max_units );
+        const int bin = _options.split == clipping_split::otsu
+            ? histogram.otsu_bin( last_bin )
+            : histogram.valley_bin( last_bin, _options.valley_radius, _options.valley_separation, _smoothed );
+        if ( bin >= 0 ) {
+            // The near class ends with its last bin, so does the foreground.
+            const float split = std::min( _options.max_meters, std::max( _options.min_meters,
+                depth_scale * static_cast<float>((bin + 1) * histogram.bin_width()) ) );
+            if ( !_valid ) {
+                _target = _distance = split;
+                _valid = true;
+            }
+            else if ( std::fabs( split - _target ) > _options.hysteresis_meters ) {
+                if ( ++_held >= _options.hold_frames ) {
+                    _target = split;
+                    _held = 0;
+                }
+            }
+            else
+                _held = 0;
+        }
+        if ( !_valid )
+            return fallback;
+        _distance += _options.smoothing * (_target - _distance);
+        return _distance;
+    }
+
+private:
+    auto_clipping_options _options;
+
+    mutable std::mutex _mutex;
+    bool _updated = false;
+    uint64_t _sequence = 0;
+    bool _valid = false;
+    float _distance = 0.f;
+    float _target = 0.f;
+    int _held = 0;                      // Consecutive splits out of the hysteresis band.
+    std::vector<uint32_t> _smoothed;    // Scratch for valley_bin().
+};
@@ -0,0 +1,292 @@
+// blob-tracker.hpp : Gives the blobs of connected-components.hpp identities that last across frames.
+//
+// Every track filters the centroid and the mean depth of its blob with a constant velocity Kalman filter per
+// axis. On each frame the tracks are predicted, then matched to the blobs greedily by overlap (IoU) of the
+// predicted and observed boxes, best overlaps first, as long as the depths agree. Unmatched blobs start tentative
+// tracks, which are confirmed after a few hits; tracks missed too many frames in a row are dropped.
+//
+// Tracks, candidate blobs and candidate pairs all live in storage sized once by the constructor, so updating
+// the tracker never allocates. The predicted boxes also give the region worth labeling on the next frame.
+#pragma once
+
+#include "connected-components.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Constant velocity model of one coordinate: position and velocity, per frame.
+struct kalman_axis {
+    float position = 0.f, velocity = 0.f;
+    float p00 = 0.f, p01 = 0.f, p11 = 0.f;     // Covariance.
+
+    void reset( float measured, float measurement_noise ) {
+        position = measured;
+        velocity = 0.f;
+        p00 = measurement_noise;
+        p01 = 0.f;
+        p11 = measurement_noise;
+    }
+
+    // dt frames ahead, with white acceleration noise of variance q.
+    void predict( float dt, float q ) {
+        position += velocity * dt;
+        p00 += dt * (2.f * p01 + dt * p11) + q * dt * dt * dt / 3.f;
+        p01 += dt * p11 + q * dt * dt / 2.f;
+        p11 += q * dt;
+    }
+
+    void correct( float measured, float r ) {
+        const float innovation = measured - position;
+        const float s = p00 + r;
+        const float k0 = p00 / s;
+        const float k1 = p01 / s;
+        position += k0 * innovation;
+        velocity += k1 * innovation;
+        p11 -= k1 * p01;
+        p01 -= k1 * p00;
+        p00 -= k0 * p00;
+    }
+};
+
+struct tracked_blob {
+    int id = -1;
+    bool active = false;
+    bool confirmed = false;
+    int hits = 0;
+    int misses = 0;                 // Consecutive frames without a matching blob.
+    int blob = -1;                  // Index of the matched blob in the last update, -1 if missed.
+    kalman_axis x, y, depth;        // Centroid in pixels, mean depth in raw units.
+    float width = 0.f, height = 0.f;
+    int area = 0;
+
+    // Box centered on the filtered centroid.
+    float left() const { return x.position - width / 2; }
+    float top() const { return y.position - height / 2; }
+    float right() const { return x.position + width / 2; }
+    float bottom() const { return y.position + height / 2; }
+};
+
+struct blob_tracker_options {
+    int max_tracks = 16;
+    int max_candidates = 32;        // Only the largest blobs are matched.
+    int min_area = 200;             // Smaller blobs are noise.
+    float min_iou = 0.1f;
+    float max_depth_jump = 0.25f;   // Largest change of mean depth between matched frames, relative to depth.
+    int confirm_hits = 3;
+    int max_misses = 5;
+    float position_noise = 4.f;     // Acceleration noise of the centroid, pixels per frame squared.
+    float depth_noise = 20.f;       // Same for depth, raw units per frame squared.
+    float measurement_noise = 4.f;  // Variance of a measured centroid coordinate, pixels squared.
+    float depth_measurement_noise = 100.f;
+    float size_smoothing = 0.3f;    // Weight of the new box size.
+};
+
+class blob_tracker {
+public:
+    explicit blob_tracker( blob_tracker_options options = blob_tracker_options() )
+        : _options( options ) {
+        _tracks.resize( std::max( 1, _options.max_tracks ) );
+        _candidates.reserve( std::max( 1, _options.max_candidates ) );
+        _pairs.reserve( _tracks.size() * _candidates.capacity() );
+        _blob_taken.reserve( _candidates.capacity() );
+    }
+
+    // Predicts the tracks to frame sequence and matches them with its blobs. Frames older than the last one
+    // are ignored, so workers finishing out of order do not move the tracks back in time.
+    // Frames from several threads are applied one at a time. The active tracks are copied to tracks (which keeps
+    // its capacity between calls) before another frame can change them, their blob indices are in blobs, or -1
+    // for all of them when the frame was ignored.
+    void update( const std::vector<blob>& blobs, uint64_t sequence, std::vector<tracked_blob>& tracks ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _updated && sequence <= _sequence ) {
+            copy_active( tracks );
+            for ( auto& t : tracks )
+                t.blob = -1;
+            return;
+        }
+        const float dt = _updated ? static_cast<float>(sequence - _sequence) : 1.f;
+        _sequence = sequence;
+        _updated = true;
+
+        for ( auto& t : _tracks ) {
+            if ( !t.active )
+                continue;
+            t.x.predict( dt, _options.position_noise );
+            t.y.predict( dt, _options.position_noise );
+            t.depth.predict( dt, _options.depth_noise );
+            t.blob = -1;
+        }
+
+        select_candidates( blobs );
+        match( blobs );
+
+        // Unmatched tracks age, unmatched candidates start new tracks where there is room.
+        for ( auto& t : _tracks ) {
+            if ( t.active && t.blob < 0 && ++t.misses > _options.max_misses )
+                t.active = false;
+        }
+        for ( size_t c = 0; c < _candidates.size(); c++ ) {
+            if ( _blob_taken[c] )
+                continue;
+            auto free_slot = std::find_if( _tracks.begin(), _tracks.end(), []( const tracked_blob& t ) { return !t.active; } );
+            if ( free_slot == _tracks.end() )
+                break;
+            start( *free_slot, blobs[_candidates[c]], _candidates[c] );
+        }
+        copy_active( tracks );
+    }
+
+    // Copies the active tracks, confirmed or not, to tracks (which keeps its capacity between calls). Their blob
+    // indices are in the blobs of the last frame applied, whichever thread it came from.
+    void tracks( std::vector<tracked_blob>& tracks ) const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        copy_active( tracks );
+    }
+
+    // Bounding rectangle of the confirmed tracks' predicted boxes one frame ahead, grown by margin pixels and
+    // clipped to the frame. Returns false when nothing is confirmed.
+    bool region( int frame_width, int frame_height, int margin, int& x, int& y, int& width, int& height ) const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        float left = 1e30f, top = 1e30f, right = -1e30f, bottom = -1e30f;
+        bool any = false;
+        for ( auto& t : _tracks ) {
+            if ( !t.active || !t.confirmed )
+                continue;
+            any = true;
+            left = std::min( left, t.left() + t.x.velocity );
+            top = std::min( top, t.top() + t.y.velocity );
+            right = std::max( right, t.right() + t.x.velocity );
+            bottom = std::max( bottom, t.bottom() + t.y.velocity );
+        }
+        if ( !any )
+            return false;
+        const int x0 = std::max( 0, static_cast<int>(std::floor( left )) - margin );
+        const int y0 = std::max( 0, static_cast<int>(std::floor( top )) - margin );
+        const int x1 = std::min( frame_width, static_cast<int>(std::ceil( right )) + margin + 1 );
+        const int y1 = std::min( frame_height, static_cast<int>(std::ceil( bottom )) + margin + 1 );
+        if ( x1 <= x0 || y1 <= y0 )
+            return false;
+        x = x0;
+        y = y0;
+        width = x1 - x0;
+        height = y1 - y0;
+        return true;
+    }
+
+private:
+    struct candidate_pair {
+        float iou;
+        int track;
+        int candidate;
+    };
+
+    void copy_active( std::vector<tracked_blob>& tracks ) const {
+        tracks.clear();
+        for ( auto& t : _tracks )
+            if ( t.active )
+                tracks.push_back( t );
+    }
+
+    // The largest blobs above min_area, at most max_candidates of them.
+    void select_candidates( const std::vector<blob>& blobs ) {
+        _candidates.clear();
+        const size_t limit = _candidates.capacity();
+        for ( int i = 0; i < static_cast<int>(blobs.size()); i++ ) {
+            if ( blobs[i].area < _options.min_area )
+                continue;
+            if ( _candidates.size() < limit )
+                _candidates.push_back( i );
+            else if ( blobs[i].area > blobs[_candidates.back()].area )
+                _candidates.back() = i;
+            else
+                continue;
+            // Keep them sorted by decreasing area, the smallest one is the first to go.
+            for ( size_t c = _candidates.size() - 1; c > 0 && blobs[_candidates[c]].area > blobs[_candidates[c - 1]].area; c-- )
+                std::swap( _candidates[c], _candidates[c - 1] );
+        }
+        _blob_taken.assign( _candidates.size(), 0 );
+    }
+
+    static float iou( const tracked_blob& t, const blob& b ) {
+        const float left = std::max( t.left(), static_cast<float>(b.min_x) );
+        const float top = std::max( t.top(), static_cast<float>(b.min_y) );
+        const float right = std::min( t.right(), static_cast<float>(b.max_x + 1) );
+        const float bottom = std::min( t.bottom(), static_cast<float>(b.max_y + 1) );
+        if ( right <= left || bottom <= top )
+            return 0.f;
+        const float overlap = (right - left) * (bottom - top);
+        const float blob_area = static_cast<float>(b.max_x + 1 - b.min_x) * (b.max_y + 1 - b.min_y);
+        return overlap / (t.width * t.height + blob_area - overlap);
+    }
+
+    // Greedy assignment: the pair with the best overlap wins, then the next best among the remaining ones.
+    void match( const std::vector<blob>& blobs ) {
+        _pairs.clear();
+        for ( int t = 0; t < static_cast<int>(_tracks.size()); t++ ) {
+            const tracked_blob& track = _tracks[t];
+            if ( !track.active )
+                continue;
+            for ( int c = 0; c < static_cast<int>(_candidates.size()); c++ ) {
+                const blob& b = blobs[_candidates[c]];
+                const float expected = std::max( 1.f, track.depth.position );
+                if ( std::fabs( b.mean_depth_units - track.depth.position ) > _options.max_depth_jump * expected )
+                    continue;
+                const float overlap = iou( track, b );
+                if ( overlap >= _options.min_iou )
+                    _pairs.push_back( candidate_pair{ overlap, t, c } );
+            }
+        }
+        std::sort( _pairs.begin(), _pairs.end(), []( const candidate_pair& a, const candidate_pair& b ) { return a.iou > b.iou; } );
+
+        for ( auto& pair : _pairs ) {
+            tracked_blob& t = _tracks[pair.track];
+            if ( t.blob >= 0 || _blob_taken[pair.candidate] )
+                continue;
+            _blob_taken[pair.candidate] = 1;
+            correct( t, blobs[_candidates[pair.candidate]], _candidates[pair.candidate] );
+        }
+    }
+
+    void start( tracked_blob& t, const blob& b, int index ) {
+        t.id = _next_id++;
+        t.active = true;
+        t.confirmed = _options.confirm_hits <= 1;
+        t.hits = 1;
+        t.misses = 0;
+        t.blob = index;
+        t.x.reset( b.centroid_x, _options.measurement_noise );
+        t.y.reset( b.centroid_y, _options.measurement_noise );
+        t.depth.reset( b.mean_depth_units, _options.depth_measurement_noise );
+        t.width = static_cast<float>(b.max_x + 1 - b.min_x);
+        t.height = static_cast<float>(b.max_y + 1 - b.min_y);
+        t.area = b.area;
+    }
+
+    void correct( tracked_blob& t, const blob& b, int index ) {
+        t.x.correct( b.centroid_x, _options.measurement_noise );
+        t.y.correct( b.centroid_y, _options.measurement_noise );
+        t.depth.correct( b.mean_depth_units, _options.depth_measurement_noise );
+        const float w = _options.size_smoothing;
+        t.width += w * (static_cast<float>(b.max_x + 1 - b.min_x) - t.width);
+        t.height += w * (static_cast<float>(b.max_y + 1 - b.min_y) - t.height);
+        t.area = b.area;
+        t.blob = index;
+        t.misses = 0;
+        if ( ++t.hits >= _options.confirm_hits )
+            t.confirmed = true;
+    }
+
+    blob_tracker_options _options;
+
+    mutable std::mutex _mutex;
+    std::vector<tracked_blob> _tracks;
+    std::vector<int> _candidates;               // Indices in the blobs of the frame, largest first.
+    std::vector<candidate_pair> _pairs;
+    std::vector<uint8_t> _blob_taken;           // Per candidate.
+    bool _updated = false;
+    uint64_t _sequence = 0;
+    int _next_id = 0;
+};
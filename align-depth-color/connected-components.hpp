@@ -0,0 +1,282 @@
+// connected-components.hpp : Parallel labeling of the foreground blobs of a depth frame, with their statistics.
+//
+// Foreground pixels have a raw depth in (0, max_units], neighbours are 8-connected and can also be required to
+// be close in depth, so objects touching in the image but not in space stay apart. Either the whole frame or a
+// rectangle of it is labeled, blob statistics are always in frame coordinates.
+//
+// The frame is split in bands of rows labeled in parallel with union-find, labels being pixel indices so bands
+// need no coordination. The seams between bands are then merged, and a last parallel pass resolves every pixel
+// to its blob and accumulates area, bounding box, centroid and mean depth per thread before they are summed.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct blob {
+    int area = 0;
+    int min_x = 0, min_y = 0, max_x = 0, max_y = 0;     // Inclusive bounding box.
+    float centroid_x = 0.f, centroid_y = 0.f;
+    float mean_depth_units = 0.f;                       // Raw depth, multiply by the depth scale for meters.
+};
+
+class connected_components {
+public:
+    // max_depth_step is the largest depth difference between connected neighbours, 0 connects any two of them.
+    void label( const uint16_t* depth, int width, int height, uint16_t max_units, uint16_t max_depth_step = 0 ) {
+        label_region( depth, width, 0, 0, width, height, max_units, max_depth_step );
+    }
+
+    // Same as label(), on the width x height rectangle at (region_x, region_y) of a frame frame_width pixels wide.
+    void label_region( const uint16_t* frame, int frame_width, int region_x, int region_y, int width, int height,
+                       uint16_t max_units, uint16_t max_depth_step = 0 ) {
+        _region_x = region_x;
+        _region_y = region_y;
+        _width = width;
+        _height = height;
+        const uint16_t* depth = frame + static_cast<size_t>(region_y) * frame_width + region_x;
+        _blobs.clear();
+        const size_t pixels = static_cast<size_t>(width) * height;
+        _parent.resize( pixels );
+        _labels.resize( pixels );
+        if ( pixels == 0 )
+            return;
+
+        auto foreground = [=]( uint16_t d ) { return static_cast<uint16_t>(d - 1) < max_units; };
+        auto connected = [=]( uint16_t a, uint16_t b ) { return max_depth_step == 0 || std::abs( a - b ) <= max_depth_step; };
+
+#ifdef _OPENMP
+        const int max_threads = omp_get_max_threads();
+#else
+        const int max_threads = 1;
+#endif
+        const int bands = std::max( 1, std::min( max_threads, height / min_band_height ) );
+
+        // Pass 1: union-find inside each band. Background pixels get -1, foreground ones point to their root,
+        // which is always the smallest pixel index of the set.
+#pragma omp parallel for schedule(static, 1)
+        for ( int band = 0; band < bands; band++ ) {
+            const int y_begin = band_begin( band, bands );
+            const int y_end = band_begin( band + 1, bands );
+            for ( int y = y_begin; y < y_end; y++ ) {
+                const uint16_t* row = depth + static_cast<size_t>(y) * frame_width;
+                const uint16_t* above = row - frame_width;
+                const int32_t first = y * width;
+                for ( int x = 0; x < width; x++ ) {
+                    const int32_t i = first + x;
+                    if ( !foreground( row[x] ) ) {
+                        _parent[i] = -1;
+                        continue;
+                    }
+                    _parent[i] = i;
+                    if ( x > 0 && _parent[i - 1] >= 0 && connected( row[x], row[x - 1] ) )
+                        unite( i, i - 1 );
+                    if ( y > y_begin ) {
+                        for ( int dx = -1; dx <= 1; dx++ ) {
+                            const int nx = x + dx;
+                            if ( nx >= 0 && nx < width && _parent[i - width + dx] >= 0 && connected( row[x], above[nx] ) )
+                                unite( i, i - width + dx );
+                        }
+                    }
+                }
+            }
+        }
+
+        // Pass 2: merge the sets across the seams, a row per seam.
+        for ( int band = 1; band < bands; band++ ) {
+            const int y = band_begin( band, bands );
+            const uint16_t* row = depth + static_cast<size_t>(y) * frame_width;
+            const uint16_t* above = row - frame_width;
+            for ( int x = 0; x < width; x++ ) {
+                const int32_t i = y * width + x;
+                if ( _parent[i] < 0 )
+                    continue;
+                for ( int dx = -1; dx <= 1; dx++ ) {
+                    const int nx = x + dx;
+                    if ( nx >= 0 && nx < width && _parent[i - width + dx] >= 0 && connected( row[x], above[nx] ) )
+                        unite( i, i - width + dx );
+                }
+            }
+        }
+
+        // Pass 3: number the roots in scan order, band after band.
+        std::vector<int> band_roots( bands + 1, 0 );
+#pragma omp parallel for schedule(static, 1)
+        for ( int band = 0; band < bands; band++ ) {
+            int count = 0;
+            const int32_t end = band_begin( band + 1, bands ) * width;
+            for ( int32_t i = band_begin( band, bands ) * width; i < end; i++ )
+                count += _parent[i] == i;
+            band_roots[band + 1] = count;
+        }
+        for ( int band = 0; band < bands; band++ )
+            band_roots[band + 1] += band_roots[band];
+        const int count = band_roots[bands];
+
+#pragma omp parallel for schedule(static, 1)
+        for ( int band = 0; band < bands; band++ ) {
+            int next = band_roots[band];
+            const int32_t end = band_begin( band + 1, bands ) * width;
+            for ( int32_t i = band_begin( band, bands ) * width; i < end; i++ )
+                if ( _parent[i] == i )
+                    _labels[i] = next++;
+        }
+
+        // Pass 4: label every pixel and accumulate the statistics of its blob. Accumulators are all zero between
+        // frames, each band only resets those of the blobs it touched.
+        _partial.resize( bands );
+        for ( auto& band : _partial )
+            band.acc.resize( count );
+
+#pragma omp parallel for schedule(static, 1)
+        for ( int band = 0; band < bands; band++ ) {
+            std::vector<accumulator>& acc = _partial[band].acc;
+            std::vector<int>& touched = _partial[band].touched;
+            for ( int y = band_begin( band, bands ); y < band_begin( band + 1, bands ); y++ ) {
+                const uint16_t* row = depth + static_cast<size_t>(y) * frame_width;
+                for ( int x = 0; x < width; x++ ) {
+                    const int32_t i = y * width + x;
+                    if ( _parent[i] < 0 ) {
+                        _labels[i] = -1;
+                        continue;
+                    }
+                    // Roots were labeled in pass 3 and are not written here, any thread can read them.
+                    const int32_t root = find_root( i );
+                    const int label = _labels[root];
+                    if ( root != i )
+                        _labels[i] = label;
+
+                    accumulator& a = acc[label];
+                    if ( a.area == 0 ) {
+                        touched.push_back( label );
+                        a.min_x = a.max_x = x;
+                        a.min_y = a.max_y = y;
+                    }
+                    a.area++;
+                    a.min_x = std::min( a.min_x, x );
+                    a.max_x = std::max( a.max_x, x );
+                    a.max_y = y;
+                    a.sum_x += x;
+                    a.sum_y += y;
+                    a.sum_depth += row[x];
+                }
+            }
+        }
+
+        // Bands in order, so a blob's first band has its top row and its last band its bottom row.
+        _totals.assign( count, accumulator() );
+        for ( auto& band : _partial ) {
+            for ( int label : band.touched ) {
+                accumulator& a = band.acc[label];
+                accumulator& total = _totals[label];
+                if ( total.area == 0 ) {
+                    total.min_x = a.min_x;
+                    total.min_y = a.min_y;
+                    total.max_x = a.max_x;
+                }
+                total.area += a.area;
+                total.min_x = std::min( total.min_x, a.min_x );
+                total.max_x = std::max( total.max_x, a.max_x );
+                total.max_y = a.max_y;
+                total.sum_x += a.sum_x;
+                total.sum_y += a.sum_y;
+                total.sum_depth += a.sum_depth;
+                a = accumulator();
+            }
+            band.touched.clear();
+        }
+
+        _blobs.resize( count );
+        for ( int label = 0; label < count; label++ ) {
+            const accumulator& total = _totals[label];
+            blob& b = _blobs[label];
+            b.area = total.area;
+            b.min_x = total.min_x + region_x;
+            b.min_y = total.min_y + region_y;
+            b.max_x = total.max_x + region_x;
+            b.max_y = total.max_y + region_y;
+            b.centroid_x = static_cast<float>(static_cast<double>(total.sum_x) / total.area) + region_x;
+            b.centroid_y = static_cast<float>(static_cast<double>(total.sum_y) / total.area) + region_y;
+            b.mean_depth_units = static_cast<float>(static_cast<double>(total.sum_depth) / total.area);
+        }
+    }
+
+    // Rectangle labeled by the last call.
+    int region_x() const { return _region_x; }
+    int region_y() const { return _region_y; }
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    const std::vector<blob>& blobs() const { return _blobs; }
+
+    // Index in blobs() of every pixel of the region, -1 for the background. Tightly packed, width() x height().
+    const int32_t* labels() const { return _labels.data(); }
+
+    // Index of the blob with the most pixels, -1 if there is none.
+    int largest() const {
+        int best = -1;
+        for ( int i = 0; i < static_cast<int>(_blobs.size()); i++ )
+            if ( best < 0 || _blobs[i].area > _blobs[best].area )
+                best = i;
+        return best;
+    }
+
+private:
+    struct accumulator {
+        int area = 0;
+        int min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+        uint64_t sum_x = 0, sum_y = 0, sum_depth = 0;
+    };
+
+    struct band_statistics {
+        std::vector<accumulator> acc;       // Per blob.
+        std::vector<int> touched;           // Blobs with pixels in the band, in the order they were met.
+    };
+
+    // Bands are at least this many rows, so the seams stay a small part of the work.
+    static const int min_band_height = 16;
+
+    int band_begin( int band, int bands ) const {
+        return static_cast<int>(static_cast<int64_t>(_height) * band / bands);
+    }
+
+    // Path halving, only ever called on the pixels of one band at a time in passes 1 and 2.
+    int32_t find( int32_t i ) {
+        while ( _parent[i] != i ) {
+            _parent[i] = _parent[_parent[i]];
+            i = _parent[i];
+        }
+        return i;
+    }
+
+    // Read-only, used once every set is complete and several threads look roots up.
+    int32_t find_root( int32_t i ) const {
+        while ( _parent[i] != i )
+            i = _parent[i];
+        return i;
+    }
+
+    void unite( int32_t a, int32_t b ) {
+        a = find( a );
+        b = find( b );
+        if ( a < b )
+            _parent[b] = a;
+        else if ( b < a )
+            _parent[a] = b;
+    }
+
+    int _region_x = 0;
+    int _region_y = 0;
+    int _width = 0;
+    int _height = 0;
+    std::vector<int32_t> _parent;
+    std::vector<int32_t> _labels;
+    std::vector<blob> _blobs;
+    std::vector<band_statistics> _partial;    // Per band statistics, kept between frames.
+    std::vector<accumulator> _totals;
+};
@@ -0,0 +1,231 @@
+// depth-background.hpp : Per-pixel model of the background depth, learned from the stream.
+//
+// Every pixel keeps the mean and variance of its depth. While a pixel has few samples they are exact running
+// statistics (Welford's update); once the weight of a new sample drops to adapt_rate they become exponentially
+// weighted, so the model follows slow changes of the scene. A pixel is foreground when its depth is closer than
+// the background by more than both sigmas standard deviations and a minimum gap that grows with distance, like the
+// noise of a stereo camera does. Foreground pixels do not update the model once the first learn_frames frames
+// have been seen, so a person standing still is not absorbed into the background.
+//
+// The update and the classification are a single pass over the frame, 8 pixels at a time with AVX2.
+#pragma once
+
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+struct depth_background_options {
+    int learn_frames = 60;          // Every valid pixel updates the model during the first frames.
+    float adapt_rate = 0.01f;       // Weight of a new sample once a pixel has enough of them.
+    float sigmas = 3.f;             // How many standard deviations closer than the background foreground must be...
+    float min_gap_meters = 0.05f;   // ...and at least this much closer,
+    float relative_gap = 0.02f;     // plus this fraction of the background distance.
+};
+
+// Values of depth_background_options for one frame, in raw depth units.
+struct depth_background_params {
+    float adapt_rate;
+    float sigmas_squared;
+    float min_gap_units;
+    float relative_gap;
+    float max_count;        // Counts stop there, the weight is adapt_rate past it.
+    bool learning;
+};
+
+// Writes the depth of foreground pixels to foreground, 0 for background and pixels without depth.
+// Pixels without a background yet (never had depth) are learned as background the first time they get some.
+inline void update_depth_background_scalar( const uint16_t* depth, float* mean, float* variance, float* count, uint16_t* foreground,
+                                            int width, const depth_background_params& p ) {
+    for ( int i = 0; i < width; i++ ) {
+        const float d = depth[i];
+        const bool valid = depth[i] != 0;
+        const float diff = mean[i] - d;
+        const float gap = p.min_gap_units + p.relative_gap * mean[i];
+        const bool is_foreground = valid && count[i] > 0.f && diff > gap && diff * diff > p.sigmas_squared * variance[i];
+        foreground[i] = is_foreground ? depth[i] : 0;
+
+        if ( valid && (p.learning || !is_foreground) ) {
+            const float weight = std::max( 1.f / (count[i] + 1.f), p.adapt_rate );
+            const float delta = d - mean[i];
+            const float new_mean = mean[i] + weight * delta;
+            variance[i] = variance[i] + weight * (delta * (d - new_mean) - variance[i]);
+            mean[i] = new_mean;
+            count[i] = std::min( count[i] + 1.f, p.max_count );
+        }
+    }
+}
+
+#if RS_SIMD_X86
+RS_TARGET_SSE41 inline void update_depth_background_sse41( const uint16_t* depth, float* mean, float* variance, float* count, uint16_t* foreground,
+                                                           int width, const depth_background_params& p ) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps( 1.f );
+    const __m128 all = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+    const __m128 adapt_rate = _mm_set1_ps( p.adapt_rate );
+    const __m128 sigmas_squared = _mm_set1_ps( p.sigmas_squared );
+    const __m128 min_gap = _mm_set1_ps( p.min_gap_units );
+    const __m128 relative_gap = _mm_set1_ps( p.relative_gap );
+    const __m128 max_count = _mm_set1_ps( p.max_count );
+    const __m128 learning = p.learning ? all : zero;
+
+    int i = 0;
+    for ( ; i + 8 <= width; i += 8 ) {
+        const __m128i d16 = _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + i) );
+        __m128i fg32[2];
+        for ( int half = 0; half < 2; half++ ) {
+            const int j = i + half * 4;
+            const __m128i d32 = _mm_cvtepu16_epi32( half ? _mm_srli_si128( d16, 8 ) : d16 );
+            const __m128 d = _mm_cvtepi32_ps( d32 );
+            const __m128 m = _mm_loadu_ps( mean + j );
+            const __m128 v = _mm_loadu_ps( variance + j );
+            const __m128 n = _mm_loadu_ps( count + j );
+
+            const __m128 valid = _mm_cmpgt_ps( d, zero );
+            const __m128 diff = _mm_sub_ps( m, d );
+            const __m128 gap = _mm_add_ps( min_gap, _mm_mul_ps( relative_gap, m ) );
+            __m128 fg = _mm_and_ps( valid, _mm_cmpgt_ps( n, zero ) );
+            fg = _mm_and_ps( fg, _mm_cmpgt_ps( diff, gap ) );
+            fg = _mm_and_ps( fg, _mm_cmpgt_ps( _mm_mul_ps( diff, diff ), _mm_mul_ps( sigmas_squared, v ) ) );
+            fg32[half] = _mm_and_si128( _mm_castps_si128( fg ), d32 );
+
+            const __m128 update = _mm_and_ps( valid, _mm_or_ps( learning, _mm_andnot_ps( fg, all ) ) );
+            const __m128 weight = _mm_max_ps( _mm_div_ps( one, _mm_add_ps( n, one ) ), adapt_rate );
+            const __m128 delta = _mm_sub_ps( d, m );
+            const __m128 new_mean = _mm_add_ps( m, _mm_mul_ps( weight, delta ) );
+            const __m128 new_variance = _mm_add_ps( v, _mm_mul_ps( weight, _mm_sub_ps( _mm_mul_ps( delta, _mm_sub_ps( d, new_mean ) ), v ) ) );
+            const __m128 new_count = _mm_min_ps( _mm_add_ps( n, one ), max_count );
+            _mm_storeu_ps( mean + j, _mm_blendv_ps( m, new_mean, update ) );
+            _mm_storeu_ps( variance + j, _mm_blendv_ps( v, new_variance, update ) );
+            _mm_storeu_ps( count + j, _mm_blendv_ps( n, new_count, update ) );
+        }
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(foreground + i), _mm_packus_epi32( fg32[0], fg32[1] ) );
+    }
+    update_depth_background_scalar( depth + i, mean + i, variance + i, count + i, foreground + i, width - i, p );
+}
+
+RS_TARGET_AVX2 inline void update_depth_background_avx2( const uint16_t* depth, float* mean, float* variance, float* count, uint16_t* foreground,
+                                                         int width, const depth_background_params& p ) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps( 1.f );
+    const __m256 all = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+    const __m256 adapt_rate = _mm256_set1_ps( p.adapt_rate );
+    const __m256 sigmas_squared = _mm256_set1_ps( p.sigmas_squared );
+    const __m256 min_gap = _mm256_set1_ps( p.min_gap_units );
+    const __m256 relative_gap = _mm256_set1_ps( p.relative_gap );
+    const __m256 max_count = _mm256_set1_ps( p.max_count );
+    const __m256 learning = p.learning ? all : zero;
+
+    int i = 0;
+    for ( ; i + 16 <= width; i += 16 ) {
+        const __m256i d16 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(depth + i) );
+        __m256i fg32[2];
+        for ( int half = 0; half < 2; half++ ) {
+            const int j = i + half * 8;
+            const __m256i d32 = _mm256_cvtepu16_epi32( half ? _mm256_extracti128_si256( d16, 1 ) : _mm256_castsi256_si128( d16 ) );
+            const __m256 d = _mm256_cvtepi32_ps( d32 );
+            const __m256 m = _mm256_loadu_ps( mean + j );
+            const __m256 v = _mm256_loadu_ps( variance + j );
+            const __m256 n = _mm256_loadu_ps( count + j );
+
+            const __m256 valid = _mm256_cmp_ps( d, zero, _CMP_GT_OQ );
+            const __m256 diff = _mm256_sub_ps( m, d );
+            const __m256 gap = _mm256_add_ps( min_gap, _mm256_mul_ps( relative_gap, m ) );
+            __m256 fg = _mm256_and_ps( valid, _mm256_cmp_ps( n, zero, _CMP_GT_OQ ) );
+            fg = _mm256_and_ps( fg, _mm256_cmp_ps( diff, gap, _CMP_GT_OQ ) );
+            fg = _mm256_and_ps( fg, _mm256_cmp_ps( _mm256_mul_ps( diff, diff ), _mm256_mul_ps( sigmas_squared, v ), _CMP_GT_OQ ) );
+            fg32[half] = _mm256_and_si256( _mm256_castps_si256( fg ), d32 );
+
+            const __m256 update = _mm256_and_ps( valid, _mm256_or_ps( learning, _mm256_andnot_ps( fg, all ) ) );
+            const __m256 weight = _mm256_max_ps( _mm256_div_ps( one, _mm256_add_ps( n, one ) ), adapt_rate );
+            const __m256 delta = _mm256_sub_ps( d, m );
+            const __m256 new_mean = _mm256_add_ps( m, _mm256_mul_ps( weight, delta ) );
+            const __m256 new_variance = _mm256_add_ps( v, _mm256_mul_ps( weight, _mm256_sub_ps( _mm256_mul_ps( delta, _mm256_sub_ps( d, new_mean ) ), v ) ) );
+            const __m256 new_count = _mm256_min_ps( _mm256_add_ps( n, one ), max_count );
+            _mm256_storeu_ps( mean + j, _mm256_blendv_ps( m, new_mean, update ) );
+            _mm256_storeu_ps( variance + j, _mm256_blendv_ps( v, new_variance, update ) );
+            _mm256_storeu_ps( count + j, _mm256_blendv_ps( n, new_count, update ) );
+        }
+        // packus works within 128-bit lanes, put the quarters back in pixel order.
+        const __m256i packed = _mm256_packus_epi32( fg32[0], fg32[1] );
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(foreground + i), _mm256_permute4x64_epi64( packed, _MM_SHUFFLE( 3, 1, 2, 0 ) ) );
+    }
+    update_depth_background_scalar( depth + i, mean + i, variance + i, count + i, foreground + i, width - i, p );
+}
+#endif
+
+inline void update_depth_background_row( const uint16_t* depth, float* mean, float* variance, float* count, uint16_t* foreground,
+                                         int width, const depth_background_params& p, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level == simd_level::avx2 )
+        return update_depth_background_avx2( depth, mean, variance, count, foreground, width, p );
+    if ( level == simd_level::sse41 )
+        return update_depth_background_sse41( depth, mean, variance, count, foreground, width, p );
+#endif
+    update_depth_background_scalar( depth, mean, variance, count, foreground, width, p );
+}
+
+class depth_background {
+public:
+    explicit depth_background( depth_background_options options = depth_background_options() )
+        : _options( options ) {}
+
+    // Forgets the learned background, the next frames are learned from scratch.
+    void reset() {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _width = 0;
+        _height = 0;
+    }
+
+    // Frames seen since the last reset.
+    int frames() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _frames;
+    }
+
+    // Classifies a tightly packed Z16 frame and updates the model with it, see update_depth_background_scalar().
+    // foreground is width x height, tightly packed. A change of resolution resets the model.
+    // Frames from several threads are applied one at a time.
+    void apply( const uint16_t* depth, int width, int height, float depth_scale, uint16_t* foreground ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( width != _width || height != _height ) {
+            const size_t pixels = static_cast<size_t>(width) * height;
+            _mean.assign( pixels, 0.f );
+            _variance.assign( pixels, 0.f );
+            _count.assign( pixels, 0.f );
+            _width = width;
+            _height = height;
+            _frames = 0;
+        }
+
+        depth_background_params p;
+        p.adapt_rate = _options.adapt_rate;
+        p.sigmas_squared = _options.sigmas * _options.sigmas;
+        p.min_gap_units = depth_scale > 0.f ? _options.min_gap_meters / depth_scale : 0.f;
+        p.relative_gap = _options.relative_gap;
+        // Past 1 / adapt_rate samples the weight no longer depends on the count.
+        p.max_count = _options.adapt_rate > 0.f ? std::ceil( 1.f / _options.adapt_rate ) : 65535.f;
+        p.learning = _frames < _options.learn_frames;
+        const simd_level level = get_simd_level();
+
+#pragma omp parallel for schedule(static)
+        for ( int y = 0; y < height; y++ ) {
+            const size_t offset = static_cast<size_t>(y) * width;
+            update_depth_background_row( depth + offset, &_mean[offset], &_variance[offset], &_count[offset], foreground + offset, width, p, level );
+        }
+        _frames++;
+    }
+
+private:
+    depth_background_options _options;
+
+    mutable std::mutex _mutex;
+    int _width = 0;
+    int _height = 0;
+    int _frames = 0;
+    std::vector<float> _mean, _variance, _count;
+};
@@ -0,0 +1,212 @@
+// depth-clipping.hpp : Vectorized kernels that paint pixels outside of a depth range with a background color.
+//
+// The depth test is done on raw Z16 units: the clipping distance is converted to a depth unit threshold once
+// per frame instead of multiplying every pixel by the depth scale.
+// Kernels read the other stream from "src" and write the result to "dst", so SDK frames can be left untouched.
+// Passing the same buffer for both clips in place.
+#pragma once
+
+#include "simd.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Color used to paint background pixels, repeated for every byte of the pixel (0x999999).
+const uint8_t background_fill_byte = 0x99;
+
+// Converts a clipping distance in meters to the largest raw depth value that is still considered foreground.
+// A pixel with raw depth d is foreground if and only if 0 < d <= returned value, which gives exactly the same
+// answer as testing "depth_scale * d <= 0.f || depth_scale * d > clipping_dist" in float for every d.
+inline uint16_t clipping_dist_to_depth_units( float depth_scale, float clipping_dist ) {
+    // A device always reports a positive scale, anything else means no pixel can be trusted.
+    if ( !(depth_scale > 0.f) || !std::isfinite( depth_scale ) )
+        return 0;
+
+    // depth_scale * d is monotonic in d, so binary search for the first value that is too far.
+    uint32_t first_too_far = 1;
+    uint32_t last = 65536;
+    while ( first_too_far < last ) {
+        uint32_t mid = (first_too_far + last) / 2;
+        if ( depth_scale * static_cast<float>(mid) > clipping_dist )
+            last = mid;
+        else
+            first_too_far = mid + 1;
+    }
+    return static_cast<uint16_t>(first_too_far - 1);
+}
+
+// Scalar kernel, used for the tail of each row and on CPUs without SSE4.1.
+// Subtracting one makes 0 wrap to 65535 so both "no data" and "too far" are caught by a single unsigned compare.
+template <int BPP>
+inline void clip_background_scalar( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int count, uint16_t max_units ) {
+    for ( int i = 0; i < count; i++ ) {
+        const bool background = static_cast<uint16_t>(depth[i] - 1) >= max_units;
+        for ( int b = 0; b < BPP; b++ )
+            dst[i * BPP + b] = background ? background_fill_byte : src[i * BPP + b];
+    }
+}
+
+inline void clip_background_scalar_any( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int count, int bpp, uint16_t max_units ) {
+    for ( int i = 0; i < count; i++ ) {
+        if ( static_cast<uint16_t>(depth[i] - 1) >= max_units )
+            std::memset( &dst[i * bpp], background_fill_byte, bpp );
+        else if ( src != dst )
+            std::memcpy( &dst[i * bpp], &src[i * bpp], bpp );
+    }
+}
+
+#if RS_SIMD_X86
+// Byte shuffles spreading a 16 pixel byte mask over the 48 bytes of 16 packed 3-byte pixels.
+RS_TARGET_SSE41 inline void expand_mask_bpp3( __m128i mask, __m128i out[3] ) {
+    const __m128i shuffle0 = _mm_setr_epi8( 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 );
+    const __m128i shuffle1 = _mm_setr_epi8( 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 );
+    const __m128i shuffle2 = _mm_setr_epi8( 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 );
+    out[0] = _mm_shuffle_epi8( mask, shuffle0 );
+    out[1] = _mm_shuffle_epi8( mask, shuffle1 );
+    out[2] = _mm_shuffle_epi8( mask, shuffle2 );
+}
+
+RS_TARGET_SSE41 inline void blend_fill_16( const uint8_t* src, uint8_t* dst, __m128i mask ) {
+    const __m128i fill = _mm_set1_epi8( static_cast<char>(background_fill_byte) );
+    __m128i pixels = _mm_loadu_si128( reinterpret_cast<const __m128i*>(src) );
+    _mm_storeu_si128( reinterpret_cast<__m128i*>(dst), _mm_blendv_epi8( pixels, fill, mask ) );
+}
+
+RS_TARGET_AVX2 inline void blend_fill_32( const uint8_t* src, uint8_t* dst, __m256i mask ) {
+    const __m256i fill = _mm256_set1_epi8( static_cast<char>(background_fill_byte) );
+    __m256i pixels = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src) );
+    _mm256_storeu_si256( reinterpret_cast<__m256i*>(dst), _mm256_blendv_epi8( pixels, fill, mask ) );
+}
+
+// SSE4.1 kernel: 16 depth samples per iteration, as two registers of 8.
+template <int BPP>
+RS_TARGET_SSE41 void clip_background_sse41( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int count, uint16_t max_units ) {
+    const __m128i one = _mm_set1_epi16( 1 );
+    const __m128i limit = _mm_set1_epi16( static_cast<short>(max_units) );
+
+    int i = 0;
+    for ( ; i + 16 <= count; i += 16 ) {
+        __m128i d0 = _mm_sub_epi16( _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + i) ), one );
+        __m128i d1 = _mm_sub_epi16( _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + i + 8) ), one );
+        // (d - 1) >= max_units, as unsigned: max(d - 1, max_units) == d - 1.
+        __m128i bg0 = _mm_cmpeq_epi16( _mm_max_epu16( d0, limit ), d0 );
+        __m128i bg1 = _mm_cmpeq_epi16( _mm_max_epu16( d1, limit ), d1 );
+
+        // Nothing to paint in this block, which is the common case inside the foreground.
+        const uint8_t* in = src + i * BPP;
+        uint8_t* out = dst + i * BPP;
+        __m128i any = _mm_or_si128( bg0, bg1 );
+        if ( _mm_testz_si128( any, any ) ) {
+            if ( in != out )
+                std::memcpy( out, in, 16 * BPP );
+            continue;
+        }
+
+        switch ( BPP ) {
+        case 1:
+            blend_fill_16( in, out, _mm_packs_epi16( bg0, bg1 ) );
+            break;
+        case 2:
+            blend_fill_16( in, out, bg0 );
+            blend_fill_16( in + 16, out + 16, bg1 );
+            break;
+        case 3:
+        {
+            __m128i masks[3];
+            expand_mask_bpp3( _mm_packs_epi16( bg0, bg1 ), masks );
+            blend_fill_16( in, out, masks[0] );
+            blend_fill_16( in + 16, out + 16, masks[1] );
+            blend_fill_16( in + 32, out + 32, masks[2] );
+            break;
+        }
+        case 4:
+            blend_fill_16( in, out, _mm_cvtepi16_epi32( bg0 ) );
+            blend_fill_16( in + 16, out + 16, _mm_cvtepi16_epi32( _mm_srli_si128( bg0, 8 ) ) );
+            blend_fill_16( in + 32, out + 32, _mm_cvtepi16_epi32( bg1 ) );
+            blend_fill_16( in + 48, out + 48, _mm_cvtepi16_epi32( _mm_srli_si128( bg1, 8 ) ) );
+            break;
+        }
+    }
+    clip_background_scalar<BPP>( depth + i, src + i * BPP, dst + i * BPP, count - i, max_units );
+}
+
+// AVX2 kernel: 16 depth samples compared by a single instruction.
+template <int BPP>
+RS_TARGET_AVX2 void clip_background_avx2( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int count, uint16_t max_units ) {
+    const __m256i one = _mm256_set1_epi16( 1 );
+    const __m256i limit = _mm256_set1_epi16( static_cast<short>(max_units) );
+
+    int i = 0;
+    for ( ; i + 16 <= count; i += 16 ) {
+        __m256i d = _mm256_sub_epi16( _mm256_loadu_si256( reinterpret_cast<const __m256i*>(depth + i) ), one );
+        __m256i bg = _mm256_cmpeq_epi16( _mm256_max_epu16( d, limit ), d );
+
+        const uint8_t* in = src + i * BPP;
+        uint8_t* out = dst + i * BPP;
+        if ( _mm256_testz_si256( bg, bg ) ) {
+            if ( in != out )
+                std::memcpy( out, in, 16 * BPP );
+            continue;
+        }
+
+        __m128i bg_lo = _mm256_castsi256_si128( bg );
+        __m128i bg_hi = _mm256_extracti128_si256( bg, 1 );
+        switch ( BPP ) {
+        case 1:
+            blend_fill_16( in, out, _mm_packs_epi16( bg_lo, bg_hi ) );
+            break;
+        case 2:
+            blend_fill_32( in, out, bg );
+            break;
+        case 3:
+        {
+            __m128i masks[3];
+            expand_mask_bpp3( _mm_packs_epi16( bg_lo, bg_hi ), masks );
+            blend_fill_32( in, out, _mm256_setr_m128i( masks[0], masks[1] ) );
+            blend_fill_16( in + 32, out + 32, masks[2] );
+            break;
+        }
+        case 4:
+            blend_fill_32( in, out, _mm256_cvtepi16_epi32( bg_lo ) );
+            blend_fill_32( in + 32, out + 32, _mm256_cvtepi16_epi32( bg_hi ) );
+            break;
+        }
+    }
+    clip_background_scalar<BPP>( depth + i, src + i * BPP, dst + i * BPP, count - i, max_units );
+}
+#endif
+
+template <int BPP>
+inline void clip_background_span( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int count, uint16_t max_units, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level == simd_level::avx2 )
+        return clip_background_avx2<BPP>( depth, src, dst, count, max_units );
+    if ( level == simd_level::sse41 )
+        return clip_background_sse41<BPP>( depth, src, dst, count, max_units );
+#endif
+    clip_background_scalar<BPP>( depth, src, dst, count, max_units );
+}
+
+// Clips a single row, for callers that already split the work between threads.
+inline void clip_background_row( const uint16_t* depth_row, const uint8_t* src_row, uint8_t* dst_row, int width, int other_bpp, uint16_t max_units, simd_level level ) {
+    switch ( other_bpp ) {
+    case 1: clip_background_span<1>( depth_row, src_row, dst_row, width, max_units, level ); break;
+    case 2: clip_background_span<2>( depth_row, src_row, dst_row, width, max_units, level ); break;
+    case 3: clip_background_span<3>( depth_row, src_row, dst_row, width, max_units, level ); break;
+    case 4: clip_background_span<4>( depth_row, src_row, dst_row, width, max_units, level ); break;
+    default: clip_background_scalar_any( depth_row, src_row, dst_row, width, other_bpp, max_units ); break;
+    }
+}
+
+// Copies "src" to "dst", painting every pixel whose depth is 0 or greater than max_units with the background color.
+// All buffers must be tightly packed and have the same width and height.
+inline void clip_background( const uint16_t* depth, const uint8_t* src, uint8_t* dst, int width, int height, int other_bpp, uint16_t max_units ) {
+    const simd_level level = get_simd_level();
+
+#pragma omp parallel for schedule(static)  // Rows are independent, and all cost the same.
+    for ( int y = 0; y < height; y++ ) {
+        const size_t offset = static_cast<size_t>(y) * width * other_bpp;
+        clip_background_row( depth + static_cast<size_t>(y) * width, src + offset, dst + offset, width, other_bpp, max_units, level );
+    }
+}
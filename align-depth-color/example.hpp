@@ -120,27 +120,32 @@ public:
     {
         if (!frame) return;
 
+        upload(frame.get_data(), frame.get_width(), frame.get_height(), frame.get_profile().format(), frame.get_profile().stream_type());
+    }
+
+    // Uploads tightly packed pixels that do not live in an rs2::frame, e.g. a processing result.
+    void upload(const void* data, int width, int height, rs2_format format, rs2_stream stream_type)
+    {
+        if (!data) return;
+
         if (!gl_handle)
             glGenTextures(1, &gl_handle);
         GLenum err = glGetError();
 
-        auto format = frame.get_profile().format();
-        auto width = frame.get_width();
-        auto height = frame.get_height();
-        stream = frame.get_profile().stream_type();
+        stream = stream_type;
 
         glBindTexture(GL_TEXTURE_2D, gl_handle);
 
         switch (format)
         {
         case RS2_FORMAT_RGB8:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, frame.get_data());
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
             break;
         case RS2_FORMAT_RGBA8:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame.get_data());
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
             break;
         case RS2_FORMAT_Y8:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frame.get_data());
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
             break;
         default:
             throw std::runtime_error("The requested format is not supported by this demo!");
@@ -0,0 +1,151 @@
+// filter-chain.hpp : Ordered list of librealsense post-processing filters built from a textual description.
+//
+// A chain is a comma (or newline) separated list of filters, each optionally followed by ":option=value" pairs:
+//     decimation:magnitude=3,threshold:min=0.2:max=4,disparity,spatial:alpha=0.5,temporal,depth,holes:mode=1
+// Filters are applied in the given order to the whole frameset, so only depth frames are touched.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class filter_chain {
+public:
+    filter_chain() = default;
+
+    explicit filter_chain( const std::string& description ) {
+        std::string normalized = description;
+        std::replace( normalized.begin(), normalized.end(), '\n', ',' );
+
+        std::stringstream entries( normalized );
+        std::string entry;
+        while ( std::getline( entries, entry, ',' ) ) {
+            entry = trim( entry );
+            if ( !entry.empty() )
+                add( entry );
+        }
+
+        // Alignment and masking work on Z16 depth, go back from disparity if the chain did not.
+        if ( _in_disparity )
+            add( "depth" );
+    }
+
+    // Same syntax as the constructor, one or more filters per line, '#' starts a comment.
+    static filter_chain from_file( const std::string& filename ) {
+        std::ifstream file( filename );
+        if ( !file )
+            throw std::runtime_error( "Could not open filter chain file " + filename );
+
+        std::stringstream content;
+        std::string line;
+        while ( std::getline( file, line ) )
+            content << line.substr( 0, line.find( '#' ) ) << '\n';
+        return filter_chain( content.str() );
+    }
+
+    bool empty() const { return _filters.empty(); }
+
+    rs2::frameset process( rs2::frameset frames ) {
+        for ( auto& f : _filters ) {
+            auto start = std::chrono::steady_clock::now();
+            frames = frames.apply_filter( *f.block );
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            // Exponential moving average, so the report follows changes in the scene.
+            f.average_ms = f.calls ? f.average_ms + (elapsed.count() - f.average_ms) * 0.05 : elapsed.count();
+            f.calls++;
+        }
+        return frames;
+    }
+
+    // Writes the average time spent in each filter, e.g. "decimation 0.41 ms, spatial 3.20 ms".
+    void report( std::ostream& out ) const {
+        out << std::fixed << std::setprecision( 2 );
+        for ( size_t i = 0; i < _filters.size(); i++ )
+            out << (i ? ", " : "") << _filters[i].name << " " << _filters[i].average_ms << " ms";
+    }
+
+private:
+    struct stage {
+        std::string name;
+        std::shared_ptr<rs2::filter> block;
+        double average_ms = 0.0;
+        uint64_t calls = 0;
+    };
+
+    static std::string trim( const std::string& s ) {
+        auto first = s.find_first_not_of( " \t\r" );
+        if ( first == std::string::npos )
+            return "";
+        return s.substr( first, s.find_last_not_of( " \t\r" ) - first + 1 );
+    }
+
+    static rs2_option option_from_name( const std::string& name ) {
+        if ( name == "magnitude" )   return RS2_OPTION_FILTER_MAGNITUDE;
+        if ( name == "alpha" )       return RS2_OPTION_FILTER_SMOOTH_ALPHA;
+        if ( name == "delta" )       return RS2_OPTION_FILTER_SMOOTH_DELTA;
+        if ( name == "min" )         return RS2_OPTION_MIN_DISTANCE;
+        if ( name == "max" )         return RS2_OPTION_MAX_DISTANCE;
+        // The temporal filter uses the holes fill option for its persistency mode.
+        if ( name == "holes" || name == "mode" || name == "persistence" )
+            return RS2_OPTION_HOLES_FILL;
+        throw std::invalid_argument( "Unknown filter option '" + name + "'" );
+    }
+
+    void add( const std::string& entry ) {
+        std::stringstream parts( entry );
+        std::string name;
+        std::getline( parts, name, ':' );
+        name = trim( name );
+
+        stage s;
+        s.name = name;
+        if ( name == "decimation" )
+            s.block = std::make_shared<rs2::decimation_filter>();
+        else if ( name == "threshold" )
+            s.block = std::make_shared<rs2::threshold_filter>();
+        else if ( name == "spatial" )
+            s.block = std::make_shared<rs2::spatial_filter>();
+        else if ( name == "temporal" )
+            s.block = std::make_shared<rs2::temporal_filter>();
+        else if ( name == "holes" )
+            s.block = std::make_shared<rs2::hole_filling_filter>();
+        else if ( name == "disparity" ) {
+            s.block = std::make_shared<rs2::disparity_transform>( true );
+            _in_disparity = true;
+        }
+        else if ( name == "depth" ) {
+            s.block = std::make_shared<rs2::disparity_transform>( false );
+            _in_disparity = false;
+        }
+        else
+            throw std::invalid_argument( "Unknown filter '" + name + "', expected decimation, threshold, spatial, temporal, holes, disparity or depth" );
+
+        std::string option;
+        while ( std::getline( parts, option, ':' ) ) {
+            auto equal = option.find( '=' );
+            if ( equal == std::string::npos )
+                throw std::invalid_argument( "Expected option=value in '" + entry + "'" );
+
+            rs2_option id = option_from_name( trim( option.substr( 0, equal ) ) );
+            if ( !s.block->supports( id ) )
+                throw std::invalid_argument( "Filter '" + name + "' does not support option '" + trim( option.substr( 0, equal ) ) + "'" );
+            s.block->set_option( id, std::stof( option.substr( equal + 1 ) ) );
+        }
+
+        _filters.push_back( s );
+    }
+
+    std::vector<stage> _filters;
+    bool _in_disparity = false;
+};
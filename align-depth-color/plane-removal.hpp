@@ -0,0 +1,354 @@
+// plane-removal.hpp : Finds the dominant plane of the scene (floor, table top) and removes it from depth.
+//
+// The plane is fitted on an organized point cloud decimated by a fixed step: RANSAC hypotheses are scored in
+// parallel, then the best one is refined by least squares on its inliers. Once found, the plane is tracked: every
+// frame refines it on its current inliers, and RANSAC only runs again when the residual grows or the inliers
+// are lost. Removing the plane from a full resolution frame costs two multiply-adds per pixel, the rays of
+// every pixel being cached from the intrinsics.
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include <librealsense2/rsutil.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+struct plane_removal_options {
+    int step = 4;                       // Decimation of the point cloud the plane is fitted on.
+    int iterations = 128;               // RANSAC hypotheses per fit.
+    float inlier_meters = 0.015f;       // Largest distance to the plane of a point on it.
+    float min_inlier_fraction = 0.15f;  // Smaller planes are ignored.
+    float residual_growth = 1.5f;       // Re-fit when the RMS distance of the inliers grows by this factor.
+    bool remove_beyond = true;          // Also remove what is behind the plane, seen from the camera.
+};
+
+// a * x + b * y + c * z + d = 0, in meters in the camera frame. The normal is a unit vector and d >= 0, so the
+// camera is on the positive side.
+struct plane_model {
+    float a = 0.f, b = 0.f, c = 0.f, d = 0.f;
+
+    float distance( float x, float y, float z ) const { return a * x + b * y + c * z + d; }
+};
+
+class plane_remover {
+public:
+    explicit plane_remover( plane_removal_options options = plane_removal_options() )
+        : _options( options ) {}
+
+    bool has_plane() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _has_plane;
+    }
+
+    plane_model plane() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _plane;
+    }
+
+    // Number of times the plane was searched with RANSAC rather than tracked.
+    int fits() const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _fits;
+    }
+
+    // Updates the plane from depth, then copies input to output with the pixels of the plane set to 0.
+    // depth and input are both tightly packed frames matching intrinsics, input can be depth, output can be input.
+    // Frames from several threads are applied one at a time.
+    void apply( const rs2_intrinsics& intrinsics, float depth_scale, const uint16_t* depth, const uint16_t* input, uint16_t* output ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        configure( intrinsics, depth_scale );
+        sample( depth );
+        update_plane();
+
+        const int width = _intrinsics.width;
+        const int height = _intrinsics.height;
+        if ( !_has_plane ) {
+            if ( input != output )
+                std::memcpy( output, input, static_cast<size_t>(width) * height * sizeof( uint16_t ) );
+            return;
+        }
+
+        // Signed distance of a pixel: z * (a * ray_x + b * ray_y + c) + d, z being its depth in meters.
+        const plane_model p = _plane;
+        const float scale = _depth_scale;
+        const float keep_above = _options.inlier_meters;
+        const float keep_below = _options.remove_beyond ? -1e30f : -_options.inlier_meters;
+
+#pragma omp parallel for schedule(static)
+        for ( int y = 0; y < height; y++ ) {
+            const size_t offset = static_cast<size_t>(y) * width;
+            const float* ray_x = &_ray_x[offset];
+            const float* ray_y = &_ray_y[offset];
+            const uint16_t* in = input + offset;
+            const uint16_t* fit = depth + offset;
+            uint16_t* out = output + offset;
+            for ( int x = 0; x < width; x++ ) {
+                const float z = fit[x] * scale;
+                const float distance = z * (p.a * ray_x[x] + p.b * ray_y[x] + p.c) + p.d;
+                const bool on_plane = fit[x] != 0 && distance <= keep_above && distance >= keep_below;
+                out[x] = on_plane ? 0 : in[x];
+            }
+        }
+    }
+
+private:
+    struct point {
+        float x, y, z;
+    };
+
+    void configure( const rs2_intrinsics& intrinsics, float depth_scale ) {
+        if ( _configured && std::memcmp( &intrinsics, &_intrinsics, sizeof( rs2_intrinsics ) ) == 0 && depth_scale == _depth_scale )
+            return;
+
+        _intrinsics = intrinsics;
+        _depth_scale = depth_scale;
+        const size_t pixels = static_cast<size_t>(intrinsics.width) * intrinsics.height;
+        _ray_x.resize( pixels );
+        _ray_y.resize( pixels );
+#pragma omp parallel for schedule(static)
+        for ( int y = 0; y < intrinsics.height; y++ ) {
+            for ( int x = 0; x < intrinsics.width; x++ ) {
+                const float pixel[2] = { static_cast<float>(x), static_cast<float>(y) };
+                float ray[3];
+                rs2_deproject_pixel_to_point( ray, &_intrinsics, pixel, 1.f );
+                _ray_x[static_cast<size_t>(y) * intrinsics.width + x] = ray[0];
+                _ray_y[static_cast<size_t>(y) * intrinsics.width + x] = ray[1];
+            }
+        }
+        _configured = true;
+        _has_plane = false;
+    }
+
+    void sample( const uint16_t* depth ) {
+        const int width = _intrinsics.width;
+        const int step = std::max( 1, _options.step );
+        _points.clear();
+        _total_samples = 0;
+        for ( int y = step / 2; y < _intrinsics.height; y += step ) {
+            for ( int x = step / 2; x < width; x += step ) {
+                const size_t i = static_cast<size_t>(y) * width + x;
+                _total_samples++;
+                if ( depth[i] == 0 )
+                    continue;
+                const float z = depth[i] * _depth_scale;
+                _points.push_back( point{ _ray_x[i] * z, _ray_y[i] * z, z } );
+            }
+        }
+    }
+
+    // Keeps tracking the plane while it fits, searches it again otherwise.
+    void update_plane() {
+        const size_t min_inliers = static_cast<size_t>(_options.min_inlier_fraction * _total_samples);
+        if ( _points.size() < 3 || _points.size() < min_inliers ) {
+            _has_plane = false;
+            return;
+        }
+
+        if ( _has_plane ) {
+            plane_model tracked = _plane;
+            float rms = 0.f;
+            const size_t inliers = refine( tracked, rms );
+            if ( inliers >= min_inliers && rms <= _options.residual_growth * std::max( _fit_rms, 0.25f * _options.inlier_meters ) ) {
+                _plane = tracked;
+                return;
+            }
+        }
+
+        _fits++;
+        plane_model candidate;
+        if ( !ransac( candidate ) ) {
+            _has_plane = false;
+            return;
+        }
+        // Two rounds, the inliers of the refined plane are a better set than those of the hypothesis.
+        float rms = 0.f;
+        size_t inliers = refine( candidate, rms );
+        inliers = refine( candidate, rms );
+        _has_plane = inliers >= min_inliers;
+        _plane = candidate;
+        _fit_rms = rms;
+    }
+
+    size_t count_inliers( const plane_model& p ) const {
+        const float threshold = _options.inlier_meters;
+        size_t count = 0;
+        for ( const point& q : _points )
+            count += std::fabs( p.distance( q.x, q.y, q.z ) ) <= threshold;
+        return count;
+    }
+
+    // Plane through three points, false if they are (almost) aligned.
+    static bool plane_through( const point& p0, const point& p1, const point& p2, plane_model& p ) {
+        const float ux = p1.x - p0.x, uy = p1.y - p0.y, uz = p1.z - p0.z;
+        const float vx = p2.x - p0.x, vy = p2.y - p0.y, vz = p2.z - p0.z;
+        float a = uy * vz - uz * vy;
+        float b = uz * vx - ux * vz;
+        float c = ux * vy - uy * vx;
+        const float norm = std::sqrt( a * a + b * b + c * c );
+        if ( norm < 1e-9f )
+            return false;
+        a /= norm;
+        b /= norm;
+        c /= norm;
+        oriented( a, b, c, -(a * p0.x + b * p0.y + c * p0.z), p );
+        return true;
+    }
+
+    // Flips the plane so the camera is on its positive side.
+    static void oriented( float a, float b, float c, float d, plane_model& p ) {
+        const float sign = d < 0.f ? -1.f : 1.f;
+        p.a = sign * a;
+        p.b = sign * b;
+        p.c = sign * c;
+        p.d = sign * d;
+    }
+
+    // Hypotheses are numbered, and each one picks its points from a hash of its number. On equal inlier counts the
+    // lowest number wins, in each thread and between threads, so the result does not depend on how OpenMP splits
+    // the iterations or on the order the threads finish in.
+    bool ransac( plane_model& best ) {
+        const uint32_t count = static_cast<uint32_t>(_points.size());
+        const uint32_t seed = static_cast<uint32_t>(_fits) * 0x9E3779B9u;
+        size_t best_inliers = 0;
+        int best_iteration = _options.iterations;
+
+#pragma omp parallel
+        {
+            plane_model thread_best;
+            size_t thread_inliers = 0;
+            int thread_iteration = _options.iterations;
+#pragma omp for schedule(dynamic, 8)
+            for ( int it = 0; it < _options.iterations; it++ ) {
+                uint32_t state = seed ^ (static_cast<uint32_t>(it) * 0x85EBCA6Bu + 0x165667B1u);
+                auto next = [&]() {
+                    // xorshift32, never seeded with 0.
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    return state;
+                };
+                if ( state == 0 )
+                    state = 1;
+                const uint32_t i0 = next() % count;
+                const uint32_t i1 = next() % count;
+                const uint32_t i2 = next() % count;
+                plane_model hypothesis;
+                if ( i0 == i1 || i1 == i2 || i0 == i2 || !plane_through( _points[i0], _points[i1], _points[i2], hypothesis ) )
+                    continue;
+                const size_t inliers = count_inliers( hypothesis );
+                if ( inliers > thread_inliers || (inliers == thread_inliers && it < thread_iteration) ) {
+                    thread_inliers = inliers;
+                    thread_iteration = it;
+                    thread_best = hypothesis;
+                }
+            }
+#pragma omp critical
+            {
+                if ( thread_inliers > best_inliers || (thread_inliers == best_inliers && thread_iteration < best_iteration) ) {
+                    best_inliers = thread_inliers;
+                    best_iteration = thread_iteration;
+                    best = thread_best;
+                }
+            }
+        }
+        return best_inliers >= 3;
+    }
+
+    // Least squares plane through the inliers of p: the normal is the direction of least variance around their
+    // centroid. Returns the number of inliers and their RMS distance to the refined plane.
+    size_t refine( plane_model& p, float& rms ) const {
+        const float threshold = _options.inlier_meters;
+        double sx = 0, sy = 0, sz = 0;
+        double sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0, szz = 0;
+        size_t n = 0;
+        for ( const point& q : _points ) {
+            if ( std::fabs( p.distance( q.x, q.y, q.z ) ) > threshold )
+                continue;
+            n++;
+            sx += q.x; sy += q.y; sz += q.z;
+            sxx += q.x * q.x; sxy += q.x * q.y; sxz += q.x * q.z;
+            syy += q.y * q.y; syz += q.y * q.z; szz += q.z * q.z;
+        }
+        if ( n < 3 ) {
+            rms = 0.f;
+            return n;
+        }
+
+        const double cx = sx / n, cy = sy / n, cz = sz / n;
+        double cov[3][3] = {
+            { sxx / n - cx * cx, sxy / n - cx * cy, sxz / n - cx * cz },
+            { sxy / n - cx * cy, syy / n - cy * cy, syz / n - cy * cz },
+            { sxz / n - cx * cz, syz / n - cy * cz, szz / n - cz * cz } };
+        double normal[3];
+        const double variance = smallest_eigenvector( cov, normal );
+
+        plane_model refined;
+        oriented( static_cast<float>(normal[0]), static_cast<float>(normal[1]), static_cast<float>(normal[2]),
+                  static_cast<float>(-(normal[0] * cx + normal[1] * cy + normal[2] * cz)), refined );
+        p = refined;
+        rms = static_cast<float>(std::sqrt( std::max( 0.0, variance ) ));
+        return n;
+    }
+
+    // Cyclic Jacobi rotations on a symmetric 3x3 matrix. Returns the smallest eigenvalue, its unit eigenvector in v.
+    static double smallest_eigenvector( double m[3][3], double v[3] ) {
+        double vectors[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+        for ( int sweep = 0; sweep < 16; sweep++ ) {
+            const double off = m[0][1] * m[0][1] + m[0][2] * m[0][2] + m[1][2] * m[1][2];
+            if ( off < 1e-30 )
+                break;
+            for ( int i = 0; i < 2; i++ ) {
+                for ( int j = i + 1; j < 3; j++ ) {
+                    if ( std::fabs( m[i][j] ) < 1e-300 )
+                        continue;
+                    const double theta = (m[j][j] - m[i][i]) / (2 * m[i][j]);
+                    const double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs( theta ) + std::sqrt( theta * theta + 1 ));
+                    const double c = 1 / std::sqrt( t * t + 1 );
+                    const double s = t * c;
+                    for ( int k = 0; k < 3; k++ ) {
+                        const double mki = m[k][i], mkj = m[k][j];
+                        m[k][i] = c * mki - s * mkj;
+                        m[k][j] = s * mki + c * mkj;
+                    }
+                    for ( int k = 0; k < 3; k++ ) {
+                        const double mik = m[i][k], mjk = m[j][k];
+                        m[i][k] = c * mik - s * mjk;
+                        m[j][k] = s * mik + c * mjk;
+                    }
+                    for ( int k = 0; k < 3; k++ ) {
+                        const double vki = vectors[k][i], vkj = vectors[k][j];
+                        vectors[k][i] = c * vki - s * vkj;
+                        vectors[k][j] = s * vki + c * vkj;
+                    }
+                }
+            }
+        }
+        int smallest = 0;
+        for ( int i = 1; i < 3; i++ )
+            if ( m[i][i] < m[smallest][smallest] )
+                smallest = i;
+        for ( int k = 0; k < 3; k++ )
+            v[k] = vectors[k][smallest];
+        return m[smallest][smallest];
+    }
+
+    plane_removal_options _options;
+
+    mutable std::mutex _mutex;
+    bool _configured = false;
+    rs2_intrinsics _intrinsics;
+    float _depth_scale = 0.f;
+    std::vector<float> _ray_x, _ray_y;
+
+    std::vector<point> _points;
+    size_t _total_samples = 0;
+
+    bool _has_plane = false;
+    plane_model _plane;
+    float _fit_rms = 0.f;
+    int _fits = 0;
+};
@@ -0,0 +1,68 @@
+// simd.hpp : Minimal helpers to pick a SIMD code path at runtime.
+//
+// Kernels are compiled for every supported instruction set and the best one is selected once,
+// the first time it is needed, so the same binary runs on machines with or without AVX2.
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RS_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RS_SIMD_X86 0
+#endif
+
+// MSVC lets any function use any intrinsic, GCC and Clang need the target to be spelled out.
+#if RS_SIMD_X86 && !defined(_MSC_VER)
+#define RS_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define RS_TARGET_AVX2  __attribute__((target("avx2")))
+#else
+#define RS_TARGET_SSE41
+#define RS_TARGET_AVX2
+#endif
+
+enum class simd_level {
+    scalar = 0,
+    sse41,
+    avx2
+};
+
+inline simd_level detect_simd_level() {
+#if RS_SIMD_X86
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid( info, 0 );
+    const int max_leaf = info[0];
+
+    __cpuid( info, 1 );
+    const bool has_sse41 = (info[2] & (1 << 19)) != 0;
+    const bool has_osxsave = (info[2] & (1 << 27)) != 0;
+    const bool has_avx = (info[2] & (1 << 28)) != 0;
+
+    bool has_avx2 = false;
+    if ( max_leaf >= 7 && has_osxsave && has_avx ) {
+        // The OS must also save the upper halves of the YMM registers on context switches.
+        const bool ymm_enabled = (_xgetbv( 0 ) & 0x6) == 0x6;
+        __cpuidex( info, 7, 0 );
+        has_avx2 = ymm_enabled && (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    const bool has_sse41 = __builtin_cpu_supports( "sse4.1" );
+    const bool has_avx2 = __builtin_cpu_supports( "avx2" );
+#endif
+    if ( has_avx2 )
+        return simd_level::avx2;
+    if ( has_sse41 )
+        return simd_level::sse41;
+#endif
+    return simd_level::scalar;
+}
+
+// The CPU does not change while we are running, so only ask once.
+inline simd_level get_simd_level() {
+    static const simd_level level = detect_simd_level();
+    return level;
+}
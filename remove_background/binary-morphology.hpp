@@ -0,0 +1,367 @@
+// binary-morphology.hpp : Dilation and erosion of bit-packed masks with rectangular structuring elements.
+//
+// A rectangle is separable, so each operation is a horizontal pass followed by a vertical one:
+//  - horizontal: 64 pixels per word, the window is covered by OR-ing (AND-ing) shifted copies of the row with
+//    doubling shifts, at most six passes for an element up to 64 pixels wide. A wider element adds a van Herk /
+//    Gil-Werman running max (min) over whole words and one more shift, so the cost per word stays bounded
+//    whatever the element width,
+//  - vertical: van Herk / Gil-Werman running max (min) over blocks of rows, three word operations per word
+//    whatever the element height.
+// Shifts and combinations of rows run on 4 words at a time with AVX2, 2 with SSE4.1.
+// Results are the same as cv::dilate and cv::erode with the default border: pixels outside of the image
+// never add to a dilation and never remove from an erosion.
+#pragma once
+
+#include "bit-mask.hpp"
+#include "depth-mask.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+// How a row of words is combined into another.
+enum class word_op {
+    copy,
+    bit_or,         // Dilation.
+    bit_and         // Erosion.
+};
+
+// acc[w] = acc[w] op (in shifted right by word_shift * 64 + bit_shift pixels)[w], for w in [first, last), with
+// bit_shift in [0, 64). Reads in[first - word_shift - 1] to in[last - 1 - word_shift]. Goes down the row, so in
+// can be acc when word_shift is not negative.
+template <word_op Op>
+inline void shift_combine_words_scalar( const uint64_t* in, uint64_t* acc, int first, int last, int word_shift, int bit_shift ) {
+    for ( int w = last - 1; w >= first; w-- ) {
+        const uint64_t hi = in[w - word_shift];
+        const uint64_t shifted = bit_shift ? (hi << bit_shift) | (in[w - word_shift - 1] >> (64 - bit_shift)) : hi;
+        acc[w] = Op == word_op::copy ? shifted : Op == word_op::bit_or ? acc[w] | shifted : acc[w] & shifted;
+    }
+}
+
+#if RS_SIMD_X86
+// Shifts of 64 bits or more give 0, which is what a bit_shift of 0 needs from the lower word.
+template <word_op Op>
+RS_TARGET_SSE41 inline void shift_combine_words_sse41( const uint64_t* in, uint64_t* acc, int first, int last, int word_shift, int bit_shift ) {
+    const __m128i left = _mm_cvtsi32_si128( bit_shift );
+    const __m128i right = _mm_cvtsi32_si128( 64 - bit_shift );
+    int w = last;
+    for ( ; w - 2 >= first; w -= 2 ) {
+        const uint64_t* from = in + w - 2 - word_shift;
+        const __m128i hi = _mm_loadu_si128( reinterpret_cast<const __m128i*>(from) );
+        const __m128i lo = _mm_loadu_si128( reinterpret_cast<const __m128i*>(from - 1) );
+        __m128i shifted = _mm_or_si128( _mm_sll_epi64( hi, left ), _mm_srl_epi64( lo, right ) );
+        __m128i* out = reinterpret_cast<__m128i*>(acc + w - 2);
+        if ( Op == word_op::bit_or )
+            shifted = _mm_or_si128( shifted, _mm_loadu_si128( out ) );
+        else if ( Op == word_op::bit_and )
+            shifted = _mm_and_si128( shifted, _mm_loadu_si128( out ) );
+        _mm_storeu_si128( out, shifted );
+    }
+    shift_combine_words_scalar<Op>( in, acc, first, w, word_shift, bit_shift );
+}
+
+template <word_op Op>
+RS_TARGET_AVX2 inline void shift_combine_words_avx2( const uint64_t* in, uint64_t* acc, int first, int last, int word_shift, int bit_shift ) {
+    const __m128i left = _mm_cvtsi32_si128( bit_shift );
+    const __m128i right = _mm_cvtsi32_si128( 64 - bit_shift );
+    int w = last;
+    for ( ; w - 4 >= first; w -= 4 ) {
+        const uint64_t* from = in + w - 4 - word_shift;
+        const __m256i hi = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(from) );
+        const __m256i lo = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(from - 1) );
+        __m256i shifted = _mm256_or_si256( _mm256_sll_epi64( hi, left ), _mm256_srl_epi64( lo, right ) );
+        __m256i* out = reinterpret_cast<__m256i*>(acc + w - 4);
+        if ( Op == word_op::bit_or )
+            shifted = _mm256_or_si256( shifted, _mm256_loadu_si256( out ) );
+        else if ( Op == word_op::bit_and )
+            shifted = _mm256_and_si256( shifted, _mm256_loadu_si256( out ) );
+        _mm256_storeu_si256( out, shifted );
+    }
+    shift_combine_words_scalar<Op>( in, acc, first, w, word_shift, bit_shift );
+}
+#endif
+
+template <word_op Op>
+inline void shift_combine_words( const uint64_t* in, uint64_t* acc, int first, int last, int word_shift, int bit_shift, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level == simd_level::avx2 )
+        return shift_combine_words_avx2<Op>( in, acc, first, last, word_shift, bit_shift );
+    if ( level == simd_level::sse41 )
+        return shift_combine_words_sse41<Op>( in, acc, first, last, word_shift, bit_shift );
+#endif
+    shift_combine_words_scalar<Op>( in, acc, first, last, word_shift, bit_shift );
+}
+
+// acc = acc op (in moved right by shift pixels, left if negative), for a row of words with fill on both sides of
+// it. in can be acc when shift is not negative.
+inline void shift_combine_row( const uint64_t* in, uint64_t* acc, int words, int shift, uint64_t fill, word_op op, simd_level level ) {
+    const int word_shift = shift >= 0 ? shift / 64 : -((-shift + 63) / 64);
+    const int bit_shift = shift - word_shift * 64;
+
+    // Words reading only inside the row go to the kernels, the few at the ends are done here. Down the row,
+    // like the kernels.
+    const int first = std::min( words, std::max( 0, word_shift + 1 ) );
+    const int last = std::max( first, std::min( words, words + word_shift ) );
+    auto edge = [&]( int w ) {
+        const int from = w - word_shift;
+        const uint64_t hi = from >= 0 && from < words ? in[from] : fill;
+        const uint64_t lo = from - 1 >= 0 && from - 1 < words ? in[from - 1] : fill;
+        const uint64_t shifted = bit_shift ? (hi << bit_shift) | (lo >> (64 - bit_shift)) : hi;
+        acc[w] = op == word_op::copy ? shifted : op == word_op::bit_or ? acc[w] | shifted : acc[w] & shifted;
+    };
+    for ( int w = words - 1; w >= last; w-- )
+        edge( w );
+    switch ( op ) {
+    case word_op::copy:
+        shift_combine_words<word_op::copy>( in, acc, first, last, word_shift, bit_shift, level );
+        break;
+    case word_op::bit_or:
+        shift_combine_words<word_op::bit_or>( in, acc, first, last, word_shift, bit_shift, level );
+        break;
+    case word_op::bit_and:
+        shift_combine_words<word_op::bit_and>( in, acc, first, last, word_shift, bit_shift, level );
+        break;
+    }
+    for ( int w = first - 1; w >= 0; w-- )
+        edge( w );
+}
+
+// Same meaning as cv::getStructuringElement( MORPH_RECT, Size( width, height ), Point( anchor_x, anchor_y ) ).
+struct rect_element {
+    int width = 1;
+    int height = 1;
+    int anchor_x = 0;
+    int anchor_y = 0;
+};
+
+// An anchor of -1 is the center, like OpenCV.
+inline rect_element make_rect_element( int width, int height, int anchor_x = -1, int anchor_y = -1 ) {
+    rect_element e;
+    e.width = std::max( 1, width );
+    e.height = std::max( 1, height );
+    e.anchor_x = anchor_x < 0 ? e.width / 2 : anchor_x;
+    e.anchor_y = anchor_y < 0 ? e.height / 2 : anchor_y;
+    return e;
+}
+
+class binary_morphology {
+public:
+    // dst can not be src.
+    void dilate( const bit_mask& src, bit_mask& dst, rect_element element ) {
+        apply( src, dst, element, false );
+    }
+
+    void erode( const bit_mask& src, bit_mask& dst, rect_element element ) {
+        apply( src, dst, element, true );
+    }
+
+    // Thresholds depth into near and far masks (see depth-mask.hpp), then dilates each with close_element and
+    // erodes the result with erode_element. Same output as build_depth_masks() followed by cv::dilate and
+    // cv::erode on both masks, without ever storing a byte per pixel for the whole frame.
+    void threshold_close_erode( const uint16_t* depth, int width, int height, depth_mask_thresholds thresholds,
+                                rect_element close_element, rect_element erode_element, bit_mask& near_mask, bit_mask& far_mask ) {
+        _near.resize( width, height );
+        _far.resize( width, height );
+        const simd_level level = get_simd_level();
+
+#pragma omp parallel
+        {
+            // A row of bytes per thread, packed into bits as soon as it is written.
+            std::vector<uint8_t> near_row( width ), far_row( width );
+#pragma omp for schedule(static)
+            for ( int y = 0; y < height; y++ ) {
+                build_depth_masks_row( depth + static_cast<size_t>(y) * width, near_row.data(), far_row.data(), width, thresholds, level );
+                pack_bits_row( near_row.data(), width, _near.row( y ), level );
+                pack_bits_row( far_row.data(), width, _far.row( y ), level );
+            }
+        }
+
+        close_erode( close_element, erode_element, near_mask, far_mask );
+    }
+
+    // Same as threshold_close_erode(), with the near mask taken from a depth frame where only the foreground has
+    // depth (see depth-background.hpp), and the far mask being every other pixel with depth.
+    void foreground_close_erode( const uint16_t* depth, const uint16_t* foreground_depth, int width, int height,
+                                 rect_element close_element, rect_element erode_element, bit_mask& near_mask, bit_mask& far_mask ) {
+        _near.resize( width, height );
+        _far.resize( width, height );
+        const simd_level level = get_simd_level();
+
+        // With both thresholds at the maximum, the "near" mask is every pixel with depth.
+        depth_mask_thresholds any_depth;
+        any_depth.near_units = 65535;
+
+#pragma omp parallel
+        {
+            std::vector<uint8_t> valid_row( width ), unused_row( width );
+#pragma omp for schedule(static)
+            for ( int y = 0; y < height; y++ ) {
+                const size_t offset = static_cast<size_t>(y) * width;
+                build_depth_masks_row( foreground_depth + offset, valid_row.data(), unused_row.data(), width, any_depth, level );
+                pack_bits_row( valid_row.data(), width, _near.row( y ), level );
+                build_depth_masks_row( depth + offset, valid_row.data(), unused_row.data(), width, any_depth, level );
+                pack_bits_row( valid_row.data(), width, _far.row( y ), level );
+
+                uint64_t* near_words = _near.row( y );
+                uint64_t* far_words = _far.row( y );
+                for ( int w = 0; w < _far.words_per_row(); w++ )
+                    far_words[w] &= ~near_words[w];
+            }
+        }
+
+        close_erode( close_element, erode_element, near_mask, far_mask );
+    }
+
+private:
+    // Dilates then erodes the masks built in _near and _far.
+    void close_erode( rect_element close_element, rect_element erode_element, bit_mask& near_mask, bit_mask& far_mask ) {
+        dilate( _near, _closed, close_element );
+        erode( _closed, near_mask, erode_element );
+        dilate( _far, _closed, close_element );
+        erode( _closed, far_mask, erode_element );
+    }
+
+    static void combine( uint64_t* acc, const uint64_t* other, int words, bool erode, simd_level level ) {
+        shift_combine_row( other, acc, words, 0, 0, erode ? word_op::bit_and : word_op::bit_or, level );
+    }
+
+    // out[w] combines in[w - count + 1] to in[w], words before the row being border, with a running max (min)
+    // over blocks of count words: prefix from the start of each block, suffix from its end.
+    static void sliding_words( const uint64_t* in, uint64_t* out, uint64_t* prefix, uint64_t* suffix, int words, int count, bool erode ) {
+        for ( int first = 0; first < words; first += count ) {
+            const int last = std::min( words, first + count ) - 1;
+            prefix[first] = in[first];
+            for ( int w = first + 1; w <= last; w++ )
+                prefix[w] = erode ? prefix[w - 1] & in[w] : prefix[w - 1] | in[w];
+            suffix[last] = in[last];
+            for ( int w = last - 1; w >= first; w-- )
+                suffix[w] = erode ? suffix[w + 1] & in[w] : suffix[w + 1] | in[w];
+        }
+        for ( int w = 0; w < words; w++ ) {
+            // Border words change nothing, and a window starting on a block boundary is the whole block.
+            const int start = w - count + 1;
+            if ( start <= 0 )
+                out[w] = prefix[w];
+            else if ( start % count == 0 )
+                out[w] = suffix[start];
+            else
+                out[w] = erode ? suffix[start] & prefix[w] : suffix[start] | prefix[w];
+        }
+    }
+
+    void apply( const bit_mask& src, bit_mask& dst, rect_element e, bool erode ) {
+        const int width = src.width();
+        const int height = src.height();
+        const int words = src.words_per_row();
+        const uint64_t border = erode ? ~uint64_t( 0 ) : 0;
+        dst.resize( width, height );
+        _horizontal.resize( width, height );
+        if ( src.empty() )
+            return;
+
+        // Horizontal pass. Output pixel x combines input pixels x + i - anchor_x, i in [0, width), which is the
+        // input shifted right by every amount in [anchor_x - width + 1, anchor_x].
+        const simd_level level = get_simd_level();
+        const word_op op = erode ? word_op::bit_and : word_op::bit_or;
+        const int lowest_shift = e.anchor_x - e.width + 1;
+        // After the first shift every pass moves the row right, so only the left margin grows with the width.
+        const int margin = e.width / 64 + 3;
+        const int padded_words = margin + words + 1;
+
+#pragma omp parallel
+        {
+            // Rows get margins of border words, wide enough that the shifts never bring the row edges in.
+            std::vector<uint64_t> padded( padded_words ), acc( padded_words );
+            std::vector<uint64_t> wide, prefix, suffix;
+            if ( e.width > 64 ) {
+                wide.resize( padded_words );
+                prefix.resize( padded_words );
+                suffix.resize( padded_words );
+            }
+#pragma omp for schedule(static)
+            for ( int y = 0; y < height; y++ ) {
+                std::fill( padded.begin(), padded.end(), border );
+                std::copy( src.row( y ), src.row( y ) + words, padded.begin() + margin );
+                padded[margin + words - 1] |= border & ~src.last_word_mask();
+
+                // Every pass doubles the shifts covered, up to 64 of them.
+                const int word_width = std::min( e.width, 64 );
+                shift_combine_row( padded.data(), acc.data(), padded_words, lowest_shift, border, word_op::copy, level );
+                for ( int covered = 1; covered < word_width; ) {
+                    const int step = std::min( covered, word_width - covered );
+                    shift_combine_row( acc.data(), acc.data(), padded_words, step, border, op, level );
+                    covered += step;
+                }
+
+                // A wider element is width / 64 of those shifted by whole words, and one more for the rest,
+                // overlapping the others.
+                const uint64_t* result = acc.data();
+                if ( e.width > 64 ) {
+                    sliding_words( acc.data(), wide.data(), prefix.data(), suffix.data(), padded_words, e.width / 64, erode );
+                    shift_combine_row( acc.data(), wide.data(), padded_words, e.width - 64, border, op, level );
+                    result = wide.data();
+                }
+                std::copy( result + margin, result + margin + words, _horizontal.row( y ) );
+            }
+        }
+
+        // Vertical pass, on rows padded with anchor_y border rows above and height - 1 - anchor_y below.
+        // Output row y combines padded rows [y, y + p), p being the element height. Per block of p rows,
+        // prefix holds the running combination from the start of the block, suffix from its end, and every
+        // window is a suffix of one block combined with a prefix of the next.
+        const int p = e.height;
+        const int padded_rows = height + p - 1;
+        _border_row.assign( words, border );
+        auto source_row = [&]( int q ) -> const uint64_t* {
+            const int y = q - e.anchor_y;
+            return y >= 0 && y < height ? _horizontal.row( y ) : _border_row.data();
+        };
+
+        if ( p == 1 ) {
+            for ( int y = 0; y < height; y++ )
+                std::copy( source_row( y ), source_row( y ) + words, dst.row( y ) );
+        }
+        else {
+            _prefix.resize( static_cast<size_t>(padded_rows) * words );
+            _suffix.resize( static_cast<size_t>(padded_rows) * words );
+            const int blocks = (padded_rows + p - 1) / p;
+
+#pragma omp parallel for schedule(static)
+            for ( int b = 0; b < blocks; b++ ) {
+                const int first = b * p;
+                const int last = std::min( padded_rows, first + p ) - 1;
+                for ( int q = first; q <= last; q++ ) {
+                    uint64_t* out = &_prefix[static_cast<size_t>(q) * words];
+                    std::copy( source_row( q ), source_row( q ) + words, out );
+                    if ( q > first )
+                        combine( out, out - words, words, erode, level );
+                }
+                for ( int q = last; q >= first; q-- ) {
+                    uint64_t* out = &_suffix[static_cast<size_t>(q) * words];
+                    std::copy( source_row( q ), source_row( q ) + words, out );
+                    if ( q < last )
+                        combine( out, out + words, words, erode, level );
+                }
+            }
+
+#pragma omp parallel for schedule(static)
+            for ( int y = 0; y < height; y++ ) {
+                uint64_t* out = dst.row( y );
+                const uint64_t* suffix = &_suffix[static_cast<size_t>(y) * words];
+                const uint64_t* prefix = &_prefix[static_cast<size_t>(y + p - 1) * words];
+                std::copy( suffix, suffix + words, out );
+                // A window starting on a block boundary is the whole block, already in suffix.
+                if ( y % p )
+                    combine( out, prefix, words, erode, level );
+            }
+        }
+
+        // Keep the bits past the width at 0.
+        for ( int y = 0; y < height; y++ )
+            dst.row( y )[words - 1] &= dst.last_word_mask();
+    }
+
+    bit_mask _near, _far, _closed, _horizontal;
+    std::vector<uint64_t> _prefix, _suffix, _border_row;
+};
@@ -0,0 +1,270 @@
+// bit-mask.hpp : Binary image stored as one bit per pixel, and its run-length encoding.
+//
+// Pixel x of a row is bit (x % 64) of word (x / 64), so shifting a word left moves pixels to the right.
+// Rows start on a word boundary, and the bits past the width in the last word of a row are always 0.
+//
+// A mask takes an eighth of the memory of a byte per pixel image. Rows convert to and from bytes 16 pixels at a
+// time, and mask_runs lists the set spans of every row so compositing can copy foreground spans and skip the
+// background whole.
+#pragma once
+
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class bit_mask {
+public:
+    bit_mask() = default;
+    bit_mask( int width, int height ) { resize( width, height ); }
+
+    // Keeps the storage when the size does not change. The content is undefined after a resize.
+    void resize( int width, int height ) {
+        _width = width;
+        _height = height;
+        _words_per_row = (width + 63) / 64;
+        _words.resize( static_cast<size_t>(_words_per_row) * height );
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int words_per_row() const { return _words_per_row; }
+    bool empty() const { return _width == 0 || _height == 0; }
+
+    uint64_t* row( int y ) { return &_words[static_cast<size_t>(y) * _words_per_row]; }
+    const uint64_t* row( int y ) const { return &_words[static_cast<size_t>(y) * _words_per_row]; }
+
+    bool get( int x, int y ) const { return (row( y )[x >> 6] >> (x & 63)) & 1; }
+    void set( int x, int y, bool value ) {
+        const uint64_t bit = uint64_t( 1 ) << (x & 63);
+        uint64_t& word = row( y )[x >> 6];
+        word = value ? (word | bit) : (word & ~bit);
+    }
+
+    void fill( bool value ) {
+        for ( int y = 0; y < _height; y++ ) {
+            uint64_t* r = row( y );
+            for ( int w = 0; w < _words_per_row; w++ )
+                r[w] = value ? ~uint64_t( 0 ) : 0;
+            if ( _words_per_row )
+                r[_words_per_row - 1] &= last_word_mask();
+        }
+    }
+
+    // Bits of the last word of a row that are inside the image.
+    uint64_t last_word_mask() const {
+        const int used = _width & 63;
+        return used ? (uint64_t( 1 ) << used) - 1 : ~uint64_t( 0 );
+    }
+
+private:
+    int _width = 0;
+    int _height = 0;
+    int _words_per_row = 0;
+    std::vector<uint64_t> _words;
+};
+
+// Packs a row of bytes into bits, any non-zero byte is a set bit.
+inline void pack_bits_row_scalar( const uint8_t* bytes, int width, uint64_t* words ) {
+    for ( int w = 0; w * 64 < width; w++ ) {
+        uint64_t word = 0;
+        const int count = width - w * 64 < 64 ? width - w * 64 : 64;
+        for ( int i = 0; i < count; i++ )
+            word |= uint64_t( bytes[w * 64 + i] != 0 ) << i;
+        words[w] = word;
+    }
+}
+
+#if RS_SIMD_X86
+RS_TARGET_SSE41 inline void pack_bits_row_sse41( const uint8_t* bytes, int width, uint64_t* words ) {
+    const __m128i zero = _mm_setzero_si128();
+    int w = 0;
+    for ( ; (w + 1) * 64 <= width; w++ ) {
+        uint64_t word = 0;
+        for ( int i = 0; i < 4; i++ ) {
+            __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>(bytes + w * 64 + i * 16) );
+            // movemask gives the zero bytes, invert to get the set ones.
+            const uint64_t zeros = static_cast<uint32_t>(_mm_movemask_epi8( _mm_cmpeq_epi8( v, zero ) ));
+            word |= (~zeros & 0xFFFF) << (i * 16);
+        }
+        words[w] = word;
+    }
+    if ( w * 64 < width )
+        pack_bits_row_scalar( bytes + w * 64, width - w * 64, words + w );
+}
+#endif
+
+inline void pack_bits_row( const uint8_t* bytes, int width, uint64_t* words, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level != simd_level::scalar )
+        return pack_bits_row_sse41( bytes, width, words );
+#endif
+    pack_bits_row_scalar( bytes, width, words );
+}
+
+// Writes value for set bits and 0 for the others.
+inline void unpack_bits_row_scalar( const uint64_t* words, int width, uint8_t* bytes, uint8_t value ) {
+    for ( int x = 0; x < width; x++ )
+        bytes[x] = (words[x >> 6] >> (x & 63)) & 1 ? value : 0;
+}
+
+#if RS_SIMD_X86
+RS_TARGET_SSE41 inline void unpack_bits_row_sse41( const uint64_t* words, int width, uint8_t* bytes, uint8_t value ) {
+    // The two bytes of 16 pixels are each spread over 8 lanes, lane i then tests bit (i % 8).
+    const __m128i spread = _mm_setr_epi8( 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 );
+    const __m128i bits = _mm_setr_epi8( 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128 );
+    const __m128i fill = _mm_set1_epi8( static_cast<char>(value) );
+
+    int x = 0;
+    for ( ; x + 16 <= width; x += 16 ) {
+        const int pixels = static_cast<int>((words[x >> 6] >> (x & 63)) & 0xFFFF);
+        __m128i v = _mm_shuffle_epi8( _mm_cvtsi32_si128( pixels ), spread );
+        v = _mm_cmpeq_epi8( _mm_and_si128( v, bits ), bits );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(bytes + x), _mm_and_si128( v, fill ) );
+    }
+    for ( ; x < width; x++ )
+        bytes[x] = (words[x >> 6] >> (x & 63)) & 1 ? value : 0;
+}
+#endif
+
+inline void unpack_bits_row( const uint64_t* words, int width, uint8_t* bytes, uint8_t value, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level != simd_level::scalar )
+        return unpack_bits_row_sse41( words, width, bytes, value );
+#endif
+    unpack_bits_row_scalar( words, width, bytes, value );
+}
+
+// Index of the lowest set bit, word must not be 0.
+inline int lowest_set_bit( uint64_t word ) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64( &index, word );
+    return static_cast<int>(index);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if ( _BitScanForward( &index, static_cast<unsigned long>(word) ) )
+        return static_cast<int>(index);
+    _BitScanForward( &index, static_cast<unsigned long>(word >> 32) );
+    return static_cast<int>(index) + 32;
+#else
+    return __builtin_ctzll( word );
+#endif
+}
+
+// A span of set pixels in a row.
+struct mask_run {
+    int start;
+    int length;
+};
+
+// Set spans of every row of a bit_mask, in order. Encoding jumps over empty and full words, so its cost follows
+// the number of runs rather than the number of pixels.
+class mask_runs {
+public:
+    void encode( const bit_mask& mask ) {
+        _width = mask.width();
+        _height = mask.height();
+        _runs.clear();
+        _row_start.resize( static_cast<size_t>(_height) + 1 );
+        for ( int y = 0; y < _height; y++ ) {
+            _row_start[y] = _runs.size();
+            encode_row( mask.row( y ), mask.words_per_row() );
+        }
+        _row_start[_height] = _runs.size();
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    // Runs of row y are [row_begin( y ), row_end( y )).
+    const mask_run* row_begin( int y ) const { return _runs.data() + _row_start[y]; }
+    const mask_run* row_end( int y ) const { return _runs.data() + _row_start[y + 1]; }
+    size_t total_runs() const { return _runs.size(); }
+
+    // Number of set pixels.
+    size_t area() const {
+        size_t area = 0;
+        for ( auto& r : _runs )
+            area += r.length;
+        return area;
+    }
+
+    void decode( bit_mask& mask ) const {
+        mask.resize( _width, _height );
+        mask.fill( false );
+        for ( int y = 0; y < _height; y++ ) {
+            uint64_t* words = mask.row( y );
+            for ( const mask_run* r = row_begin( y ); r != row_end( y ); ++r ) {
+                // Up to a word at a time.
+                for ( int x = r->start, end = r->start + r->length; x < end; ) {
+                    const int count = std::min( 64 - (x & 63), end - x );
+                    const uint64_t bits = count == 64 ? ~uint64_t( 0 ) : ((uint64_t( 1 ) << count) - 1) << (x & 63);
+                    words[x >> 6] |= bits;
+                    x += count;
+                }
+            }
+        }
+    }
+
+    // Copies the pixels of the runs from src to dst and clears the rest of dst. Both images are width x height
+    // pixels of bytes_per_pixel bytes, tightly packed. src and dst can be the same image.
+    void composite( const uint8_t* src, uint8_t* dst, int bytes_per_pixel ) const {
+        const size_t row_bytes = static_cast<size_t>(_width) * bytes_per_pixel;
+
+#pragma omp parallel for schedule(static)
+        for ( int y = 0; y < _height; y++ ) {
+            const uint8_t* src_row = src + y * row_bytes;
+            uint8_t* dst_row = dst + y * row_bytes;
+            size_t cleared = 0;
+            for ( const mask_run* r = row_begin( y ); r != row_end( y ); ++r ) {
+                const size_t begin = static_cast<size_t>(r->start) * bytes_per_pixel;
+                const size_t length = static_cast<size_t>(r->length) * bytes_per_pixel;
+                std::memset( dst_row + cleared, 0, begin - cleared );
+                if ( src_row != dst_row )
+                    std::memcpy( dst_row + begin, src_row + begin, length );
+                cleared = begin + length;
+            }
+            std::memset( dst_row + cleared, 0, row_bytes - cleared );
+        }
+    }
+
+private:
+    void encode_row( const uint64_t* words, int count ) {
+        if ( count == 0 )
+            return;
+
+        int w = 0;
+        uint64_t word = words[0];   // Bits of word w not encoded yet.
+        while ( true ) {
+            while ( word == 0 ) {
+                if ( ++w == count )
+                    return;
+                word = words[w];
+            }
+            const int start = w * 64 + lowest_set_bit( word );
+
+            // The run ends on the first clear bit above start. Setting the bits below start hides them.
+            uint64_t clear = ~(word | (word - 1));
+            while ( clear == 0 ) {
+                if ( ++w == count ) {
+                    _runs.push_back( mask_run{ start, _width - start } );
+                    return;
+                }
+                word = words[w];
+                clear = ~word;
+            }
+            const int end_bit = lowest_set_bit( clear );
+            _runs.push_back( mask_run{ start, w * 64 + end_bit - start } );
+            word &= ~uint64_t( 0 ) << end_bit;
+        }
+    }
+
+    int _width = 0;
+    int _height = 0;
+    std::vector<mask_run> _runs;
+    std::vector<size_t> _row_start;
+};
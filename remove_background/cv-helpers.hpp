@@ -6,8 +6,11 @@
 #include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
 #include <opencv2/opencv.hpp>   // Include OpenCV API
 #include <exception>
+#include "bit-mask.hpp"
+#include "frame-pool.hpp"
 
 // Convert rs2::frame to cv::Mat
+// The matrix shares the frame's memory when OpenCV can use it as is, treat it as read-only.
 cv::Mat frame_to_mat(const rs2::frame& f)
 {
     using namespace cv;
@@ -23,9 +26,11 @@ cv::Mat frame_to_mat(const rs2::frame& f)
     }
     else if (f.get_profile().format() == RS2_FORMAT_RGB8)
     {
+        // Reorder into a new matrix, the frame could be used elsewhere.
         auto r = Mat(Size(w, h), CV_8UC3, (void*)f.get_data(), Mat::AUTO_STEP);
-        cvtColor(r, r, COLOR_RGB2BGR);
-        return r;
+        Mat bgr;
+        cvtColor(r, bgr, COLOR_RGB2BGR);
+        return bgr;
     }
     else if (f.get_profile().format() == RS2_FORMAT_Z16)
     {
@@ -39,6 +44,27 @@ cv::Mat frame_to_mat(const rs2::frame& f)
     throw std::runtime_error("Frame format is not supported yet!");
 }
 
+// Same as above, but a frame that needs converting is converted into "storage", taken from "pool".
+// The matrix is valid as long as "storage" (or the frame, if it was not converted) is.
+cv::Mat frame_to_mat(const rs2::frame& f, frame_pool& pool, pooled_frame& storage)
+{
+    using namespace cv;
+    using namespace rs2;
+
+    if (f.get_profile().format() != RS2_FORMAT_RGB8)
+        return frame_to_mat(f);
+
+    auto vf = f.as<video_frame>();
+    const int w = vf.get_width();
+    const int h = vf.get_height();
+
+    storage = pool.acquire(w, h, 3);
+    auto r = Mat(Size(w, h), CV_8UC3, (void*)f.get_data(), Mat::AUTO_STEP);
+    auto bgr = Mat(Size(w, h), CV_8UC3, storage.data(), storage.stride());
+    cvtColor(r, bgr, COLOR_RGB2BGR);
+    return bgr;
+}
+
 // Converts depth frame to a matrix of doubles with distances in meters
 cv::Mat depth_frame_to_meters(const rs2::pipeline& pipe, const rs2::depth_frame& f)
 {
@@ -55,3 +81,25 @@ cv::Mat depth_frame_to_meters(const rs2::pipeline& pipe, const rs2::depth_frame&
     return dm;
 }
 
+// Converts a bit mask to an 8-bit matrix, value where a bit is set and 0 elsewhere.
+void bit_mask_to_mat(const bit_mask& mask, cv::Mat& mat, uint8_t value = 255)
+{
+    mat.create(mask.height(), mask.width(), CV_8UC1);
+    const simd_level level = get_simd_level();
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < mask.height(); y++)
+        unpack_bits_row(mask.row(y), mask.width(), mat.ptr<uint8_t>(y), value, level);
+}
+
+// Converts an 8-bit single channel matrix to a bit mask, any non-zero pixel is set.
+void mat_to_bit_mask(const cv::Mat& mat, bit_mask& mask)
+{
+    CV_Assert(mat.type() == CV_8UC1);
+    mask.resize(mat.cols, mat.rows);
+    const simd_level level = get_simd_level();
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < mat.rows; y++)
+        pack_bits_row(mat.ptr<uint8_t>(y), mat.cols, mask.row(y), level);
+}
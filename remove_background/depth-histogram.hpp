@@ -0,0 +1,316 @@
+// depth-histogram.hpp : Histogram of raw depth values, built in parallel without sharing counters between threads.
+//
+// Every thread counts into its own private set of 32-bit bins, which are summed once all rows are done.
+// The mode finder is vectorized and always picks the lowest bin on ties, so results do not depend on threading.
+// The histogram can also be built on a subsampled grid, and split in two classes (near objects and the rest) by
+// Otsu's method or at the deepest valley between its two main peaks.
+#pragma once
+
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+class depth_histogram {
+public:
+    // bin_width is in raw depth units, 32 matches the old "slotSizeFactor = 5".
+    explicit depth_histogram( int bin_width = 32 ) {
+        set_bin_width( bin_width );
+    }
+
+    void set_bin_width( int bin_width ) {
+        if ( bin_width < 1 || bin_width > 65536 )
+            throw std::invalid_argument( "Depth histogram bin width must be in [1, 65536]" );
+
+        _bin_width = bin_width;
+        // bin_of() divides by multiplying with ceil(2^32 / bin_width), exact for every 16-bit depth value.
+        _reciprocal = ((uint64_t( 1 ) << 32) + bin_width - 1) / bin_width;
+        _bin_count = (65536 + bin_width - 1) / bin_width;
+        // Keep each thread's bins on their own cache lines.
+        _thread_stride = (_bin_count + 15) & ~15;
+        _bins.assign( _bin_count, 0 );
+        _thread_bins.clear();
+    }
+
+    int bin_width() const { return _bin_width; }
+    int bin_count() const { return _bin_count; }
+    const std::vector<uint32_t>& bins() const { return _bins; }
+    uint32_t total() const { return _total; }
+
+    int bin_of( uint16_t depth_units ) const {
+        return static_cast<int>((depth_units * _reciprocal) >> 32);
+    }
+
+    // First raw depth value falling into a bin.
+    uint16_t bin_min_units( int bin ) const {
+        return static_cast<uint16_t>(bin * _bin_width);
+    }
+
+    // Counts every pixel with 0 < depth <= max_units. Invalid (0) and clipped pixels are not counted.
+    // A step above 1 only counts one pixel out of step in each direction.
+    void compute( const uint16_t* depth, int width, int height, uint16_t max_units, int step = 1 ) {
+        step = std::max( 1, step );
+#ifdef _OPENMP
+        const int max_threads = omp_get_max_threads();
+#else
+        const int max_threads = 1;
+#endif
+        const size_t needed = static_cast<size_t>(max_threads) * _thread_stride;
+        if ( _thread_bins.size() < needed )
+            _thread_bins.resize( needed );
+
+        uint32_t total = 0;
+
+#pragma omp parallel num_threads(max_threads) reduction(+:total)
+        {
+#ifdef _OPENMP
+            const int thread = omp_get_thread_num();
+            const int used_threads = omp_get_num_threads();
+#else
+            const int thread = 0;
+            const int used_threads = 1;
+#endif
+            uint32_t* local = &_thread_bins[static_cast<size_t>(thread) * _thread_stride];
+            std::fill( local, local + _bin_count, 0u );
+
+#pragma omp for schedule(static)
+            for ( int y = 0; y < height; y += step ) {
+                const uint16_t* row = depth + static_cast<size_t>(y) * width;
+                for ( int x = 0; x < width; x += step ) {
+                    const uint16_t d = row[x];
+                    // 0 wraps to 65535 so invalid pixels fail the same test as far ones.
+                    if ( static_cast<uint16_t>(d - 1) < max_units ) {
+                        local[bin_of( d )]++;
+                        total++;
+                    }
+                }
+            }
+            // Implicit barrier above: every private histogram is complete before merging.
+
+#pragma omp for schedule(static)
+            for ( int b = 0; b < _bin_count; b++ ) {
+                uint32_t sum = 0;
+                for ( int t = 0; t < used_threads; t++ )
+                    sum += _thread_bins[static_cast<size_t>(t) * _thread_stride + b];
+                _bins[b] = sum;
+            }
+        }
+        _total = total;
+    }
+
+    // Smallest depth such that at least "fraction" of the counted pixels are at or below it, rounded up to the
+    // last raw value of its bin. Returns 0 if the histogram is empty.
+    uint16_t percentile_units( float fraction ) const {
+        if ( _total == 0 )
+            return 0;
+
+        const double clamped = std::min( 1.0, std::max( 0.0, static_cast<double>(fraction) ) );
+        const uint64_t target = std::max<uint64_t>( 1, static_cast<uint64_t>(std::ceil( clamped * _total )) );
+        uint64_t cumulative = 0;
+        for ( int b = 0; b < _bin_count; b++ ) {
+            cumulative += _bins[b];
+            if ( cumulative >= target )
+                return static_cast<uint16_t>(std::min( 65535, (b + 1) * _bin_width - 1 ));
+        }
+        return 65535;
+    }
+
+    // Last bin of the near class when bins [0, last_bin] are split in two by Otsu's method, which maximizes the
+    // variance between the classes. Returns -1 if fewer than two bins are populated.
+    int otsu_bin( int last_bin ) const {
+        last_bin = std::min( last_bin, _bin_count - 1 );
+        double total = 0, total_sum = 0;
+        for ( int b = 0; b <= last_bin; b++ ) {
+            total += _bins[b];
+            total_sum += static_cast<double>(b) * _bins[b];
+        }
+
+        int best = -1;
+        double best_variance = 0;
+        double count = 0, sum = 0;
+        for ( int b = 0; b < last_bin; b++ ) {
+            count += _bins[b];
+            sum += static_cast<double>(b) * _bins[b];
+            if ( count == 0 )
+                continue;
+            if ( count == total )
+                break;
+            // Between class variance, up to the constant factor 1 / total^2.
+            const double difference = sum * total - total_sum * count;
+            const double variance = difference * difference / (count * (total - count));
+            if ( variance > best_variance ) {
+                best_variance = variance;
+                best = b;
+            }
+        }
+        return best;
+    }
+
+    // Last bin of the near class when bins [0, last_bin] are split at the lowest point between the two highest
+    // peaks of the histogram smoothed over 2 * radius + 1 bins. Peaks closer than min_separation bins count as
+    // one. Returns -1 without two such peaks. smoothed is scratch space, kept by the caller between frames.
+    int valley_bin( int last_bin, int radius, int min_separation, std::vector<uint32_t>& smoothed ) const {
+        last_bin = std::min( last_bin, _bin_count - 1 );
+        if ( last_bin < 2 )
+            return -1;
+        radius = std::max( 0, radius );
+        smoothed.resize( last_bin + 1 );
+
+        // Running box sum, the window is clamped at both ends.
+        uint32_t window = 0;
+        for ( int b = 0; b <= std::min( radius, last_bin ); b++ )
+            window += _bins[b];
+        for ( int b = 0; b <= last_bin; b++ ) {
+            smoothed[b] = window;
+            if ( b + radius + 1 <= last_bin )
+                window += _bins[b + radius + 1];
+            if ( b - radius >= 0 )
+                window -= _bins[b - radius];
+        }
+
+        // The highest peak, then the highest local maximum far enough from it (not a shoulder of the first one).
+        const int first = argmax_u32( smoothed.data(), last_bin + 1 );
+        int second = -1;
+        for ( int b = 0; b <= last_bin; b++ ) {
+            const bool peak = (b == 0 || smoothed[b] >= smoothed[b - 1]) && (b == last_bin || smoothed[b] >= smoothed[b + 1]);
+            if ( peak && std::abs( b - first ) >= std::max( 1, min_separation ) && (second < 0 || smoothed[b] > smoothed[second]) )
+                second = b;
+        }
+        if ( second < 0 || smoothed[first] == 0 || smoothed[second] == 0 )
+            return -1;
+
+        const int low = std::min( first, second );
+        const int high = std::max( first, second );
+        return static_cast<int>(std::min_element( smoothed.begin() + low, smoothed.begin() + high + 1 ) - smoothed.begin());
+    }
+
+    // Bin with the most pixels, the lowest one on ties. Returns -1 if the histogram is empty.
+    int mode() const {
+        const int bin = argmax_u32( _bins.data(), _bin_count );
+        return _bins[bin] ? bin : -1;
+    }
+
+    // The k most populated non-empty bins as (bin, count), sorted by decreasing count then increasing bin.
+    std::vector<std::pair<int, uint32_t>> top_k( int k ) const {
+        std::vector<std::pair<int, uint32_t>> best;
+        if ( k <= 0 )
+            return best;
+        best.reserve( k + 1 );
+
+        auto before = []( const std::pair<int, uint32_t>& a, const std::pair<int, uint32_t>& b ) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        // Bins are visited in increasing order, so an equal count never displaces an earlier bin.
+        auto consider = [&]( int bin ) {
+            std::pair<int, uint32_t> candidate( bin, _bins[bin] );
+            best.insert( std::upper_bound( best.begin(), best.end(), candidate, before ), candidate );
+            if ( static_cast<int>(best.size()) > k )
+                best.pop_back();
+        };
+
+        // Only bins beating the current k-th count can enter the list; skip the rest 8 or 4 at a time.
+        int b = 0;
+#if RS_SIMD_X86
+        const simd_level level = get_simd_level();
+        if ( level != simd_level::scalar ) {
+            const int step = level == simd_level::avx2 ? 8 : 4;
+            for ( ; b + step <= _bin_count; b += step ) {
+                const uint32_t kth = static_cast<int>(best.size()) < k ? 0 : best.back().second;
+                unsigned lanes = level == simd_level::avx2
+                    ? greater_lanes_avx2( &_bins[b], kth )
+                    : greater_lanes_sse41( &_bins[b], kth );
+                while ( lanes ) {
+                    int lane = 0;
+                    while ( !(lanes & (1u << lane)) )
+                        lane++;
+                    lanes &= ~(1u << lane);
+                    // The k-th count may have risen since the compare, so check again.
+                    if ( static_cast<int>(best.size()) < k ? _bins[b + lane] > 0 : _bins[b + lane] > best.back().second )
+                        consider( b + lane );
+                }
+            }
+        }
+#endif
+        for ( ; b < _bin_count; b++ ) {
+            if ( _bins[b] > 0 && (static_cast<int>(best.size()) < k || _bins[b] > best.back().second) )
+                consider( b );
+        }
+        return best;
+    }
+
+private:
+#if RS_SIMD_X86
+    // Bit i is set when values[i] > threshold, for 8 values.
+    static RS_TARGET_AVX2 unsigned greater_lanes_avx2( const uint32_t* values, uint32_t threshold ) {
+        const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(values) );
+        const __m256i f = _mm256_set1_epi32( static_cast<int>(threshold) );
+        // v > f unsigned <=> max(v, f) != f.
+        const __m256i not_greater = _mm256_cmpeq_epi32( _mm256_max_epu32( v, f ), f );
+        return ~static_cast<unsigned>(_mm256_movemask_ps( _mm256_castsi256_ps( not_greater ) )) & 0xFFu;
+    }
+
+    // Bit i is set when values[i] > threshold, for 4 values.
+    static RS_TARGET_SSE41 unsigned greater_lanes_sse41( const uint32_t* values, uint32_t threshold ) {
+        const __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>(values) );
+        const __m128i f = _mm_set1_epi32( static_cast<int>(threshold) );
+        const __m128i not_greater = _mm_cmpeq_epi32( _mm_max_epu32( v, f ), f );
+        return ~static_cast<unsigned>(_mm_movemask_ps( _mm_castsi128_ps( not_greater ) )) & 0xFu;
+    }
+
+    static RS_TARGET_AVX2 uint32_t max_u32_avx2( const uint32_t* values, int count, int& done ) {
+        __m256i m = _mm256_setzero_si256();
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 )
+            m = _mm256_max_epu32( m, _mm256_loadu_si256( reinterpret_cast<const __m256i*>(values + i) ) );
+        __m128i h = _mm_max_epu32( _mm256_castsi256_si128( m ), _mm256_extracti128_si256( m, 1 ) );
+        h = _mm_max_epu32( h, _mm_shuffle_epi32( h, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        h = _mm_max_epu32( h, _mm_shuffle_epi32( h, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        done = i;
+        return static_cast<uint32_t>(_mm_cvtsi128_si32( h ));
+    }
+
+    static RS_TARGET_SSE41 uint32_t max_u32_sse41( const uint32_t* values, int count, int& done ) {
+        __m128i m = _mm_setzero_si128();
+        int i = 0;
+        for ( ; i + 4 <= count; i += 4 )
+            m = _mm_max_epu32( m, _mm_loadu_si128( reinterpret_cast<const __m128i*>(values + i) ) );
+        m = _mm_max_epu32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        m = _mm_max_epu32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        done = i;
+        return static_cast<uint32_t>(_mm_cvtsi128_si32( m ));
+    }
+#endif
+
+    // Index of the first maximum: a vectorized max reduction, then a scan for the first match.
+    static int argmax_u32( const uint32_t* values, int count ) {
+        uint32_t max_value = 0;
+        int i = 0;
+#if RS_SIMD_X86
+        const simd_level level = get_simd_level();
+        if ( level == simd_level::avx2 )
+            max_value = max_u32_avx2( values, count, i );
+        else if ( level == simd_level::sse41 )
+            max_value = max_u32_sse41( values, count, i );
+#endif
+        for ( ; i < count; i++ )
+            max_value = std::max( max_value, values[i] );
+        return static_cast<int>(std::find( values, values + count, max_value ) - values);
+    }
+
+    int _bin_width = 0;
+    uint64_t _reciprocal = 0;
+    int _bin_count = 0;
+    int _thread_stride = 0;
+    uint32_t _total = 0;
+    std::vector<uint32_t> _bins;
+    std::vector<uint32_t> _thread_bins;     // One private histogram per thread, _thread_stride apart.
+};
@@ -0,0 +1,134 @@
+// depth-mask.hpp : Near and far masks built straight from Z16 depth, in a single pass.
+//
+// The thresholds are raw depth units, taken either from distances in meters or from percentiles of the depth
+// histogram. Percentiles give the same kind of split as thresholding the histogram-equalized colorizer output,
+// without colorizing the frame and converting it to gray twice.
+#pragma once
+
+#include "depth-histogram.hpp"
+#include "simd.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// A pixel with raw depth d is "near" if 0 < d <= near_units and "far" if d > far_units.
+// Pixels without depth (0) are in neither mask.
+struct depth_mask_thresholds {
+    uint16_t near_units = 0;
+    uint16_t far_units = 65535;
+};
+
+inline uint16_t meters_to_depth_units( float depth_scale, float meters ) {
+    if ( !(depth_scale > 0.f) || !(meters > 0.f) )
+        return 0;
+    const double units = std::floor( meters / depth_scale );
+    return static_cast<uint16_t>(units > 65535.0 ? 65535.0 : units);
+}
+
+inline depth_mask_thresholds depth_mask_thresholds_from_meters( float depth_scale, float near_meters, float far_meters ) {
+    depth_mask_thresholds thresholds;
+    thresholds.near_units = meters_to_depth_units( depth_scale, near_meters );
+    thresholds.far_units = meters_to_depth_units( depth_scale, far_meters );
+    return thresholds;
+}
+
+// Thresholds follow the scene: "near" is the closest near_fraction of the valid pixels, "far" is everything past
+// the far_fraction percentile. The histogram is recomputed from the frame.
+inline depth_mask_thresholds depth_mask_thresholds_from_percentiles( depth_histogram& histogram, const uint16_t* depth,
+                                                                    int width, int height, float near_fraction, float far_fraction ) {
+    histogram.compute( depth, width, height, 65535 );
+
+    depth_mask_thresholds thresholds;
+    thresholds.near_units = histogram.percentile_units( near_fraction );
+    thresholds.far_units = histogram.percentile_units( far_fraction );
+    return thresholds;
+}
+
+inline void build_depth_masks_scalar( const uint16_t* depth, uint8_t* near_mask, uint8_t* far_mask, int count, depth_mask_thresholds thresholds ) {
+    for ( int i = 0; i < count; i++ ) {
+        // Subtracting one makes 0 wrap to 65535, so invalid pixels are never near.
+        near_mask[i] = static_cast<uint16_t>(depth[i] - 1) < thresholds.near_units ? 255 : 0;
+        far_mask[i] = depth[i] > thresholds.far_units ? 255 : 0;
+    }
+}
+
+#if RS_SIMD_X86
+RS_TARGET_SSE41 inline void build_depth_masks_sse41( const uint16_t* depth, uint8_t* near_mask, uint8_t* far_mask, int count, depth_mask_thresholds thresholds ) {
+    const __m128i one = _mm_set1_epi16( 1 );
+    const __m128i ones = _mm_set1_epi8( -1 );
+    const __m128i near_limit = _mm_set1_epi16( static_cast<short>(thresholds.near_units) );
+    const __m128i far_limit = _mm_set1_epi16( static_cast<short>(thresholds.far_units) );
+
+    int i = 0;
+    for ( ; i + 16 <= count; i += 16 ) {
+        __m128i d0 = _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + i) );
+        __m128i d1 = _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + i + 8) );
+
+        // Not near: (d - 1) >= near_units, as unsigned.
+        __m128i m0 = _mm_sub_epi16( d0, one );
+        __m128i m1 = _mm_sub_epi16( d1, one );
+        __m128i not_near = _mm_packs_epi16( _mm_cmpeq_epi16( _mm_max_epu16( m0, near_limit ), m0 ),
+                                            _mm_cmpeq_epi16( _mm_max_epu16( m1, near_limit ), m1 ) );
+        // Not far: max(d, far_units) == far_units.
+        __m128i not_far = _mm_packs_epi16( _mm_cmpeq_epi16( _mm_max_epu16( d0, far_limit ), far_limit ),
+                                           _mm_cmpeq_epi16( _mm_max_epu16( d1, far_limit ), far_limit ) );
+
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(near_mask + i), _mm_xor_si128( not_near, ones ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(far_mask + i), _mm_xor_si128( not_far, ones ) );
+    }
+    build_depth_masks_scalar( depth + i, near_mask + i, far_mask + i, count - i, thresholds );
+}
+
+RS_TARGET_AVX2 inline void build_depth_masks_avx2( const uint16_t* depth, uint8_t* near_mask, uint8_t* far_mask, int count, depth_mask_thresholds thresholds ) {
+    const __m256i one = _mm256_set1_epi16( 1 );
+    const __m256i ones = _mm256_set1_epi8( -1 );
+    const __m256i near_limit = _mm256_set1_epi16( static_cast<short>(thresholds.near_units) );
+    const __m256i far_limit = _mm256_set1_epi16( static_cast<short>(thresholds.far_units) );
+
+    int i = 0;
+    for ( ; i + 32 <= count; i += 32 ) {
+        __m256i d0 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(depth + i) );
+        __m256i d1 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(depth + i + 16) );
+
+        __m256i m0 = _mm256_sub_epi16( d0, one );
+        __m256i m1 = _mm256_sub_epi16( d1, one );
+        __m256i not_near = _mm256_packs_epi16( _mm256_cmpeq_epi16( _mm256_max_epu16( m0, near_limit ), m0 ),
+                                               _mm256_cmpeq_epi16( _mm256_max_epu16( m1, near_limit ), m1 ) );
+        __m256i not_far = _mm256_packs_epi16( _mm256_cmpeq_epi16( _mm256_max_epu16( d0, far_limit ), far_limit ),
+                                              _mm256_cmpeq_epi16( _mm256_max_epu16( d1, far_limit ), far_limit ) );
+
+        // packs works within 128-bit lanes, put the four quarters back in pixel order.
+        not_near = _mm256_permute4x64_epi64( not_near, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+        not_far = _mm256_permute4x64_epi64( not_far, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(near_mask + i), _mm256_xor_si256( not_near, ones ) );
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(far_mask + i), _mm256_xor_si256( not_far, ones ) );
+    }
+    build_depth_masks_scalar( depth + i, near_mask + i, far_mask + i, count - i, thresholds );
+}
+#endif
+
+// One row at the given SIMD level.
+inline void build_depth_masks_row( const uint16_t* depth, uint8_t* near_mask, uint8_t* far_mask, int count,
+                                   depth_mask_thresholds thresholds, simd_level level ) {
+#if RS_SIMD_X86
+    if ( level == simd_level::avx2 )
+        return build_depth_masks_avx2( depth, near_mask, far_mask, count, thresholds );
+    if ( level == simd_level::sse41 )
+        return build_depth_masks_sse41( depth, near_mask, far_mask, count, thresholds );
+#endif
+    build_depth_masks_scalar( depth, near_mask, far_mask, count, thresholds );
+}
+
+// Writes 255 to near_mask and far_mask where a pixel is near or far, 0 elsewhere.
+// The depth is tightly packed, the masks are width x height bytes with rows mask_step bytes apart.
+inline void build_depth_masks( const uint16_t* depth, int width, int height, depth_mask_thresholds thresholds,
+                               uint8_t* near_mask, uint8_t* far_mask, size_t mask_step ) {
+    const simd_level level = get_simd_level();
+
+#pragma omp parallel for schedule(static)
+    for ( int y = 0; y < height; y++ )
+        build_depth_masks_row( depth + static_cast<size_t>(y) * width, near_mask + y * mask_step, far_mask + y * mask_step,
+                               width, thresholds, level );
+}
@@ -0,0 +1,428 @@
+// fast-align.hpp : Depth to color (or any other stream) alignment with precomputed deprojection tables.
+//
+// rs2::align deprojects two corners of every depth pixel on every frame, although the rays only depend on the
+// intrinsics and extrinsics. Here the rays of every pixel corner are rotated into the other camera, scaled to
+// meters and cached, so aligning a frame costs one multiply-add per coordinate and a projection.
+// The result matches rs2::align: each depth pixel is splatted on the rectangle between its projected corners,
+// and where several depth pixels land on the same output pixel the closest one wins (occlusion).
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include <librealsense2/rsutil.h>
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+class depth_aligner {
+public:
+    // Rebuilds the tables if anything changed. Returns true if they were rebuilt.
+    bool configure( const rs2_intrinsics& depth_intrin, const rs2_intrinsics& other_intrin, const rs2_extrinsics& depth_to_other, float depth_scale ) {
+        if ( _configured
+             && std::memcmp( &depth_intrin, &_depth_intrin, sizeof( rs2_intrinsics ) ) == 0
+             && std::memcmp( &other_intrin, &_other_intrin, sizeof( rs2_intrinsics ) ) == 0
+             && std::memcmp( &depth_to_other, &_depth_to_other, sizeof( rs2_extrinsics ) ) == 0
+             && depth_scale == _depth_scale )
+            return false;
+
+        _depth_intrin = depth_intrin;
+        _other_intrin = other_intrin;
+        _depth_to_other = depth_to_other;
+        _depth_scale = depth_scale;
+        build_tables();
+        _configured = true;
+        return true;
+    }
+
+    int width() const { return _other_intrin.width; }
+    int height() const { return _other_intrin.height; }
+
+    // depth is depth_intrin.width x depth_intrin.height, aligned is width() x height(), both tightly packed.
+    void align( const uint16_t* depth, uint16_t* aligned ) {
+        project( depth );
+
+        // Pass 2: every thread owns a band of output rows, so the closest-depth test needs no synchronization.
+        const int band_count = (height() + band_height - 1) / band_height;
+#pragma omp parallel for schedule(dynamic)
+        for ( int band = 0; band < band_count; band++ ) {
+            const int v_begin = band * band_height;
+            splat_band( depth, aligned + static_cast<size_t>(v_begin) * width(), v_begin, std::min( v_begin + band_height, height() ) );
+        }
+    }
+
+    // Same as align(), but the aligned depth is never stored as a whole: each band of rows is splatted into a small
+    // per-thread buffer and handed to band_fn( const uint16_t* rows, int v_begin, int v_end ) while still in cache.
+    // band_fn is called concurrently for different bands.
+    template <class BandFn>
+    void align_bands( const uint16_t* depth, BandFn band_fn ) {
+        project( depth );
+
+        const int band_count = (height() + band_height - 1) / band_height;
+        const size_t band_size = static_cast<size_t>(band_height) * width();
+#ifdef _OPENMP
+        const int max_threads = omp_get_max_threads();
+#else
+        const int max_threads = 1;
+#endif
+        if ( _band_scratch.size() < band_size * max_threads )
+            _band_scratch.resize( band_size * max_threads );
+
+#pragma omp parallel num_threads(max_threads)
+        {
+#ifdef _OPENMP
+            uint16_t* rows = &_band_scratch[band_size * omp_get_thread_num()];
+#else
+            uint16_t* rows = &_band_scratch[0];
+#endif
+#pragma omp for schedule(dynamic)
+            for ( int band = 0; band < band_count; band++ ) {
+                const int v_begin = band * band_height;
+                const int v_end = std::min( v_begin + band_height, height() );
+                splat_band( depth, rows, v_begin, v_end );
+                band_fn( static_cast<const uint16_t*>(rows), v_begin, v_end );
+            }
+        }
+    }
+
+private:
+    static const int band_height = 16;
+
+    // Pass 1: project the corners of every depth pixel, rows are independent.
+    void project( const uint16_t* depth ) {
+        if ( !_configured )
+            throw std::logic_error( "depth_aligner used before configure" );
+
+        const int depth_height = _depth_intrin.height;
+        const simd_level level = get_simd_level();
+#pragma omp parallel for schedule(static)
+        for ( int y = 0; y < depth_height; y++ ) {
+#if RS_SIMD_X86
+            if ( _pinhole && level == simd_level::avx2 )
+                project_row_avx2( depth, y );
+            else
+#endif
+                project_row( depth, y );
+        }
+    }
+
+    void build_tables() {
+        const int dw = _depth_intrin.width;
+        const int dh = _depth_intrin.height;
+        const size_t corners = static_cast<size_t>(dw + 1) * (dh + 1);
+        _ray_x.resize( corners );
+        _ray_y.resize( corners );
+        _ray_z.resize( corners );
+
+        // Only rotate here, the translation is added per frame after scaling by depth.
+        rs2_extrinsics rotation = _depth_to_other;
+        rotation.translation[0] = rotation.translation[1] = rotation.translation[2] = 0.f;
+
+        // Corner (x, y) is the top-left corner of depth pixel (x, y), i.e. pixel coordinate (x - 0.5, y - 0.5).
+        for ( int y = 0; y <= dh; y++ ) {
+            for ( int x = 0; x <= dw; x++ ) {
+                float pixel[2] = { x - 0.5f, y - 0.5f }, ray[3], rotated[3];
+                rs2_deproject_pixel_to_point( ray, &_depth_intrin, pixel, _depth_scale );
+                rs2_transform_point_to_point( rotated, &rotation, ray );
+                const size_t i = static_cast<size_t>(y) * (dw + 1) + x;
+                _ray_x[i] = rotated[0];
+                _ray_y[i] = rotated[1];
+                _ray_z[i] = rotated[2];
+            }
+        }
+
+        // Brown-Conrady models with all coefficients at 0 (common on color sensors) project like a pinhole.
+        _pinhole = _other_intrin.model == RS2_DISTORTION_NONE;
+        if ( _other_intrin.model == RS2_DISTORTION_MODIFIED_BROWN_CONRADY
+             || _other_intrin.model == RS2_DISTORTION_INVERSE_BROWN_CONRADY
+             || _other_intrin.model == RS2_DISTORTION_BROWN_CONRADY ) {
+            _pinhole = std::all_of( std::begin( _other_intrin.coeffs ), std::end( _other_intrin.coeffs ), []( float c ) { return c == 0.f; } );
+        }
+
+        const size_t pixels = static_cast<size_t>(dw) * dh;
+        _x0.resize( pixels );
+        _y0.resize( pixels );
+        _x1.resize( pixels );
+        _y1.resize( pixels );
+        _row_min_v.resize( dh );
+        _row_max_v.resize( dh );
+    }
+
+    // Projects corner c of a pixel with raw depth z into the other image, already offset by 0.5 for rounding.
+    void project_corner( size_t c, uint16_t z, float& u, float& v ) const {
+        const float point[3] = {
+            z * _ray_x[c] + _depth_to_other.translation[0],
+            z * _ray_y[c] + _depth_to_other.translation[1],
+            z * _ray_z[c] + _depth_to_other.translation[2]
+        };
+        float pixel[2];
+        if ( _pinhole ) {
+            pixel[0] = point[0] / point[2] * _other_intrin.fx + _other_intrin.ppx;
+            pixel[1] = point[1] / point[2] * _other_intrin.fy + _other_intrin.ppy;
+        }
+        else
+            rs2_project_point_to_pixel( pixel, &_other_intrin, point );
+        u = pixel[0] + 0.5f;
+        v = pixel[1] + 0.5f;
+    }
+
+    // Stores the output rectangle of depth pixel (x, y), or _x0 = -1 if it lands nowhere.
+    void project_pixel( const uint16_t* depth, int y, int x ) {
+        const int dw = _depth_intrin.width;
+        const size_t i = static_cast<size_t>(y) * dw + x;
+        const uint16_t z = depth[i];
+        _x0[i] = -1;
+        // Skip over depth pixels with the value of zero, we have no depth data so we will not write anything.
+        if ( !z )
+            return;
+
+        float u0, v0, u1, v1;
+        project_corner( static_cast<size_t>(y) * (dw + 1) + x, z, u0, v0 );
+        project_corner( static_cast<size_t>(y + 1) * (dw + 1) + x + 1, z, u1, v1 );
+
+        // Same rule as rs2::align, truncating (u + 0.5) and dropping pixels whose rectangle leaves the image.
+        // Written on floats so that NaN and huge values are rejected before being converted.
+        const float ow = static_cast<float>(width());
+        const float oh = static_cast<float>(height());
+        if ( !(u0 > -1.f && v0 > -1.f && u1 > -1.f && v1 > -1.f && u0 < ow && v0 < oh && u1 < ow && v1 < oh) )
+            return;
+
+        _x0[i] = static_cast<int16_t>(u0);
+        _y0[i] = static_cast<int16_t>(v0);
+        _x1[i] = static_cast<int16_t>(u1);
+        _y1[i] = static_cast<int16_t>(v1);
+    }
+
+    void project_row( const uint16_t* depth, int y ) {
+        for ( int x = 0; x < _depth_intrin.width; x++ )
+            project_pixel( depth, y, x );
+        update_row_range( y );
+    }
+
+#if RS_SIMD_X86
+    // Pinhole projection of 8 depth pixels at a time.
+    RS_TARGET_AVX2 void project_row_avx2( const uint16_t* depth, int y ) {
+        const int dw = _depth_intrin.width;
+        const __m256 tx = _mm256_set1_ps( _depth_to_other.translation[0] );
+        const __m256 ty = _mm256_set1_ps( _depth_to_other.translation[1] );
+        const __m256 tz = _mm256_set1_ps( _depth_to_other.translation[2] );
+        const __m256 fx = _mm256_set1_ps( _other_intrin.fx );
+        const __m256 fy = _mm256_set1_ps( _other_intrin.fy );
+        const __m256 ppx = _mm256_set1_ps( _other_intrin.ppx );
+        const __m256 ppy = _mm256_set1_ps( _other_intrin.ppy );
+        const __m256 half = _mm256_set1_ps( 0.5f );
+        const __m256 minus_one = _mm256_set1_ps( -1.f );
+        const __m256 ow = _mm256_set1_ps( static_cast<float>(width()) );
+        const __m256 oh = _mm256_set1_ps( static_cast<float>(height()) );
+        const __m256i invalid = _mm256_set1_epi32( -1 );
+
+        const size_t row = static_cast<size_t>(y) * dw;
+        const size_t top = static_cast<size_t>(y) * (dw + 1);           // Top-left corner of pixel 0.
+        const size_t bottom = static_cast<size_t>(y + 1) * (dw + 1) + 1; // Bottom-right corner of pixel 0.
+
+        int x = 0;
+        for ( ; x + 8 <= dw; x += 8 ) {
+            const __m128i z16 = _mm_loadu_si128( reinterpret_cast<const __m128i*>(depth + row + x) );
+            const __m256i z32 = _mm256_cvtepu16_epi32( z16 );
+            const __m256 z = _mm256_cvtepi32_ps( z32 );
+
+            __m256 u[2], v[2];
+            const size_t corner[2] = { top + x, bottom + x };
+            for ( int c = 0; c < 2; c++ ) {
+                const __m256 px = _mm256_add_ps( _mm256_mul_ps( z, _mm256_loadu_ps( &_ray_x[corner[c]] ) ), tx );
+                const __m256 py = _mm256_add_ps( _mm256_mul_ps( z, _mm256_loadu_ps( &_ray_y[corner[c]] ) ), ty );
+                const __m256 pz = _mm256_add_ps( _mm256_mul_ps( z, _mm256_loadu_ps( &_ray_z[corner[c]] ) ), tz );
+                // Same operations, in the same order, as project_corner() so both paths give identical results.
+                u[c] = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_div_ps( px, pz ), fx ), ppx ), half );
+                v[c] = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( _mm256_div_ps( py, pz ), fy ), ppy ), half );
+            }
+
+            // Ordered compares are false for NaN, which rejects points on the camera plane as well.
+            __m256 ok = _mm256_castsi256_ps( _mm256_xor_si256( _mm256_cmpeq_epi32( z32, _mm256_setzero_si256() ), invalid ) );
+            for ( int c = 0; c < 2; c++ ) {
+                ok = _mm256_and_ps( ok, _mm256_cmp_ps( u[c], minus_one, _CMP_GT_OQ ) );
+                ok = _mm256_and_ps( ok, _mm256_cmp_ps( v[c], minus_one, _CMP_GT_OQ ) );
+                ok = _mm256_and_ps( ok, _mm256_cmp_ps( u[c], ow, _CMP_LT_OQ ) );
+                ok = _mm256_and_ps( ok, _mm256_cmp_ps( v[c], oh, _CMP_LT_OQ ) );
+            }
+            const __m256i keep = _mm256_castps_si256( ok );
+
+            // Invalid lanes may hold garbage after the conversion, they are replaced by -1 before packing.
+            store_coords( &_x0[row + x], _mm256_blendv_epi8( invalid, _mm256_cvttps_epi32( u[0] ), keep ) );
+            store_coords( &_y0[row + x], _mm256_cvttps_epi32( _mm256_and_ps( v[0], ok ) ) );
+            store_coords( &_x1[row + x], _mm256_cvttps_epi32( _mm256_and_ps( u[1], ok ) ) );
+            store_coords( &_y1[row + x], _mm256_cvttps_epi32( _mm256_and_ps( v[1], ok ) ) );
+        }
+
+        for ( ; x < dw; x++ )
+            project_pixel( depth, y, x );
+        update_row_range( y );
+    }
+
+    static RS_TARGET_AVX2 void store_coords( int16_t* dst, __m256i values ) {
+        const __m128i packed = _mm_packs_epi32( _mm256_castsi256_si128( values ), _mm256_extracti128_si256( values, 1 ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(dst), packed );
+    }
+#endif
+
+    // Range of output rows touched by depth row y, so bands can skip the rows that cannot reach them.
+    void update_row_range( int y ) {
+        const int dw = _depth_intrin.width;
+        const size_t row = static_cast<size_t>(y) * dw;
+        int min_v = height();
+        int max_v = -1;
+        for ( int x = 0; x < dw; x++ ) {
+            if ( _x0[row + x] < 0 )
+                continue;
+            min_v = std::min<int>( min_v, _y0[row + x] );
+            max_v = std::max<int>( max_v, _y1[row + x] );
+        }
+        _row_min_v[y] = min_v;
+        _row_max_v[y] = max_v;
+    }
+
+    // Writes output rows [v_begin, v_end) to rows, which points at row v_begin.
+    void splat_band( const uint16_t* depth, uint16_t* rows, int v_begin, int v_end ) const {
+        const int dw = _depth_intrin.width;
+        const int dh = _depth_intrin.height;
+        const int ow = width();
+        std::fill( rows, rows + static_cast<size_t>(v_end - v_begin) * ow, uint16_t( 0 ) );
+
+        for ( int y = 0; y < dh; y++ ) {
+            if ( _row_max_v[y] < v_begin || _row_min_v[y] >= v_end )
+                continue;
+
+            const size_t row = static_cast<size_t>(y) * dw;
+            for ( int x = 0; x < dw; x++ ) {
+                const size_t i = row + x;
+                if ( _x0[i] < 0 )
+                    continue;
+
+                const uint16_t z = depth[i];
+                const int first_v = std::max<int>( _y0[i], v_begin );
+                const int last_v = std::min<int>( _y1[i], v_end - 1 );
+                for ( int v = first_v; v <= last_v; v++ ) {
+                    uint16_t* out = rows + static_cast<size_t>(v - v_begin) * ow;
+                    for ( int u = _x0[i]; u <= _x1[i]; u++ ) {
+                        // Keep the closest depth where pixels overlap.
+                        if ( !out[u] || z < out[u] )
+                            out[u] = z;
+                    }
+                }
+            }
+        }
+    }
+
+    bool _configured = false;
+    bool _pinhole = false;
+    rs2_intrinsics _depth_intrin;
+    rs2_intrinsics _other_intrin;
+    rs2_extrinsics _depth_to_other;
+    float _depth_scale = 0.f;
+
+    // Rotated, scaled rays of the (width + 1) x (height + 1) depth pixel corners.
+    std::vector<float> _ray_x, _ray_y, _ray_z;
+    // Per depth pixel output rectangle, inclusive.
+    std::vector<int16_t> _x0, _y0, _x1, _y1;
+    std::vector<int> _row_min_v, _row_max_v;
+    // One band of aligned depth per thread, for align_bands().
+    std::vector<uint16_t> _band_scratch;
+};
+
+// Drop-in replacement for rs2::align, for aligning depth to another stream.
+class fast_align {
+public:
+    explicit fast_align( rs2_stream align_to )
+        : _state( std::make_shared<state>() ),
+          _block( [s = _state]( rs2::frame f, rs2::frame_source& src ) { align_frames( *s, f, src ); } ) {
+        _state->align_to = align_to;
+        _block.start( _queue );
+    }
+
+    rs2::frameset process( rs2::frameset frames ) {
+        _block.invoke( frames );
+        rs2::frame result;
+        if ( !_queue.poll_for_frame( &result ) )
+            throw std::runtime_error( "Error occured during alignment! See the log for more info" );
+        return result;
+    }
+
+    // Fused path: aligns the depth of frames band by band, see depth_aligner::align_bands, without producing an
+    // aligned depth frame. Returns false if frames lack depth or the stream to align to.
+    template <class BandFn>
+    bool align_bands( const rs2::frameset& frames, BandFn band_fn ) {
+        rs2::depth_frame depth = frames.first_or_default( RS2_STREAM_DEPTH, RS2_FORMAT_Z16 );
+        rs2::frame other = frames.first_or_default( _state->align_to );
+        if ( !depth || !other )
+            return false;
+
+        update_calibration( *_state, depth, other );
+        _state->aligner.align_bands( reinterpret_cast<const uint16_t*>(depth.get_data()), band_fn );
+        return true;
+    }
+
+private:
+    struct state {
+        rs2_stream align_to = RS2_STREAM_ANY;
+        depth_aligner aligner;
+        int depth_profile_id = -1;
+        int other_profile_id = -1;
+        rs2_intrinsics depth_intrin;
+        rs2_intrinsics other_intrin;
+        rs2_extrinsics depth_to_other;
+        rs2::stream_profile aligned_profile;
+    };
+
+    // Only query the SDK for calibration when a profile changes, e.g. after a device reconnection.
+    static void update_calibration( state& s, const rs2::depth_frame& depth, const rs2::frame& other ) {
+        auto depth_profile = depth.get_profile().as<rs2::video_stream_profile>();
+        auto other_profile = other.get_profile().as<rs2::video_stream_profile>();
+        if ( depth_profile.unique_id() != s.depth_profile_id || other_profile.unique_id() != s.other_profile_id ) {
+            s.depth_intrin = depth_profile.get_intrinsics();
+            s.other_intrin = other_profile.get_intrinsics();
+            s.depth_to_other = depth_profile.get_extrinsics_to( other_profile );
+            s.depth_profile_id = depth_profile.unique_id();
+            s.other_profile_id = other_profile.unique_id();
+            s.aligned_profile = depth_profile.clone( RS2_STREAM_DEPTH, depth_profile.stream_index(), RS2_FORMAT_Z16,
+                                                     s.other_intrin.width, s.other_intrin.height, s.other_intrin );
+        }
+        s.aligner.configure( s.depth_intrin, s.other_intrin, s.depth_to_other, depth.get_units() );
+    }
+
+    static void align_frames( state& s, rs2::frame f, rs2::frame_source& src ) {
+        rs2::frameset frames = f;
+        rs2::depth_frame depth = frames.first_or_default( RS2_STREAM_DEPTH, RS2_FORMAT_Z16 );
+        rs2::frame other = frames.first_or_default( s.align_to );
+        if ( !depth || !other ) {
+            src.frame_ready( f );
+            return;
+        }
+        update_calibration( s, depth, other );
+
+        const int w = s.aligner.width();
+        const int h = s.aligner.height();
+        rs2::frame aligned = src.allocate_video_frame( s.aligned_profile, depth, 2, w, h, w * 2, RS2_EXTENSION_DEPTH_FRAME );
+        s.aligner.align( reinterpret_cast<const uint16_t*>(depth.get_data()),
+                         reinterpret_cast<uint16_t*>(const_cast<void*>(aligned.get_data())) );
+
+        // Same content as rs2::align output: the aligned depth in place of the original, every other frame as is.
+        std::vector<rs2::frame> output;
+        for ( auto&& frame : frames ) {
+            if ( frame.get_profile().stream_type() != RS2_STREAM_DEPTH )
+                output.push_back( frame );
+        }
+        output.push_back( aligned );
+        src.frame_ready( src.allocate_composite_frame( output ) );
+    }
+
+    std::shared_ptr<state> _state;
+    rs2::processing_block _block;
+    rs2::frame_queue _queue;
+};
@@ -0,0 +1,152 @@
+// frame-pool.hpp : Recycled image buffers, so processing results never have to be written into SDK frames.
+//
+// Frames handed out by librealsense can be shared with other consumers (recorders, other processing blocks),
+// so writing into them is not safe. A frame_pool hands out pooled_frame buffers instead: the first pixel starts on a
+// 64 byte boundary, rows are tightly packed like SDK frames, copies share the same memory, and the memory goes back
+// to the pool's free list when the last copy is gone. Once the pool is warm, acquiring a frame does not allocate.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class frame_pool;
+
+class pooled_frame {
+public:
+    pooled_frame() = default;
+
+    pooled_frame( const pooled_frame& other )
+        : _block( other._block ), _width( other._width ), _height( other._height ), _bpp( other._bpp ), _stride( other._stride ) {
+        if ( _block )
+            _block->refs++;
+    }
+
+    pooled_frame( pooled_frame&& other )
+        : _block( other._block ), _width( other._width ), _height( other._height ), _bpp( other._bpp ), _stride( other._stride ) {
+        other._block = nullptr;
+    }
+
+    pooled_frame& operator=( pooled_frame other ) {
+        std::swap( _block, other._block );
+        _width = other._width;
+        _height = other._height;
+        _bpp = other._bpp;
+        _stride = other._stride;
+        return *this;
+    }
+
+    ~pooled_frame() {
+        if ( _block && --_block->refs == 0 )
+            release( _block );
+    }
+
+    explicit operator bool() const { return _block != nullptr; }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int bytes_per_pixel() const { return _bpp; }
+    int stride() const { return _stride; }
+
+    uint8_t* data() const { return _block ? _block->data : nullptr; }
+    uint8_t* row( int y ) const { return data() + static_cast<size_t>(y) * _stride; }
+
+private:
+    friend class frame_pool;
+
+    struct pool_state;
+
+    struct block {
+        std::unique_ptr<uint8_t[]> storage;
+        uint8_t* data = nullptr;                // storage, rounded up to the alignment.
+        size_t capacity = 0;
+        std::atomic<int> refs{ 0 };
+        std::shared_ptr<pool_state> owner;      // Only set while handed out, keeps the free list alive.
+    };
+
+    struct pool_state {
+        std::mutex mutex;
+        std::vector<block*> free_blocks;
+
+        ~pool_state() {
+            for ( block* b : free_blocks )
+                delete b;
+        }
+    };
+
+    // Returns the memory to the pool it came from, or frees it if that pool is gone.
+    static void release( block* b ) {
+        std::shared_ptr<pool_state> owner = std::move( b->owner );
+        if ( !owner ) {
+            delete b;
+            return;
+        }
+        std::lock_guard<std::mutex> lock( owner->mutex );
+        owner->free_blocks.push_back( b );
+    }
+
+    block* _block = nullptr;
+    int _width = 0;
+    int _height = 0;
+    int _bpp = 0;
+    int _stride = 0;
+};
+
+class frame_pool {
+public:
+    static const size_t alignment = 64;
+
+    frame_pool() : _state( std::make_shared<pooled_frame::pool_state>() ) {}
+
+    frame_pool( const frame_pool& ) = delete;
+    frame_pool& operator=( const frame_pool& ) = delete;
+
+    // Returns an uninitialized width x height frame.
+    pooled_frame acquire( int width, int height, int bytes_per_pixel ) {
+        const size_t stride = static_cast<size_t>(width) * bytes_per_pixel;
+        const size_t size = stride * height;
+
+        pooled_frame::block* b = nullptr;
+        {
+            std::lock_guard<std::mutex> lock( _state->mutex );
+            // Take the smallest block that fits, so a frame of another resolution does not hold a large one.
+            auto& free_blocks = _state->free_blocks;
+            size_t best = free_blocks.size();
+            for ( size_t i = 0; i < free_blocks.size(); i++ ) {
+                if ( free_blocks[i]->capacity >= size && (best == free_blocks.size() || free_blocks[i]->capacity < free_blocks[best]->capacity) )
+                    best = i;
+            }
+            if ( best < free_blocks.size() ) {
+                b = free_blocks[best];
+                free_blocks[best] = free_blocks.back();
+                free_blocks.pop_back();
+            }
+        }
+
+        if ( !b ) {
+            b = new pooled_frame::block;
+            b->storage.reset( new uint8_t[size + alignment] );
+            const uintptr_t address = reinterpret_cast<uintptr_t>(b->storage.get());
+            b->data = b->storage.get() + (alignment - address % alignment) % alignment;
+            b->capacity = size;
+        }
+
+        b->refs = 1;
+        b->owner = _state;
+
+        pooled_frame f;
+        f._block = b;
+        f._width = width;
+        f._height = height;
+        f._bpp = bytes_per_pixel;
+        f._stride = static_cast<int>(stride);
+        return f;
+    }
+
+private:
+    std::shared_ptr<pooled_frame::pool_state> _state;
+};
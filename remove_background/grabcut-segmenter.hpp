@@ -0,0 +1,366 @@
+// grabcut-segmenter.hpp : GrabCut on a reduced resolution chosen from a time budget, with edge-aware upsampling.
+//
+// GrabCut cost grows with the number of pixels, so each level of the pyramid divides it by about four. The level
+// is picked from the measured cost of previous frames. The low resolution result is brought back to full
+// resolution with a fast guided filter driven by the full resolution color, so edges follow the image instead of
+// the blocks of the small mask. Pixels the depth marked as sure foreground or background keep that label.
+//
+// With warm start enabled the color models learned on one frame are reused on the next ones, which skips the
+// k-means initialization and, with OpenCV 4, the model updates. The models are learned again when the scene
+// changes (color histogram or amount of sure foreground moved too much) or when they get too old.
+//
+// In region mode GrabCut only runs around the blobs of sure foreground: each significant connected component
+// gets a padded box, overlapping boxes are merged, and the boxes are segmented in parallel. Everything outside
+// of them is background, so the cost follows the size of the foreground rather than the sensor resolution.
+#pragma once
+
+#include "bit-mask.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+// Initial labels from the depth masks: background by default, "probably background" outside of the far mask,
+// foreground inside the near mask. Reads 64 pixels at a time and skips words without any near or far pixel.
+inline void labels_from_depth_masks( const bit_mask& near_mask, const bit_mask& far_mask, cv::Mat& labels ) {
+    const int width = near_mask.width();
+    labels.create( near_mask.height(), width, CV_8UC1 );
+
+#pragma omp parallel for schedule(static)
+    for ( int y = 0; y < near_mask.height(); y++ ) {
+        const uint64_t* near_row = near_mask.row( y );
+        const uint64_t* far_row = far_mask.row( y );
+        uint8_t* out = labels.ptr<uint8_t>( y );
+        for ( int w = 0; w < near_mask.words_per_row(); w++ ) {
+            const int count = std::min( 64, width - w * 64 );
+            uint8_t* o = out + w * 64;
+            const uint64_t near_bits = near_row[w];
+            const uint64_t far_bits = far_row[w];
+            if ( near_bits == 0 && far_bits == 0 ) {
+                std::fill( o, o + count, static_cast<uint8_t>(cv::GC_PR_BGD) );
+                continue;
+            }
+            for ( int i = 0; i < count; i++ )
+                o[i] = (near_bits >> i) & 1 ? cv::GC_FGD : (far_bits >> i) & 1 ? cv::GC_BGD : cv::GC_PR_BGD;
+        }
+    }
+}
+
+// Uses boxes around the objects of interest (e.g. detected people) to refine the labels built from depth.
+// Outside of every padded box, "probably background" becomes background. Inside, background becomes "probably
+// background", so GrabCut can recover parts the depth thresholds missed. Sure foreground is left alone.
+inline void seed_labels_from_boxes( cv::Mat& labels, const std::vector<cv::Rect>& boxes, int padding, cv::Mat& scratch ) {
+    if ( boxes.empty() )
+        return;
+
+    const cv::Rect image( 0, 0, labels.cols, labels.rows );
+    scratch.create( labels.size(), CV_8UC1 );
+    scratch.setTo( cv::Scalar::all( 0 ) );
+    for ( auto& box : boxes ) {
+        const cv::Rect padded = cv::Rect( box.x - padding, box.y - padding, box.width + 2 * padding, box.height + 2 * padding ) & image;
+        cv::Mat roi = labels( padded );
+        roi.setTo( cv::GC_PR_BGD, roi == cv::GC_BGD );
+        scratch( padded ).setTo( cv::Scalar::all( 255 ) );
+    }
+    labels.setTo( cv::GC_BGD, (scratch == 0) & (labels == cv::GC_PR_BGD) );
+}
+
+class grabcut_segmenter {
+public:
+    // A budget of 0 always runs GrabCut at full resolution.
+    explicit grabcut_segmenter( double budget_ms = 0.0, int max_level = 3 )
+        : _budget_ms( budget_ms ), _max_level( max_level ) {}
+
+    void set_budget( double budget_ms ) { _budget_ms = budget_ms; }
+    double budget() const { return _budget_ms; }
+
+    // histogram_change is a Bhattacharyya distance in [0, 1], foreground_change a fraction of the image.
+    void set_warm_start( bool enabled, double histogram_change = 0.3, double foreground_change = 0.1, int max_model_age = 90 ) {
+        _warm_start = enabled;
+        _histogram_change = histogram_change;
+        _foreground_change = foreground_change;
+        _max_model_age = max_model_age;
+        _have_models = false;
+    }
+    bool warm_start() const { return _warm_start; }
+
+    // Number of times the color models were learned from scratch.
+    int model_resets() const { return _model_resets; }
+
+    // Blobs smaller than min_area pixels are ignored, boxes grow by padding pixels on every side.
+    void set_region_options( int min_area, int padding ) {
+        _min_region_area = min_area;
+        _region_padding = padding;
+    }
+
+    // Boxes GrabCut ran on during the last call to segment_regions().
+    std::vector<cv::Rect> region_boxes() const {
+        std::vector<cv::Rect> boxes;
+        for ( auto& r : _regions )
+            boxes.push_back( r.box );
+        return boxes;
+    }
+
+    // Pyramid level used by the last call to segment(), 0 is full resolution.
+    int level() const { return _level; }
+
+    // color is the full resolution BGR image, labels holds GC_BGD, GC_FGD, GC_PR_BGD or GC_PR_FGD for every pixel.
+    // Writes 255 to foreground where a pixel belongs to the foreground, 0 elsewhere.
+    void segment( const cv::Mat& color, const cv::Mat& labels, cv::Mat& foreground ) {
+        _level = choose_level( color.total() );
+
+        if ( _level == 0 ) {
+            labels.copyTo( _labels );
+            if ( !has_both_classes( _labels ) ) {
+                labels_to_foreground( labels, foreground );
+                return;
+            }
+            run_grabcut( color );
+            // GC_FGD and GC_PR_FGD are the two odd labels.
+            cv::bitwise_and( _labels, cv::Scalar::all( 1 ), foreground );
+            foreground *= 255;
+            return;
+        }
+
+        const cv::Size small( std::max( 1, color.cols >> _level ), std::max( 1, color.rows >> _level ) );
+        cv::resize( color, _small_color, small, 0, 0, cv::INTER_AREA );
+        cv::resize( labels, _labels, small, 0, 0, cv::INTER_NEAREST );
+        // A small object can vanish from the nearest neighbor downscale, leaving GrabCut without foreground samples.
+        if ( !has_both_classes( _labels ) ) {
+            labels_to_foreground( labels, foreground );
+            return;
+        }
+        run_grabcut( _small_color );
+
+        cv::bitwise_and( _labels, cv::Scalar::all( 1 ), _small_alpha );
+        _small_alpha.convertTo( _small_alpha, CV_32F );
+
+        guided_upsample( color, foreground );
+
+        // Depth is trusted where it was sure, whatever happened at low resolution.
+        foreground.setTo( 255, labels == cv::GC_FGD );
+        foreground.setTo( 0, labels == cv::GC_BGD );
+    }
+
+    // Same inputs and output as segment(), but GrabCut only runs on boxes around the GC_FGD blobs of labels,
+    // always at full resolution and with models learned for each box.
+    void segment_regions( const cv::Mat& color, const cv::Mat& labels, cv::Mat& foreground ) {
+        find_regions( labels );
+
+        foreground.create( color.size(), CV_8UC1 );
+        foreground.setTo( cv::Scalar::all( 0 ) );
+
+        // Boxes do not overlap, so every task writes its own part of the output.
+#pragma omp parallel for schedule(dynamic)
+        for ( int i = 0; i < static_cast<int>(_regions.size()); i++ ) {
+            region& r = _regions[i];
+            labels( r.box ).copyTo( r.labels );
+
+            // GrabCut needs background samples, a box with nothing but sure foreground is kept as it is.
+            if ( cv::countNonZero( r.labels != cv::GC_FGD ) > 0 )
+                cv::grabCut( color( r.box ), r.labels, cv::Rect(), r.bg_model, r.fg_model, 1, cv::GC_INIT_WITH_MASK );
+
+            cv::Mat out = foreground( r.box );
+            cv::bitwise_and( r.labels, cv::Scalar::all( 1 ), out );
+            out *= 255;
+        }
+    }
+
+private:
+    struct region {
+        cv::Rect box;
+        cv::Mat labels, bg_model, fg_model;
+    };
+
+    void find_regions( const cv::Mat& labels ) {
+        cv::compare( labels, cv::Scalar::all( cv::GC_FGD ), _near, cv::CMP_EQ );
+        const int count = cv::connectedComponentsWithStats( _near, _components, _stats, _centroids, 8, CV_32S );
+
+        const cv::Rect image( 0, 0, labels.cols, labels.rows );
+        std::vector<cv::Rect> boxes;
+        for ( int c = 1; c < count; c++ ) {    // Component 0 is everything that is not sure foreground.
+            if ( _stats.at<int>( c, cv::CC_STAT_AREA ) < _min_region_area )
+                continue;
+            cv::Rect box( _stats.at<int>( c, cv::CC_STAT_LEFT ) - _region_padding, _stats.at<int>( c, cv::CC_STAT_TOP ) - _region_padding,
+                          _stats.at<int>( c, cv::CC_STAT_WIDTH ) + 2 * _region_padding, _stats.at<int>( c, cv::CC_STAT_HEIGHT ) + 2 * _region_padding );
+            boxes.push_back( box & image );
+        }
+
+        // Merge overlapping boxes until none are left, padding easily makes neighbors touch.
+        bool merged = true;
+        while ( merged ) {
+            merged = false;
+            for ( size_t i = 0; i < boxes.size() && !merged; i++ ) {
+                for ( size_t j = i + 1; j < boxes.size(); j++ ) {
+                    if ( (boxes[i] & boxes[j]).area() > 0 ) {
+                        boxes[i] |= boxes[j];
+                        boxes.erase( boxes.begin() + j );
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Regions keep their buffers from frame to frame.
+        _regions.resize( boxes.size() );
+        for ( size_t i = 0; i < boxes.size(); i++ )
+            _regions[i].box = boxes[i];
+    }
+
+    // GC_INIT_WITH_MASK needs background (even labels) and foreground (odd labels) samples, or grabCut throws.
+    bool has_both_classes( const cv::Mat& labels ) {
+        cv::bitwise_and( labels, cv::Scalar::all( 1 ), _odd );
+        const int foreground = cv::countNonZero( _odd );
+        return foreground > 0 && static_cast<size_t>(foreground) < labels.total();
+    }
+
+    // The depth labels as they are, what GrabCut would have started from.
+    static void labels_to_foreground( const cv::Mat& labels, cv::Mat& foreground ) {
+        cv::bitwise_and( labels, cv::Scalar::all( 1 ), foreground );
+        foreground *= 255;
+    }
+
+    int choose_level( size_t pixels ) const {
+        if ( !(_budget_ms > 0.0) )
+            return 0;
+        // Nothing measured yet, start small and let the estimate bring the level down.
+        if ( !(_ms_per_pixel > 0.0) )
+            return _max_level;
+
+        for ( int level = 0; level < _max_level; level++ ) {
+            const double estimate = _ms_per_pixel * static_cast<double>(pixels >> (2 * level));
+            if ( estimate <= _budget_ms )
+                return level;
+        }
+        return _max_level;
+    }
+
+    void run_grabcut( const cv::Mat& color ) {
+        auto start = std::chrono::steady_clock::now();
+
+        // Inside the timed section, so the change detection is part of the cost the budget sees.
+        const bool changed = scene_changed( color );
+        const bool reset = !_warm_start || changed || _model_age >= _max_model_age;
+        if ( reset ) {
+            cv::grabCut( color, _labels, cv::Rect(), _bg_model, _fg_model, 1, cv::GC_INIT_WITH_MASK );
+            _reference_histogram = _histogram.clone();
+            _reference_foreground = _foreground_fraction;
+            _have_models = _warm_start;
+            _model_age = 0;
+            _model_resets++;
+        }
+        else {
+#if CV_VERSION_MAJOR >= 4
+            cv::grabCut( color, _labels, cv::Rect(), _bg_model, _fg_model, 1, cv::GC_EVAL_FREEZE_MODEL );
+#else
+            cv::grabCut( color, _labels, cv::Rect(), _bg_model, _fg_model, 1, cv::GC_EVAL );
+#endif
+            _model_age++;
+        }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        // Exponential moving average of the cost per pixel, so the level follows the scene.
+        const double sample = elapsed.count() / static_cast<double>(color.total());
+        _ms_per_pixel = _ms_per_pixel > 0.0 ? _ms_per_pixel + (sample - _ms_per_pixel) * 0.2 : sample;
+    }
+
+    // Compares the frame with the one the models were learned on, true if there are no models yet.
+    // Only computes anything with warm start on.
+    bool scene_changed( const cv::Mat& color ) {
+        if ( !_warm_start )
+            return false;
+
+        const int channels[] = { 0, 1, 2 };
+        const int bins[] = { 8, 8, 8 };
+        const float range[] = { 0, 256 };
+        const float* ranges[] = { range, range, range };
+        cv::calcHist( &color, 1, channels, cv::Mat(), _histogram, 3, bins, ranges );
+        cv::normalize( _histogram, _histogram, 1, 0, cv::NORM_L1 );
+
+        _foreground_fraction = static_cast<double>(cv::countNonZero( _labels == cv::GC_FGD )) / static_cast<double>(_labels.total());
+
+        if ( !_have_models )
+            return true;
+        return cv::compareHist( _histogram, _reference_histogram, cv::HISTCMP_BHATTACHARYYA ) > _histogram_change
+            || std::abs( _foreground_fraction - _reference_foreground ) > _foreground_change;
+    }
+
+    // Fast guided filter (He and Sun): the linear coefficients are fitted at low resolution against a gray guide,
+    // upsampled, then applied to the full resolution guide.
+    //
+    // The guide is luminance only, neither depth nor chroma. Where depth was sure, segment() overrides the result
+    // with the depth labels, so the filter only decides the uncertain band along the mask edges. Depth is least
+    // reliable in that band (holes and the edge halo of the sensor), and as a guide it would pull the mask back
+    // onto the errors GrabCut was run to fix. Luminance carries most of the contrast at those edges. A three
+    // channel color guide needs a 3x3 inverse per pixel, about three times the cost. The price is that an edge
+    // between two colors of the same brightness is not sharpened and keeps the shape of the low resolution mask.
+    void guided_upsample( const cv::Mat& color, cv::Mat& foreground ) {
+        const int radius = 2;
+        const double eps = 1e-3;
+        const cv::Size box( 2 * radius + 1, 2 * radius + 1 );
+
+        cv::cvtColor( color, _gray, cv::COLOR_BGR2GRAY );
+        _gray.convertTo( _guide, CV_32F, 1.0 / 255 );
+        cv::resize( _guide, _small_guide, _small_alpha.size(), 0, 0, cv::INTER_AREA );
+
+        const cv::Mat& I = _small_guide;
+        const cv::Mat& p = _small_alpha;
+        cv::boxFilter( I, _mean_I, CV_32F, box );
+        cv::boxFilter( p, _mean_p, CV_32F, box );
+        cv::multiply( I, p, _tmp );
+        cv::boxFilter( _tmp, _corr_Ip, CV_32F, box );
+        cv::multiply( I, I, _tmp );
+        cv::boxFilter( _tmp, _var_I, CV_32F, box );
+
+        // a = cov(I, p) / (var(I) + eps), b = mean(p) - a * mean(I)
+        cv::multiply( _mean_I, _mean_I, _tmp );
+        cv::subtract( _var_I, _tmp, _var_I );
+        cv::multiply( _mean_I, _mean_p, _tmp );
+        cv::subtract( _corr_Ip, _tmp, _a );
+        cv::add( _var_I, cv::Scalar::all( eps ), _var_I );
+        cv::divide( _a, _var_I, _a );
+        cv::multiply( _a, _mean_I, _tmp );
+        cv::subtract( _mean_p, _tmp, _b );
+
+        cv::boxFilter( _a, _a, CV_32F, box );
+        cv::boxFilter( _b, _b, CV_32F, box );
+        cv::resize( _a, _full_a, color.size(), 0, 0, cv::INTER_LINEAR );
+        cv::resize( _b, _full_b, color.size(), 0, 0, cv::INTER_LINEAR );
+
+        // q = a * I + b, then back to a binary mask.
+        cv::multiply( _full_a, _guide, _full_a );
+        cv::add( _full_a, _full_b, _full_a );
+        cv::compare( _full_a, cv::Scalar::all( 0.5 ), foreground, cv::CMP_GT );
+    }
+
+    double _budget_ms;
+    int _max_level;
+    int _level = 0;
+    double _ms_per_pixel = 0.0;
+
+    bool _warm_start = false;
+    bool _have_models = false;
+    double _histogram_change = 0.3;
+    double _foreground_change = 0.1;
+    int _max_model_age = 90;
+    int _model_age = 0;
+    int _model_resets = 0;
+    cv::Mat _histogram, _reference_histogram;
+    double _foreground_fraction = 0.0;
+    double _reference_foreground = 0.0;
+
+    int _min_region_area = 500;
+    int _region_padding = 24;
+    std::vector<region> _regions;
+    cv::Mat _near, _components, _stats, _centroids;
+
+    // Kept between frames so the buffers are only allocated when the resolution changes.
+    cv::Mat _labels, _bg_model, _fg_model, _odd;
+    cv::Mat _small_color, _small_alpha, _gray, _guide, _small_guide;
+    cv::Mat _mean_I, _mean_p, _corr_Ip, _var_I, _a, _b, _tmp, _full_a, _full_b;
+};
@@ -0,0 +1,297 @@
+// object-detector.hpp : MobileNet-SSD detection running on its own thread, off the frame loops.
+//
+// A detection_service owns the network and a worker thread. Every camera registers as a source and offers
+// frames to it; the worker collects the latest pending frame of every source and runs them through the network
+// as a single batch, then scatters the boxes back. It waits for the other sources at most latency_cap after the
+// first frame arrives, so a slow camera never holds back the others.
+//
+// async_detector is what a frame loop uses: submit() never waits. The frame is copied into the service only
+// when a detection is due (every N frames, or right away on a scene change) and the previous one is done,
+// otherwise it is ignored. Results are published as immutable lists that latest() returns without waiting for
+// inference. Input frames, the network blob and the output buffers are reused between runs. An exception
+// thrown by inference stops the worker and is rethrown to the frame loop by the next call to latest().
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct detection {
+    int class_id = 0;
+    float confidence = 0.f;
+    cv::Rect box;           // In pixels of the submitted frame.
+};
+
+struct detection_result {
+    std::vector<detection> detections;
+    uint64_t frame_number = 0;      // Frame the detections were computed on.
+    double inference_ms = 0.0;      // Whole batch, including the frames of other sources.
+    int batch_size = 0;
+};
+
+class detection_service {
+public:
+    // Class 15 is "person" in the 20 VOC classes MobileNet-SSD is trained on, -1 keeps every class.
+    static const int person_class = 15;
+
+    detection_service( const std::string& prototxt, const std::string& weights, double latency_cap_ms = 15.0,
+                       float min_confidence = 0.5f, int class_filter = person_class )
+        : _net( load_network( prototxt, weights ) ), _latency_cap( latency_cap_ms ),
+          _min_confidence( min_confidence ), _class_filter( class_filter ) {
+        _net.setPreferableBackend( cv::dnn::DNN_BACKEND_OPENCV );
+        _net.setPreferableTarget( cv::dnn::DNN_TARGET_CPU );
+        _worker = std::thread( [this] { run(); } );
+    }
+
+    detection_service( const detection_service& ) = delete;
+    detection_service& operator=( const detection_service& ) = delete;
+
+    ~detection_service() {
+        {
+            std::lock_guard<std::mutex> lock( _mutex );
+            _stop = true;
+        }
+        _input_ready.notify_one();
+        _worker.join();
+    }
+
+    // Returns the id to pass to submit() and latest().
+    int add_source() {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _sources.emplace_back( new source );
+        return static_cast<int>(_sources.size()) - 1;
+    }
+
+    // True while a frame of this source is waiting for, or going through, the network.
+    bool busy( int id ) const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _sources[id]->pending || _sources[id]->in_flight;
+    }
+
+    // Offers a BGR frame, returns false without waiting if the source is busy, the service is collecting a batch
+    // or the worker stopped on an error.
+    bool submit( int id, const cv::Mat& bgr, uint64_t frame_number ) {
+        std::unique_lock<std::mutex> lock( _mutex, std::try_to_lock );
+        if ( !lock.owns_lock() || _error )
+            return false;
+        source& s = *_sources[id];
+        if ( s.pending || s.in_flight )
+            return false;
+        bgr.copyTo( s.input );
+        s.frame_number = frame_number;
+        s.pending = true;
+        s.submitted = std::chrono::steady_clock::now();
+        lock.unlock();
+        _input_ready.notify_one();
+        return true;
+    }
+
+    // Most recent detections of a source, null until its first frame went through the network.
+    // Only waits for the service's bookkeeping, never for inference. Rethrows what stopped the worker, if anything.
+    std::shared_ptr<const detection_result> latest( int id ) const {
+        std::lock_guard<std::mutex> lock( _mutex );
+        if ( _error )
+            std::rethrow_exception( _error );
+        return _sources[id]->latest;
+    }
+
+private:
+    struct source {
+        cv::Mat input, resized;
+        uint64_t frame_number = 0;
+        bool pending = false;
+        bool in_flight = false;
+        std::chrono::steady_clock::time_point submitted;
+        std::shared_ptr<const detection_result> latest;
+    };
+
+    // Loading happens on the caller's thread, a missing or broken file is reported right away.
+    static cv::dnn::Net load_network( const std::string& prototxt, const std::string& weights ) {
+        cv::dnn::Net net;
+        try {
+            net = cv::dnn::readNetFromCaffe( prototxt, weights );
+        }
+        catch ( const cv::Exception& e ) {
+            throw std::runtime_error( "Could not load detector network " + prototxt + ": " + e.what() );
+        }
+        if ( net.empty() )
+            throw std::runtime_error( "Could not load detector network " + prototxt );
+        return net;
+    }
+
+    void run() {
+        try {
+            detect();
+        }
+        catch ( ... ) {
+            // Nothing can be detected anymore. Every camera of the batch, and those waiting to join one, is
+            // released and learns about it from latest(), not only the one whose frame failed.
+            std::lock_guard<std::mutex> lock( _mutex );
+            _error = std::current_exception();
+            for ( auto& s : _sources )
+                s->pending = s->in_flight = false;
+        }
+    }
+
+    void detect() {
+        const cv::Size input_size( 300, 300 );
+        const double scale = 1.0 / 127.5;
+        const cv::Scalar mean( 127.5, 127.5, 127.5 );
+
+        std::vector<source*> batch;
+        std::vector<cv::Mat> images;
+        while ( true ) {
+            {
+                std::unique_lock<std::mutex> lock( _mutex );
+                auto any_pending = [this] {
+                    return std::any_of( _sources.begin(), _sources.end(), []( const std::unique_ptr<source>& s ) { return s->pending; } );
+                };
+                auto all_pending = [this] {
+                    return std::all_of( _sources.begin(), _sources.end(), []( const std::unique_ptr<source>& s ) { return s->pending; } );
+                };
+                _input_ready.wait( lock, [&] { return _stop || any_pending(); } );
+                if ( _stop )
+                    return;
+
+                // Give the other sources until the first pending frame is latency_cap old to join the batch.
+                auto oldest = std::chrono::steady_clock::time_point::max();
+                for ( auto& s : _sources )
+                    if ( s->pending )
+                        oldest = std::min( oldest, s->submitted );
+                auto deadline = oldest + std::chrono::duration_cast<std::chrono::steady_clock::duration>( _latency_cap );
+                _input_ready.wait_until( lock, deadline, [&] { return _stop || all_pending(); } );
+                if ( _stop )
+                    return;
+
+                batch.clear();
+                for ( auto& s : _sources ) {
+                    if ( s->pending ) {
+                        s->pending = false;
+                        s->in_flight = true;
+                        batch.push_back( s.get() );
+                    }
+                }
+            }
+
+            // In-flight inputs are not touched by submit().
+            auto start = std::chrono::steady_clock::now();
+            images.resize( batch.size() );
+            for ( size_t i = 0; i < batch.size(); i++ ) {
+                cv::resize( batch[i]->input, batch[i]->resized, input_size );
+                images[i] = batch[i]->resized;
+            }
+            cv::dnn::blobFromImages( images, _blob, scale, input_size, mean, false, false );
+            _net.setInput( _blob, "data" );
+            _net.forward( _output, "detection_out" );
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::vector<std::shared_ptr<detection_result>> results( batch.size() );
+            for ( size_t i = 0; i < batch.size(); i++ ) {
+                results[i] = std::make_shared<detection_result>();
+                results[i]->frame_number = batch[i]->frame_number;
+                results[i]->inference_ms = elapsed.count();
+                results[i]->batch_size = static_cast<int>(batch.size());
+            }
+            parse( batch, results );
+
+            std::lock_guard<std::mutex> lock( _mutex );
+            for ( size_t i = 0; i < batch.size(); i++ ) {
+                batch[i]->latest = std::move( results[i] );
+                batch[i]->in_flight = false;
+            }
+        }
+    }
+
+    // The SSD output is 1 x 1 x N x 7: image in the batch, class, confidence, then the box corners in [0, 1].
+    void parse( const std::vector<source*>& batch, std::vector<std::shared_ptr<detection_result>>& results ) const {
+        const cv::Mat rows( _output.size[2], _output.size[3], CV_32F, const_cast<float*>(_output.ptr<float>()) );
+        for ( int i = 0; i < rows.rows; i++ ) {
+            const float* r = rows.ptr<float>( i );
+            const int image = static_cast<int>(r[0]);
+            if ( image < 0 || image >= static_cast<int>(batch.size()) )
+                continue;
+
+            detection d;
+            d.class_id = static_cast<int>(r[1]);
+            d.confidence = r[2];
+            if ( d.confidence < _min_confidence || (_class_filter >= 0 && d.class_id != _class_filter) )
+                continue;
+
+            const cv::Size frame_size = batch[image]->input.size();
+            cv::Point top_left( static_cast<int>(r[3] * frame_size.width), static_cast<int>(r[4] * frame_size.height) );
+            cv::Point bottom_right( static_cast<int>(r[5] * frame_size.width), static_cast<int>(r[6] * frame_size.height) );
+            d.box = cv::Rect( top_left, bottom_right ) & cv::Rect( cv::Point(), frame_size );
+            if ( d.box.area() > 0 )
+                results[image]->detections.push_back( d );
+        }
+    }
+
+    cv::dnn::Net _net;
+    std::chrono::duration<double, std::milli> _latency_cap;
+    float _min_confidence;
+    int _class_filter;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _input_ready;
+    bool _stop = false;
+    std::exception_ptr _error;      // What stopped the worker.
+    std::vector<std::unique_ptr<source>> _sources;
+
+    // Only used by the worker, reused between batches.
+    cv::Mat _blob, _output;
+
+    std::thread _worker;
+};
+
+// One camera's view of a detection_service, with its own cadence.
+class async_detector {
+public:
+    static const int person_class = detection_service::person_class;
+
+    // Detector with a service of its own, for a single camera.
+    async_detector( const std::string& prototxt, const std::string& weights, int every_n_frames = 5,
+                    float min_confidence = 0.5f, int class_filter = person_class )
+        : async_detector( std::make_shared<detection_service>( prototxt, weights, 0.0, min_confidence, class_filter ), every_n_frames ) {}
+
+    // Detector sharing the network, and its batches, with other cameras.
+    async_detector( std::shared_ptr<detection_service> service, int every_n_frames = 5 )
+        : _service( std::move( service ) ), _id( _service->add_source() ), _every_n_frames( std::max( 1, every_n_frames ) ) {}
+
+    // Offers a BGR frame to the detector. Returns true if it was taken for detection.
+    bool submit( const cv::Mat& bgr, uint64_t frame_number, bool scene_changed = false ) {
+        // A scene change seen while busy is remembered for the next frame.
+        _force_next = _force_next || scene_changed;
+        const bool due = _force_next || !_submitted_once || frame_number >= _last_submitted + _every_n_frames;
+        if ( !due || !_service->submit( _id, bgr, frame_number ) )
+            return false;
+
+        _submitted_once = true;
+        _force_next = false;
+        _last_submitted = frame_number;
+        return true;
+    }
+
+    // Most recent detections, null until the first run completes.
+    std::shared_ptr<const detection_result> latest() const {
+        return _service->latest( _id );
+    }
+
+private:
+    std::shared_ptr<detection_service> _service;
+    int _id;
+    int _every_n_frames;
+    bool _submitted_once = false;
+    bool _force_next = false;
+    uint64_t _last_submitted = 0;
+};
@@ -6,87 +6,215 @@
 #include <imgui.h>
 #include "imgui_impl_glfw.h"
 #include "cv-helpers.hpp"
+#include "binary-morphology.hpp"
+#include "depth-background.hpp"
+#include "depth-mask.hpp"
+#include "fast-align.hpp"
+#include "grabcut-segmenter.hpp"
+#include "object-detector.hpp"
 #include "example.hpp"
 
+#include <memory>
+#include <string>
+#include <vector>
+
 using namespace cv;
 using namespace rs2;
 
-int main( int argc, char* argv[] )try {
-    // Define colorizer and align processing blocks.
-    colorizer colorize;
-    align align_to( RS2_STREAM_COLOR );
+// Command line options.
+const char* usage = "Usage: remove_background [--near METERS --far METERS | --near-percentile F --far-percentile F | --background-model] [--grabcut-budget MS] [--warm-start] [--regions] [--detector WEIGHTS [--detector-proto PROTOTXT] [--detect-every N]] [--all-cameras [--batch-latency MS]]";
+struct app_options {
+    // By default the masks split the scene by depth percentiles, which follow the scene like the old
+    // thresholds on the histogram-equalized colorizer output did (180 and 100 out of 255).
+    bool use_meters = false;
+    float near_meters = 0.f;
+    float far_meters = 0.f;
+    float near_percentile = 1.f - 180.f / 255.f;
+    float far_percentile = 1.f - 100.f / 255.f;
+    bool background_model = false;  // Near is what is closer than the learned background, see depth-background.hpp.
+    float grabcut_budget_ms = 0.f;  // 0 runs GrabCut at full resolution, see grabcut-segmenter.hpp.
+    bool warm_start = false;        // Keep GrabCut color models between frames until the scene changes.
+    bool regions = false;           // Only run GrabCut on boxes around the near blobs.
+    std::string detector_weights;   // MobileNet-SSD caffemodel, no person detection if empty.
+    std::string detector_proto = "MobileNetSSD_deploy.prototxt";
+    int detect_every = 5;
+    bool all_cameras = false;       // One window per connected camera, sharing the detector.
+    float batch_latency_ms = 15.f;  // How long the detector waits for the other cameras' frames to batch them.
+};
+
+// Everything one camera needs, so several cameras can share the display loop and the detection network.
+struct camera {
+    explicit camera( const app_options& options )
+        : align_to( RS2_STREAM_COLOR ), segmenter( options.grabcut_budget_ms ) {
+        segmenter.set_warm_start( options.warm_start );
+    }
 
-    // Start the camera.
     pipeline pipe;
-    pipe.start();
+    std::string window_name;
+    float depth_scale = 0.f;
+
+    // fast_align gives the same result as rs2::align, but caches the deprojection tables between frames.
+    fast_align align_to;
+
+    // Near and far masks are built straight from depth into bits, and cleaned up there, see binary-morphology.hpp.
+    depth_histogram histogram{ 8 };
+    binary_morphology morphology;
+    bit_mask near, far;
+
+    // Used instead of the thresholds with --background-model.
+    depth_background background;
+    std::vector<uint16_t> foreground_depth;
+
+    // Runs GrabCut on a smaller image when the full resolution one does not fit in the time budget.
+    grabcut_segmenter segmenter;
+    Mat mask, foreground_mask, seed_scratch;
+
+    // The refined mask as spans of foreground, so compositing only touches the pixels it keeps.
+    bit_mask foreground_bits;
+    mask_runs foreground_runs;
+
+    // Person boxes narrow down where GrabCut looks. The detector runs on its own thread, the frame loop
+    // only ever uses the latest boxes it published.
+    std::unique_ptr<async_detector> detector;
+    uint64_t frame_number = 0;
+    int model_resets = 0;
+};
+
+app_options parse_options( int argc, char* argv[] );
+
+int main( int argc, char* argv[] )try {
+    app_options options = parse_options( argc, argv );
+
+    // Converted color and output images are written to pooled buffers, never to the SDK frames.
+    frame_pool pool;
+
+    // Start the cameras: the first one found, or every connected one.
+    context ctx;
+    std::vector<std::string> serials;
+    if ( options.all_cameras ) {
+        for ( auto&& dev : ctx.query_devices() )
+            serials.push_back( dev.get_info( RS2_CAMERA_INFO_SERIAL_NUMBER ) );
+        if ( serials.empty() )
+            throw std::runtime_error( "No camera connected" );
+    }
+    else
+        serials.push_back( "" );
+
+    // With several cameras, one network sees the frames of all of them in a single batch.
+    std::shared_ptr<detection_service> detection;
+    if ( !options.detector_weights.empty() )
+        detection = std::make_shared<detection_service>( options.detector_proto, options.detector_weights, options.batch_latency_ms );
+
+    std::vector<std::unique_ptr<camera>> cameras;
+    for ( auto& serial : serials ) {
+        std::unique_ptr<camera> cam( new camera( options ) );
+        config cfg;
+        if ( !serial.empty() )
+            cfg.enable_device( serial );
+        cam->pipe = pipeline( ctx );
+        pipeline_profile profile = cam->pipe.start( cfg );
+        cam->depth_scale = profile.get_device().first<depth_sensor>().get_depth_scale();
+        cam->window_name = serial.empty() ? "Display Image" : "Display Image " + serial;
+        if ( detection )
+            cam->detector.reset( new async_detector( detection, options.detect_every ) );
+        namedWindow( cam->window_name, WINDOW_AUTOSIZE );
+        cameras.push_back( std::move( cam ) );
+    }
 
-    const auto window_name = "Display Image";
-    namedWindow( window_name, WINDOW_AUTOSIZE );
-    // We are using StructuringElement for erode/dilate operations.
+    // Rectangular structuring elements for erode/dilate operations.
     auto gen_element = []( int erosion_size ) {
-        return getStructuringElement( MORPH_RECT,
-                                      Size( erosion_size + 1, erosion_size + 1 ),
-                                      Point( erosion_size, erosion_size ) );
+        return make_rect_element( erosion_size + 1, erosion_size + 1, erosion_size, erosion_size );
     };
 
     const int erosion_size = 3;
     auto erode_less = gen_element( erosion_size );
     auto erode_more = gen_element( erosion_size * 2 );
 
-    // The following operation is taking grayscale image,
-    // performs treshold on it, closes small holes and erodes the white area.
-    auto create_mask_from_depth = [&]( Mat & depth, int tresh, cv::ThresholdTypes type ) {
-        cv::threshold( depth, depth, tresh, 255, type );
-        dilate( depth, depth, erode_less );
-        erode( depth, depth, erode_more );
-    };
-
-    // Skip some frames to allow auto_exposure to stabilize.
-    for ( int i = 0; i < 10; i++ ) pipe.wait_for_frames();
-
-    while ( getWindowProperty( window_name, WND_PROP_AUTOSIZE ) >= 0 ) {
-        frameset data = pipe.wait_for_frames();
+    auto process = [&]( camera & cam, const frameset & data ) {
         // Make sure the frameset is spatialy aligned
         // (each pixel in depth image corresponds to the same pixel in the color image)
-        frameset aligned_set = align_to.process( data );
-        frame depth = aligned_set.get_depth_frame();
-        auto color_mat = frame_to_mat( aligned_set.get_color_frame() );
-
-        // Colorize depth image with white being near and black being far.
-        // This will take adbantage of histogram eq done by the colorizer.
-        colorize.set_option( RS2_OPTION_COLOR_SCHEME, 2 );
-        frame bw_depth = depth.apply_filter( colorize );
-
-        // Generate "near" mask image:
-        auto near = frame_to_mat( bw_depth );
-        cvtColor( near, near, COLOR_BGR2GRAY );
-        // Take just values within range [180-255].
-        // These will roughly correspond to near objects due to histogram eq.
-        create_mask_from_depth( near, 180, THRESH_BINARY );
-
-        // Generate "far" mask image:
-        auto far = frame_to_mat( bw_depth );
-        cvtColor( far, far, COLOR_BGR2GRAY );
-        far.setTo( 255, far == 0 ); // Note: 0 value does not indicate pixel near the camera, and requires special attention.
-        create_mask_from_depth( far, 100, THRESH_BINARY_INV );
+        frameset aligned_set = cam.align_to.process( data );
+        depth_frame depth = aligned_set.get_depth_frame();
+        pooled_frame color_storage;
+        auto color_mat = frame_to_mat( aligned_set.get_color_frame(), pool, color_storage );
+
+        // Generate "near" and "far" masks in one pass over the depth, then close small holes and erode the
+        // white area of both, without leaving the bit-packed representation.
+        // Note: 0 depth does not indicate pixel near the camera, such pixels are in neither mask.
+        const uint16_t* p_depth = reinterpret_cast<const uint16_t*>(depth.get_data());
+        const int width = depth.get_width();
+        const int height = depth.get_height();
+        if ( options.background_model ) {
+            // Near is what stands in front of the learned background, far is the background itself.
+            cam.foreground_depth.resize( static_cast<size_t>(width) * height );
+            cam.background.apply( p_depth, width, height, cam.depth_scale, cam.foreground_depth.data() );
+            cam.morphology.foreground_close_erode( p_depth, cam.foreground_depth.data(), width, height, erode_less, erode_more, cam.near, cam.far );
+        }
+        else {
+            depth_mask_thresholds thresholds = options.use_meters
+                ? depth_mask_thresholds_from_meters( cam.depth_scale, options.near_meters, options.far_meters )
+                : depth_mask_thresholds_from_percentiles( cam.histogram, p_depth, width, height, options.near_percentile, options.far_percentile );
+            cam.morphology.threshold_close_erode( p_depth, width, height, thresholds, erode_less, erode_more, cam.near, cam.far );
+        }
 
         // GrabCut algorithm needs a mask with every pixel marked as either:
         // BGD, FGB, PR_BGD, PR_FGB.
-        Mat mask;
-        mask.create( near.size(), CV_8UC1 );
-        mask.setTo( Scalar::all( GC_BGD ) );    // Set "Background" as default guess
-        mask.setTo( GC_PR_BGD, far == 0 );      // Relax this to "probably background" for pixels outside "far" region.
-        mask.setTo( GC_FGD, near == 255 );      // Set pixels withing the "near" region to "foreground"
+        // "Background" is the default guess, relaxed to "probably background" outside of the "far" region,
+        // and pixels within the "near" region are "foreground".
+        Mat& mask = cam.mask;
+        labels_from_depth_masks( cam.near, cam.far, mask );
+
+        if ( cam.detector ) {
+            // Re-detect right away when the segmenter saw the scene change.
+            cam.detector->submit( color_mat, cam.frame_number, cam.segmenter.model_resets() != cam.model_resets );
+            cam.model_resets = cam.segmenter.model_resets();
+            if ( auto detected = cam.detector->latest() ) {
+                std::vector<Rect> boxes;
+                for ( auto& d : detected->detections )
+                    boxes.push_back( d.box );
+                seed_labels_from_boxes( mask, boxes, 16, cam.seed_scratch );
+            }
+        }
+        cam.frame_number++;
 
         // Run Grab-Cut algorithm:
-        Mat bgModel, fgModel;
-        grabCut( color_mat, mask, Rect(), bgModel, fgModel, 1, GC_INIT_WITH_MASK );
+        if ( options.regions )
+            cam.segmenter.segment_regions( color_mat, mask, cam.foreground_mask );
+        else
+            cam.segmenter.segment( color_mat, mask, cam.foreground_mask );
+
+        // Extract foreground pixels based on refined mask from the algorithm: copy its runs, clear the gaps.
+        mat_to_bit_mask( cam.foreground_mask, cam.foreground_bits );
+        cam.foreground_runs.encode( cam.foreground_bits );
+        pooled_frame foreground_storage = pool.acquire( color_mat.cols, color_mat.rows, 3 );
+        Mat3b foreground( color_mat.rows, color_mat.cols, reinterpret_cast<Vec3b*>(foreground_storage.data()), foreground_storage.stride() );
+        CV_Assert( color_mat.isContinuous() );
+        cam.foreground_runs.composite( color_mat.data, foreground_storage.data(), 3 );
+
+        imshow( cam.window_name, foreground );
+    };
 
-        // Extract foreground pixels based on refined mask from the algorithm.
-        Mat3b foreground = Mat3b::zeros( color_mat.rows, color_mat.cols );
-        color_mat.copyTo( foreground, (mask == GC_FGD) | (mask == GC_PR_FGD) );
+    // Skip some frames to allow auto_exposure to stabilize.
+    for ( auto& cam : cameras )
+        for ( int i = 0; i < 10; i++ ) cam->pipe.wait_for_frames();
+
+    auto windows_open = [&] {
+        for ( auto& cam : cameras )
+            if ( getWindowProperty( cam->window_name, WND_PROP_AUTOSIZE ) < 0 )
+                return false;
+        return true;
+    };
 
-        imshow( window_name, foreground );
+    while ( windows_open() ) {
+        for ( auto& cam : cameras ) {
+            // A single camera can block on its frames, several cameras must not wait for each other.
+            frameset data;
+            if ( cameras.size() == 1 )
+                data = cam->pipe.wait_for_frames();
+            else if ( !cam->pipe.poll_for_frames( &data ) )
+                continue;
+            process( *cam, data );
+        }
         waitKey( 1 );
     }
 }
@@ -98,3 +226,69 @@ catch ( const std::exception & e ) {
     std::cerr << e.what() << std::endl;
     return EXIT_FAILURE;
 }
+
+app_options parse_options( int argc, char* argv[] ) {
+    app_options options;
+    bool near_set = false;
+    bool far_set = false;
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg = argv[i];
+        if ( arg == "--warm-start" ) {
+            options.warm_start = true;
+            continue;
+        }
+        if ( arg == "--regions" ) {
+            options.regions = true;
+            continue;
+        }
+        if ( arg == "--all-cameras" ) {
+            options.all_cameras = true;
+            continue;
+        }
+        if ( arg == "--background-model" ) {
+            options.background_model = true;
+            continue;
+        }
+        if ( i + 1 >= argc )
+            throw std::invalid_argument( "Missing value for " + arg + "\n" + usage );
+        std::string text = argv[++i];
+
+        if ( arg == "--detector" ) {
+            options.detector_weights = text;
+            continue;
+        }
+        if ( arg == "--detector-proto" ) {
+            options.detector_proto = text;
+            continue;
+        }
+        if ( arg == "--detect-every" ) {
+            options.detect_every = std::stoi( text );
+            continue;
+        }
+
+        float value = std::stof( text );
+        if ( arg == "--near" ) {
+            options.near_meters = value;
+            near_set = true;
+        }
+        else if ( arg == "--far" ) {
+            options.far_meters = value;
+            far_set = true;
+        }
+        else if ( arg == "--near-percentile" )
+            options.near_percentile = value;
+        else if ( arg == "--far-percentile" )
+            options.far_percentile = value;
+        else if ( arg == "--grabcut-budget" )
+            options.grabcut_budget_ms = value;
+        else if ( arg == "--batch-latency" )
+            options.batch_latency_ms = value;
+        else
+            throw std::invalid_argument( "Unknown option " + arg + "\n" + usage );
+    }
+
+    if ( near_set != far_set )
+        throw std::invalid_argument( std::string( "--near and --far must be given together\n" ) + usage );
+    options.use_meters = near_set;
+    return options;
+}
@@ -0,0 +1,294 @@
+// recording-test.cpp : Writes recordings of frames made up by the test, reads them back and compares.
+//
+// Frames are given to the writer as recording_frame, no camera or SDK call needed: a Z16 depth stream, with
+// holes and 12-bit values like a camera's, a smooth RGB8 color stream with padded rows, which color_codec
+// compresses, and a Y8 infrared stream of noise, which it can not and is kept raw. Several threads write them at
+// once, in chunks small enough that some are waiting for their turn to be written while others are being filled.
+// A recording cut short, as left by a crash, must be refused by the reader.
+#include "recording.hpp"
+#include "test-harness.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using test_harness::check;
+
+namespace {
+    const int width = 64;
+    const int height = 48;
+    const int frame_count = 120;
+    const double depth_start_ms = 1000.0;
+    const double color_offset_ms = 5.0;
+    const double infrared_offset_ms = 10.0;
+    const double frame_ms = 33.0;
+    const float depth_units = 0.001f;
+
+    // The frames of a stream, kept until the recording is read back.
+    struct test_stream {
+        recording_stream description;
+        int stride = 0;
+        double start_ms = 0;
+        std::vector<std::vector<uint8_t>> pixels;       // Rows of stride bytes, the padding is noise.
+        std::vector<std::vector<recording_metadata>> metadata;
+
+        frame_codec codec;                              // How the writer should store the pixels.
+
+        test_stream( rs2_stream type, rs2_format format, int bpp, int padding, double start, frame_codec stored_as )
+            : stride( width * bpp + padding ), start_ms( start ), codec( stored_as ) {
+            description.type = type;
+            description.format = format;
+            description.width = width;
+            description.height = height;
+            description.bytes_per_pixel = bpp;
+            description.depth_scale = type == RS2_STREAM_DEPTH ? depth_units : 0.f;
+            description.intrinsics = { width, height, width / 2.f, height / 2.f, 60.f, 60.f, RS2_DISTORTION_NONE, { 0, 0, 0, 0, 0 } };
+        }
+
+        recording_frame frame( int i ) const {
+            recording_frame f;
+            f.pixels = pixels[i].data();
+            f.stride = stride;
+            f.frame_number = static_cast<uint64_t>(i);
+            f.timestamp = start_ms + i * frame_ms;
+            f.metadata = metadata[i].data();
+            f.metadata_count = metadata[i].size();
+            return f;
+        }
+
+        // The pixels of frame i without the padding, as the reader returns them.
+        std::vector<uint8_t> packed( int i ) const {
+            const size_t row_bytes = static_cast<size_t>(width) * description.bytes_per_pixel;
+            std::vector<uint8_t> rows( row_bytes * height );
+            for ( int y = 0; y < height; y++ )
+                std::copy( &pixels[i][static_cast<size_t>(y) * stride], &pixels[i][static_cast<size_t>(y) * stride] + row_bytes, &rows[row_bytes * y] );
+            return rows;
+        }
+    };
+
+    test_stream make_depth( std::mt19937& rng ) {
+        test_stream s( RS2_STREAM_DEPTH, RS2_FORMAT_Z16, 2, 0, depth_start_ms, frame_codec::rvl );
+        for ( int i = 0; i < frame_count; i++ ) {
+            std::vector<uint8_t> pixels( static_cast<size_t>(s.stride) * height );
+            uint16_t* depth = reinterpret_cast<uint16_t*>(pixels.data());
+            for ( int j = 0; j < width * height; j++ )
+                depth[j] = rng() % 4 == 0 ? 0 : static_cast<uint16_t>(rng() % 4096);
+            s.pixels.push_back( std::move( pixels ) );
+            s.metadata.push_back( { { RS2_FRAME_METADATA_FRAME_COUNTER, i } } );
+        }
+        return s;
+    }
+
+    // Gradients with a little noise, and a bright square moving across them.
+    test_stream make_color( std::mt19937& rng ) {
+        test_stream s( RS2_STREAM_COLOR, RS2_FORMAT_RGB8, 3, 8, depth_start_ms + color_offset_ms, frame_codec::color );
+        for ( int i = 0; i < frame_count; i++ ) {
+            std::vector<uint8_t> pixels( static_cast<size_t>(s.stride) * height );
+            for ( int y = 0; y < height; y++ ) {
+                for ( int x = 0; x < s.stride; x++ ) {
+                    const int c = x % 3;
+                    const bool square = x / 3 >= i % width && x / 3 < i % width + 8 && y >= 20 && y < 28;
+                    pixels[static_cast<size_t>(y) * s.stride + x] = static_cast<uint8_t>(square ? 250 - c : 2 * x / 3 + 3 * y + 40 * c + rng() % 3);
+                }
+            }
+            s.pixels.push_back( std::move( pixels ) );
+            s.metadata.push_back( { { RS2_FRAME_METADATA_FRAME_COUNTER, i }, { RS2_FRAME_METADATA_ACTUAL_EXPOSURE, -1000 * i } } );
+        }
+        return s;
+    }
+
+    test_stream make_infrared( std::mt19937& rng ) {
+        test_stream s( RS2_STREAM_INFRARED, RS2_FORMAT_Y8, 1, 0, depth_start_ms + infrared_offset_ms, frame_codec::raw );
+        for ( int i = 0; i < frame_count; i++ ) {
+            std::vector<uint8_t> pixels( static_cast<size_t>(s.stride) * height );
+            for ( auto& p : pixels )
+                p = static_cast<uint8_t>(rng());
+            s.pixels.push_back( std::move( pixels ) );
+            s.metadata.push_back( {} );
+        }
+        return s;
+    }
+
+    size_t file_size( const std::string& filename ) {
+        std::ifstream file( filename, std::ios::binary | std::ios::ate );
+        return static_cast<size_t>(file.tellg());
+    }
+
+    struct test_streams {
+        test_stream depth, color, infrared;
+
+        explicit test_streams( std::mt19937& rng )
+            : depth( make_depth( rng ) ), color( make_color( rng ) ), infrared( make_infrared( rng ) ) {}
+    };
+
+    // Writes the streams from several threads, a chunk holds a few frames.
+    void write_recording( const std::string& filename, const test_streams& streams ) {
+        recording_writer writer( filename, 16 << 10 );
+        const test_stream* all[] = { &streams.depth, &streams.color, &streams.infrared };
+        uint32_t ids[3];
+        for ( int s = 0; s < 3; s++ )
+            ids[s] = writer.add_stream( all[s]->description );
+        const int threads = 4;
+        std::atomic<int> refused( 0 );
+        std::vector<std::thread> writers;
+        for ( int t = 0; t < threads; t++ ) {
+            writers.emplace_back( [&, t] {
+                recording_scratch scratch;
+                for ( int i = t; i < frame_count; i += threads ) {
+                    for ( int s = 0; s < 3; s++ )
+                        refused += !writer.write( ids[s], all[s]->frame( i ), scratch );
+                }
+            } );
+        }
+        for ( auto& thread : writers )
+            thread.join();
+        writer.close();
+        check( refused == 0, std::to_string( refused.load() ) + " frames refused by the writer" );
+        check( writer.frames() == static_cast<size_t>(3 * frame_count), "the writer counted " + std::to_string( writer.frames() ) + " frames" );
+        check( writer.bytes() == file_size( filename ), "the writer's byte count is not the file size" );
+    }
+
+    // Reads back every frame of a stream, found by seeking to its timestamp.
+    void check_stream( const recording_reader& reader, const test_stream& expected, const std::string& name ) {
+        const int stream = reader.find_stream( expected.description.type );
+        check( stream >= 0, name + " stream missing" );
+        if ( stream < 0 )
+            return;
+        const recording_stream& s = reader.streams()[stream];
+        check( s.format == expected.description.format && s.width == width && s.height == height
+               && s.bytes_per_pixel == expected.description.bytes_per_pixel, name + " stream has the wrong format" );
+        check( s.depth_scale == expected.description.depth_scale, name + " stream has the wrong depth scale" );
+        check( s.intrinsics.fx == 60.f && s.intrinsics.ppx == width / 2.f, name + " stream lost its intrinsics" );
+        check( s.entry_count == static_cast<uint64_t>(frame_count), name + " stream has " + std::to_string( s.entry_count ) + " frames" );
+
+        rvl_codec depth_codec;
+        color_codec color_codec;
+        std::vector<uint8_t> pixels;
+        for ( int i = 0; i < frame_count; i++ ) {
+            const std::string what = name + " frame " + std::to_string( i );
+            const size_t entry = reader.seek( static_cast<uint32_t>(stream), expected.start_ms + i * frame_ms );
+            recorded_frame frame;
+            if ( !reader.frame( entry, frame ) || frame.frame_number != static_cast<uint64_t>(i) ) {
+                check( false, what + " not found at its timestamp" );
+                continue;
+            }
+            check( frame.timestamp == expected.start_ms + i * frame_ms, what + " has the wrong timestamp" );
+            check( frame.codec == expected.codec, what + " is not stored as expected" );
+            check( reader.decode( frame, pixels, depth_codec, color_codec ) && pixels == expected.packed( i ), what + " differs" );
+            check( frame.metadata_count == expected.metadata[i].size(), what + " has the wrong number of metadata" );
+            for ( auto& m : expected.metadata[i] ) {
+                rs2_metadata_type value = 0;
+                check( frame.get_metadata( m.id, value ) && value == m.value, what + " lost a metadata value" );
+            }
+        }
+    }
+
+    void test_round_trip() {
+        const std::string filename = "recording-test.rsrec";
+        std::mt19937 rng( 1 );
+        const test_streams streams( rng );
+        write_recording( filename, streams );
+
+        {
+            recording_reader reader( filename );
+            check( reader.streams().size() == 3, "expected three streams" );
+            check( reader.entry_count() == static_cast<size_t>(3 * frame_count), "index has " + std::to_string( reader.entry_count() ) + " entries" );
+            check_stream( reader, streams.depth, "depth" );
+            check_stream( reader, streams.color, "color" );
+            check_stream( reader, streams.infrared, "infrared" );
+        }
+        // The file can only be removed once it is unmapped.
+        std::remove( filename.c_str() );
+    }
+
+    // Timestamps between frames, before the first and after the last.
+    void check_seek( const std::string& filename, const test_stream& color ) {
+        recording_reader reader( filename );
+        const int stream = reader.find_stream( RS2_STREAM_COLOR );
+        check( stream >= 0, "color stream missing" );
+        if ( stream < 0 )
+            return;
+        const uint32_t id = static_cast<uint32_t>(stream);
+        const size_t first = reader.streams()[stream].first_entry;
+        check( reader.seek( id, 0.0 ) == first, "seeking before the first frame did not find it" );
+        for ( int i = 1; i < frame_count; i++ ) {
+            const size_t entry = reader.seek( id, color.start_ms + (i - 0.5) * frame_ms );
+            check( entry == first + i && reader.entry( entry ).frame_number == static_cast<uint64_t>(i),
+                   "seeking before frame " + std::to_string( i ) + " did not find it" );
+        }
+        check( reader.seek( id, color.start_ms + (frame_count - 1) * frame_ms + 1.0 ) == reader.entry_count(), "seeking past the end found a frame" );
+        check( reader.seek( 3, color.start_ms ) == reader.entry_count(), "seeking an unknown stream found a frame" );
+        check( reader.find_stream( RS2_STREAM_FISHEYE ) == -1, "found a stream that was not recorded" );
+    }
+
+    void test_seek() {
+        const std::string filename = "recording-test-seek.rsrec";
+        std::mt19937 rng( 2 );
+        const test_streams streams( rng );
+        write_recording( filename, streams );
+
+        check_seek( filename, streams.color );
+        std::remove( filename.c_str() );
+    }
+
+    // A copy cut before its footer, as left by a crash, and one cut in the middle of its chunks.
+    void test_truncated() {
+        const std::string filename = "recording-test-truncated.rsrec";
+        std::mt19937 rng( 3 );
+        write_recording( filename, test_streams( rng ) );
+        std::vector<char> bytes;
+        {
+            std::ifstream original( filename, std::ios::binary );
+            bytes.assign( std::istreambuf_iterator<char>( original ), std::istreambuf_iterator<char>() );
+        }
+
+        const size_t cuts[] = { bytes.size() - recording_footer_size, bytes.size() - 1, bytes.size() / 2, recording_header_size };
+        for ( size_t cut : cuts ) {
+            std::ofstream( filename, std::ios::binary | std::ios::trunc ).write( bytes.data(), cut );
+            bool thrown = false;
+            try {
+                recording_reader reader( filename );
+            }
+            catch ( const std::runtime_error& ) {
+                thrown = true;
+            }
+            check( thrown, "a recording cut to " + std::to_string( cut ) + " bytes was read" );
+        }
+        std::remove( filename.c_str() );
+    }
+
+    void test_closed_writer() {
+        const std::string filename = "recording-test-closed.rsrec";
+        std::mt19937 rng( 4 );
+        const test_stream depth = make_depth( rng );
+        recording_writer writer( filename );
+        const uint32_t id = writer.add_stream( depth.description );
+        recording_scratch scratch;
+        check( writer.write( id, depth.frame( 0 ), scratch ), "the first frame was refused" );
+        check( !writer.write( id + 1, depth.frame( 1 ), scratch ), "a frame of an unknown stream was written" );
+        writer.close();
+        check( !writer.write( id, depth.frame( 1 ), scratch ), "a frame was written after close()" );
+        check( writer.frames() == 1, "the writer counted " + std::to_string( writer.frames() ) + " frames" );
+
+        {
+            recording_reader reader( filename );
+            check( reader.entry_count() == 1, "index has " + std::to_string( reader.entry_count() ) + " entries" );
+        }
+        std::remove( filename.c_str() );
+    }
+}
+
+int main() {
+    return test_harness::run_tests( {
+        { "recording round trip", test_round_trip },
+        { "recording seek", test_seek },
+        { "recording truncated", test_truncated },
+        { "recording closed writer", test_closed_writer },
+    } );
+}
@@ -0,0 +1,60 @@
+// test-harness.hpp : What the tests of the solution share, a test is a function calling check().
+//
+// A failed check is reported with the name of its test and the test goes on, an exception ends the test and
+// counts as one more failure. run_tests() runs every test in order and returns the exit code of the program,
+// which the post-build step of the tests project checks.
+#pragma once
+
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace test_harness {
+    struct test_case {
+        std::string name;
+        std::function<void()> run;
+    };
+
+    struct state {
+        std::string current;
+        int failures = 0;
+    };
+
+    inline state& current_state() {
+        static state s;
+        return s;
+    }
+
+    inline void check( bool condition, const std::string& what ) {
+        if ( condition )
+            return;
+        state& s = current_state();
+        std::cerr << s.current << ": FAILED " << what << std::endl;
+        s.failures++;
+    }
+
+    inline int run_tests( const std::vector<test_case>& tests ) {
+        state& s = current_state();
+        for ( auto& test : tests ) {
+            s.current = test.name;
+            const int before = s.failures;
+            try {
+                test.run();
+            }
+            catch ( const std::exception& e ) {
+                std::cerr << test.name << ": FAILED with an exception: " << e.what() << std::endl;
+                s.failures++;
+            }
+            std::cout << (s.failures == before ? "passed " : "FAILED ") << test.name << std::endl;
+        }
+        if ( s.failures ) {
+            std::cerr << s.failures << " checks failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "All " << tests.size() << " tests passed" << std::endl;
+        return EXIT_SUCCESS;
+    }
+}